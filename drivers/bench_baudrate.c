@@ -0,0 +1,198 @@
+/**
+	Philip Romano
+	Baud rate sweep for UART
+
+	Sends a test pattern through a loopback at a series of baud rates,
+	standard and not, and checks that it comes back intact, to find the
+	fastest rate a link runs cleanly at.
+
+	With -d, the device given must have its Tx wired to its Rx (or be a
+	USB adapter looped the same way). Without it, the driver runs on a
+	pseudo-terminal whose master side echoes everything back; a pty is not
+	paced by its baud rate, so that only checks that each rate is accepted
+	and applied.
+
+	Results are written as CSV, one row per rate:
+
+	  requested,applied,bytes,seconds,mb_per_s,line_utilization,errors,lost
+
+	applied is the rate the kernel reports (see uart_getBaudRate());
+	line_utilization is the throughput over the applied rate's 10 bits per
+	byte; errors counts bytes that came back wrong, lost those that never
+	came back.
+
+	Usage: bench_baudrate.x [-q] [-d device] [-o file]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "uart.h"
+#include "ptyharness.h"
+
+// Half a second of data at each rate, but never less than this
+#define MIN_BYTES 4096
+
+// Bytes in flight at once, well within the driver's queues
+#define WINDOW 4096
+
+// Time without progress after which the rest is counted as lost
+#define TIMEOUT_MS 1000
+
+static size_t loopback(struct UART *uart, size_t total, size_t *errors);
+static double now();
+
+int main(int argc, char **argv) {
+	const char *device = NULL;
+	FILE *out = stdout;
+	int   quick = 0, opt;
+
+	while ((opt = getopt(argc, argv, "qd:o:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quick = 1;
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			case 'o':
+				out = fopen(optarg, "w");
+				if (!out) {
+					fprintf(stderr, "Could not open %s for writing\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-q] [-d device] [-o file]\n",
+						argv[0]);
+				return 1;
+		}
+	}
+
+	// Standard rates, plus some only reachable through termios2
+	int rates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 250000,
+	                460800, 500000, 921600, 1000000, 1500000, 1843200,
+	                2000000, 3000000, 4000000 };
+
+	fprintf(out, "requested,applied,bytes,seconds,mb_per_s,line_utilization,"
+			"errors,lost\n");
+
+	size_t r;
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); ++r) {
+		char        slavepath[64];
+		const char *path = device;
+		struct PtyPeer echo;
+		struct PtyStep echostep = { PTY_ECHO, NULL, 0 };
+		int            master = -1;
+
+		if (!device) {
+			master = pty_open(slavepath, sizeof(slavepath));
+			if (master == -1) {
+				fprintf(stderr, "Could not open a pseudo-terminal\n");
+				return 1;
+			}
+			path = slavepath;
+		}
+
+		struct UARTOptions options;
+		uart_defaultOptions(&options);
+		options.rxmode = UART_RXTHREAD;
+		struct UART *uart = uart_openWithOptions(path, rates[r],
+				UART_PARDISABLE, &options);
+		if (!uart) {
+			fprintf(stderr, "%d: %s\n", rates[r], uart_getLastError());
+			if (!device)
+				close(master);
+			continue;
+		}
+
+		if (!device)
+			pty_startPeer(&echo, master, &echostep, 1);
+
+		size_t total = rates[r] / 10 / 2, errors = 0;
+		if (quick)
+			total /= 16;
+		if (total < MIN_BYTES)
+			total = MIN_BYTES;
+
+		double start = now();
+		size_t received = loopback(uart, total, &errors);
+		double seconds = now() - start;
+		int applied = uart_hgetBaudRate(uart);
+
+		uart_close(uart);
+		if (!device) {
+			pty_stopPeer(&echo, 0);
+			close(master);
+		}
+
+		fprintf(out, "%d,%d,%zu,%.6f,%.3f,%.3f,%zu,%zu\n", rates[r], applied,
+				total, seconds, received / seconds / 1e6,
+				received / seconds / (applied / 10.0), errors,
+				total - received);
+		fflush(out);
+	}
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+/**
+	Send total bytes of a counting pattern and read them back, keeping at
+	most WINDOW bytes in flight. Returns the number of bytes received;
+	those that did not match the pattern are counted in errors.
+*/
+size_t loopback(struct UART *uart, size_t total, size_t *errors) {
+	uint8_t pattern[WINDOW], buffer[WINDOW];
+	size_t  sent = 0, received = 0, i;
+	struct pollfd pfd;
+
+	pfd.fd = uart_hgetEventFd(uart);
+	pfd.events = POLLIN;
+
+	while (received < total) {
+		if (sent < total && sent - received < WINDOW) {
+			size_t len = WINDOW - (sent - received);
+			if (len > total - sent)
+				len = total - sent;
+			for (i = 0; i < len; ++i)
+				pattern[i] = (uint8_t)((sent + i) * 7);
+			sent += uart_hwrite(uart, pattern, len);
+		}
+
+		int bytes = uart_hread(uart, buffer, sizeof(buffer));
+		if (bytes == 0) {
+			int ready = poll(&pfd, 1, TIMEOUT_MS);
+			if (ready == -1 && errno == EINTR)
+				continue;
+			if (ready <= 0)
+				break;
+
+			uint64_t events;
+			read(pfd.fd, &events, sizeof(events));
+			continue;
+		}
+
+		for (i = 0; i < (size_t)bytes; ++i)
+			if (buffer[i] != (uint8_t)((received + i) * 7))
+				++*errors;
+		received += bytes;
+	}
+
+	return received;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,250 @@
+/**
+	Philip Romano
+	Throughput benchmark for the framing layer
+
+	For each payload size:
+
+	  encode   - fr_encode into memory
+	  decode   - fr_decode over a stream of encoded frames in memory
+	  loopback - fr_write through the UART driver on a pseudo-terminal whose
+	             master side echoes everything back, and fr_read of the
+	             frames as they return (encode, both queues and decode)
+
+	Results are written as CSV, one row per run, counting payload bytes:
+
+	  benchmark,payload,frames,seconds,mb_per_s,dropped
+
+	dropped is the number of frames that failed to decode (loopback only).
+
+	Usage: bench_framing.x [-q] [-o file]
+	  -q  quick run with 1/16 of the data
+	  -o  write results to file instead of standard output
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "framing.h"
+#include "ptyharness.h"
+
+// Payload bytes per run
+#define MEMORY_BYTES   (64 * 1024 * 1024)
+#define LOOPBACK_BYTES (8 * 1024 * 1024)
+
+// Encoded frames held in memory for the decode run
+#define STREAM_BYTES (1024 * 1024)
+
+// Frames in flight at once in the loopback run
+#define WINDOW 16
+
+// Time without progress after which the loopback run gives up
+#define TIMEOUT_MS 1000
+
+static double benchEncode(size_t payload, size_t frames);
+static double benchDecode(size_t payload, size_t frames);
+static double benchLoopback(size_t payload, size_t frames, size_t *dropped);
+static void   fillPayload(uint8_t *payload, size_t len);
+static double now();
+
+// Keeps the compiler from discarding work whose result is not used
+static volatile size_t sink;
+
+int main(int argc, char **argv) {
+	FILE *out = stdout;
+	int   quick = 0, opt;
+
+	while ((opt = getopt(argc, argv, "qo:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quick = 1;
+				break;
+			case 'o':
+				out = fopen(optarg, "w");
+				if (!out) {
+					fprintf(stderr, "Could not open %s for writing\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-q] [-o file]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	size_t payloads[] = { 16, 64, 256, 1024 };
+	size_t memory = quick ? MEMORY_BYTES / 16 : MEMORY_BYTES,
+	       loopback = quick ? LOOPBACK_BYTES / 16 : LOOPBACK_BYTES;
+
+	fprintf(out, "benchmark,payload,frames,seconds,mb_per_s,dropped\n");
+
+	size_t p;
+	for (p = 0; p < sizeof(payloads) / sizeof(payloads[0]); ++p) {
+		size_t payload = payloads[p],
+		       frames = memory / payload,
+		       dropped = 0;
+		double seconds;
+
+		seconds = benchEncode(payload, frames);
+		fprintf(out, "encode,%zu,%zu,%.6f,%.1f,0\n", payload, frames, seconds,
+				frames * payload / seconds / 1e6);
+
+		seconds = benchDecode(payload, frames);
+		fprintf(out, "decode,%zu,%zu,%.6f,%.1f,0\n", payload, frames, seconds,
+				frames * payload / seconds / 1e6);
+
+		frames = loopback / payload;
+		seconds = benchLoopback(payload, frames, &dropped);
+		if (seconds < 0)
+			return 1;
+		fprintf(out, "loopback,%zu,%zu,%.6f,%.1f,%zu\n", payload, frames,
+				seconds, frames * payload / seconds / 1e6, dropped);
+		fflush(out);
+	}
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+double benchEncode(size_t payload, size_t frames) {
+	uint8_t data[FR_MAXPAYLOAD], encoded[FR_MAXENCODED];
+	size_t  total = 0, i;
+
+	fillPayload(data, payload);
+
+	double start = now();
+	for (i = 0; i < frames; ++i) {
+		data[0] = (uint8_t)i;
+		total += fr_encode(data, payload, encoded, sizeof(encoded));
+	}
+	double seconds = now() - start;
+
+	sink = total;
+	return seconds;
+}
+
+double benchDecode(size_t payload, size_t frames) {
+	uint8_t data[FR_MAXPAYLOAD];
+	uint8_t *stream = malloc(STREAM_BYTES);
+	size_t  streamlen = 0, perstream = 0;
+
+	// Fill the stream once, then decode it over and over
+	fillPayload(data, payload);
+	while (streamlen + FR_MAXENCODED <= STREAM_BYTES) {
+		data[0] = (uint8_t)perstream++;
+		streamlen += fr_encode(data, payload, stream + streamlen,
+				FR_MAXENCODED);
+	}
+
+	struct FrameDecoder decoder;
+	fr_initDecoder(&decoder);
+
+	size_t decoded = 0, total = 0, pos, used;
+	double start = now();
+	while (decoded < frames) {
+		pos = 0;
+		while (pos < streamlen && decoded < frames) {
+			if (fr_decode(&decoder, stream + pos, streamlen - pos, &used)) {
+				++decoded;
+				total += decoder.length;
+			}
+			pos += used;
+		}
+	}
+	double seconds = now() - start;
+
+	sink = total;
+	free(stream);
+	return seconds;
+}
+
+double benchLoopback(size_t payload, size_t frames, size_t *dropped) {
+	char slavepath[64];
+	struct PtyPeer echo;
+	struct PtyStep echostep = { PTY_ECHO, NULL, 0 };
+
+	int master = pty_open(slavepath, sizeof(slavepath));
+	if (master == -1) {
+		fprintf(stderr, "Could not open a pseudo-terminal\n");
+		return -1;
+	}
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.rxmode = UART_RXTHREAD;
+	struct UART *uart = uart_openWithOptions(slavepath, 115200,
+			UART_PARDISABLE, &options);
+	if (!uart) {
+		fprintf(stderr, "uart_openWithOptions(): %s\n", uart_getLastError());
+		close(master);
+		return -1;
+	}
+	pty_startPeer(&echo, master, &echostep, 1);
+
+	uint8_t data[FR_MAXPAYLOAD];
+	struct FrameDecoder decoder;
+	struct pollfd pfd;
+	size_t sent = 0, received = 0;
+
+	fillPayload(data, payload);
+	fr_initDecoder(&decoder);
+	pfd.fd = uart_hgetEventFd(uart);
+	pfd.events = POLLIN;
+
+	double start = now();
+	while (received + decoder.crcerrors + decoder.truncated < frames) {
+		while (sent < frames && sent - received < WINDOW)
+			if (fr_write(uart, data, payload) == (int)payload)
+				++sent;
+
+		if (fr_read(&decoder, uart)) {
+			++received;
+			continue;
+		}
+
+		int ready = poll(&pfd, 1, TIMEOUT_MS);
+		if (ready == -1 && errno == EINTR)
+			continue;
+		if (ready <= 0)
+			break;
+
+		uint64_t events;
+		read(pfd.fd, &events, sizeof(events));
+	}
+	double seconds = now() - start;
+
+	uart_close(uart);
+	pty_stopPeer(&echo, 0);
+	close(master);
+
+	*dropped = frames - received;
+	return seconds;
+}
+
+/**
+	Fill payload with pseudo-random sensor-like bytes, about one in eight
+	zero, so COBS has blocks of varied length to handle.
+*/
+void fillPayload(uint8_t *payload, size_t len) {
+	uint32_t state = 1;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		state = state * 1103515245 + 12345;
+		payload[i] = (state >> 16) % 8 == 0 ? 0 : (uint8_t)(state >> 24);
+	}
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,511 @@
+/**
+	Philip Romano
+	Benchmarks for QueueBuffer
+
+	Runs each pattern below against every QueueBuffer backend. The first
+	three sweep the push/pop chunk size from 1 byte to 64 KB:
+
+	  burst       - push a 256 KB burst, then pop all of it (like Test 1 of
+	                test_queuebuffer)
+	  interleaved - keep the queue part-full while alternating push and pop
+	                (like Test 2 of test_queuebuffer)
+	  threaded    - a producer thread pushes while a consumer thread pops.
+	                The list backend is not thread-safe, so both threads take
+	                a mutex around each call.
+	  frames-pop  - qb_pop the header and then the body of each XBee frame
+	                into a temporary buffer, validate there, then copy the
+	                payload out (chunk is the payload size)
+	  frames-peek - qb_peek each frame in place, validate it across regions,
+	                copy only the payload out, then qb_consume it
+
+	Results are written as CSV, one row per run:
+
+	  pattern,backend,chunk,ops,bytes,seconds,ns_per_op,mb_per_s,
+	  allocations,frees,peak_queue_bytes,maxrss_kb
+
+	ops counts qb_push and qb_pop calls (frames for the frame patterns).
+	allocations, frees and peak_queue_bytes come from qb_getStats; maxrss_kb
+	is the peak resident size of the whole process up to that row.
+
+	Usage: bench_queuebuffer.x [-q] [-o file]
+	  -q  quick run, moving 1/16 of the data
+	  -o  write results to file instead of standard output
+
+	Frames use the XBee API layout:
+	  0x7E | length (16-bit BE) | payload | checksum (0xFF - sum of payload)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "queuebuffer.h"
+
+#define FRAME_START 0x7E
+#define FRAME_MAX   256
+
+#define CHUNK_MIN   1
+#define CHUNK_MAX   (64 * 1024)
+#define BURST_BYTES (256 * 1024)
+
+// Bytes moved per run (divided by 16 with -q), and a limit on calls so the
+// small-chunk runs finish in reasonable time
+#define RUN_BYTES (64 * 1024 * 1024)
+#define RUN_OPS   (4 * 1024 * 1024)
+
+struct Result {
+	size_t ops,
+	       bytes;
+	double seconds;
+};
+
+typedef void (*PatternFunc)(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result);
+
+static void runBurst(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result);
+static void runInterleaved(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result);
+static void runThreaded(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result);
+static void runFramesPop(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result);
+static void runFramesPeek(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result);
+
+static void  *threadProducer(void *arg);
+static void  *threadConsumer(void *arg);
+static size_t buildStream(uint8_t *stream, size_t framelen);
+static size_t decodePop(struct QueueBuffer *qb, uint8_t *out,
+		uint32_t *digest);
+static size_t decodePeek(struct QueueBuffer *qb, uint8_t *out,
+		uint32_t *digest);
+static double now();
+static long   maxRSS();
+
+// Data pushed by every pattern, and somewhere to pop it to
+static uint8_t source[BURST_BYTES],
+               sink[BURST_BYTES];
+
+int main(int argc, char **argv) {
+	FILE *out = stdout;
+	int   quick = 0, opt;
+
+	while ((opt = getopt(argc, argv, "qo:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quick = 1;
+				break;
+			case 'o':
+				out = fopen(optarg, "w");
+				if (!out) {
+					fprintf(stderr, "Could not open %s for writing\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-q] [-o file]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	size_t i;
+	for (i = 0; i < BURST_BYTES; ++i)
+		source[i] = (uint8_t)i;
+
+	struct {
+		const char  *name;
+		PatternFunc func;
+		int         sweep; // Sweep chunk sizes rather than frame sizes
+	} patterns[] = {
+		{ "burst",       runBurst,       1 },
+		{ "interleaved", runInterleaved, 1 },
+		{ "threaded",    runThreaded,    1 },
+		{ "frames-pop",  runFramesPop,   0 },
+		{ "frames-peek", runFramesPeek,  0 }
+	};
+	QBBackend backends[] = { QB_BACKEND_LIST, QB_BACKEND_RING,
+			QB_BACKEND_MIRROR };
+	const char *backendnames[] = { "list", "ring", "mirror" };
+	size_t framelens[] = { 16, 32, 64, 128, 256 };
+
+	size_t numpatterns = sizeof(patterns) / sizeof(patterns[0]),
+	       numbackends = sizeof(backends) / sizeof(backends[0]),
+	       numframelens = sizeof(framelens) / sizeof(framelens[0]);
+
+	fprintf(out, "pattern,backend,chunk,ops,bytes,seconds,ns_per_op,mb_per_s,"
+			"allocations,frees,peak_queue_bytes,maxrss_kb\n");
+
+	size_t p, b, step;
+	for (p = 0; p < numpatterns; ++p) {
+		for (b = 0; b < numbackends; ++b) {
+			for (step = 0; ; ++step) {
+				size_t chunk;
+				if (patterns[p].sweep) {
+					chunk = (size_t)CHUNK_MIN << (2 * step);
+					if (chunk > CHUNK_MAX)
+						break;
+				} else {
+					if (step >= numframelens)
+						break;
+					chunk = framelens[step];
+				}
+
+				size_t total = quick ? RUN_BYTES / 16 : RUN_BYTES;
+				if (patterns[p].sweep && total / chunk > RUN_OPS)
+					total = chunk * RUN_OPS;
+
+				struct QueueBufferConfig config;
+				struct QueueBuffer *qb;
+				config.backend = backends[b];
+				config.capacity = backends[b] == QB_BACKEND_LIST ? 0 :
+						BURST_BYTES;
+				config.overflow = QB_OVERFLOW_DROP_NEWEST;
+				config.reserve = QB_DEFAULT_RESERVE;
+				if (!qb_initializeWithConfig(&qb, &config)) {
+					fprintf(stderr, "Could not initialize %s QueueBuffer\n",
+							backendnames[b]);
+					return 1;
+				}
+
+				struct Result result;
+				struct QueueBufferStats stats;
+				memset(&result, 0, sizeof(result));
+				patterns[p].func(qb, backends[b] == QB_BACKEND_LIST, chunk,
+						total, &result);
+				qb_getStats(qb, &stats);
+				qb_free(&qb);
+
+				fprintf(out, "%s,%s,%zu,%zu,%zu,%.6f,%.2f,%.1f,%zu,%zu,%zu,%ld\n",
+						patterns[p].name, backendnames[b], chunk, result.ops,
+						result.bytes, result.seconds,
+						result.seconds * 1e9 / result.ops,
+						result.bytes / result.seconds / 1e6,
+						stats.allocations, stats.frees, stats.highwater,
+						maxRSS());
+				fflush(out);
+			}
+		}
+	}
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+/*
+	Chunk size patterns
+*/
+
+void runBurst(struct QueueBuffer *qb, int locked, size_t chunk, size_t total,
+		struct Result *result) {
+	(void)locked; // One thread: nothing to lock against
+
+	double start = now();
+
+	while (result->bytes < total) {
+		size_t i;
+		for (i = 0; i < BURST_BYTES; i += chunk) {
+			qb_push(qb, source + i, chunk);
+			++result->ops;
+		}
+		for (i = 0; i < BURST_BYTES; i += chunk) {
+			qb_pop(qb, sink + i, chunk);
+			++result->ops;
+		}
+		result->bytes += BURST_BYTES;
+	}
+
+	result->seconds = now() - start;
+}
+
+void runInterleaved(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result) {
+	(void)locked; // One thread: nothing to lock against
+
+	// Keep half a burst queued, so pushes and pops work on different nodes
+	// (or distant parts of the ring) and cross their boundaries
+	qb_push(qb, source, BURST_BYTES / 2);
+
+	double start = now();
+	size_t offset = 0;
+
+	while (result->bytes < total) {
+		qb_push(qb, source + offset, chunk);
+		qb_pop(qb, sink + offset, chunk);
+		result->ops += 2;
+		result->bytes += chunk;
+
+		offset += chunk;
+		if (offset + chunk > BURST_BYTES / 2)
+			offset = 0;
+	}
+
+	result->seconds = now() - start;
+}
+
+struct ThreadArgs {
+	struct QueueBuffer *qb;
+	pthread_mutex_t    *lock; // NULL for the lock-free backends
+	size_t             chunk,
+	                   total,
+	                   ops;
+};
+
+void runThreaded(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result) {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct ThreadArgs producer, consumer;
+	pthread_t producerthread, consumerthread;
+
+	producer.qb = consumer.qb = qb;
+	producer.lock = consumer.lock = locked ? &lock : NULL;
+	producer.chunk = consumer.chunk = chunk;
+	producer.total = consumer.total = total;
+	producer.ops = consumer.ops = 0;
+
+	double start = now();
+	pthread_create(&producerthread, NULL, threadProducer, &producer);
+	pthread_create(&consumerthread, NULL, threadConsumer, &consumer);
+	pthread_join(producerthread, NULL);
+	pthread_join(consumerthread, NULL);
+	result->seconds = now() - start;
+
+	result->ops = producer.ops + consumer.ops;
+	result->bytes = total;
+	pthread_mutex_destroy(&lock);
+}
+
+void *threadProducer(void *arg) {
+	struct ThreadArgs *args = (struct ThreadArgs *)arg;
+	size_t sent = 0, offset = 0;
+
+	while (sent < args->total) {
+		size_t len = args->total - sent;
+		if (len > args->chunk)
+			len = args->chunk;
+
+		if (args->lock)
+			pthread_mutex_lock(args->lock);
+		int pushed = qb_push(args->qb, source + offset, len);
+		if (args->lock)
+			pthread_mutex_unlock(args->lock);
+		++args->ops;
+
+		// A full ring stores only what fits; offer the rest again
+		if (pushed <= 0) {
+			sched_yield();
+			continue;
+		}
+		sent += pushed;
+		offset = (offset + pushed) % (BURST_BYTES - CHUNK_MAX);
+	}
+
+	return NULL;
+}
+
+void *threadConsumer(void *arg) {
+	struct ThreadArgs *args = (struct ThreadArgs *)arg;
+	size_t received = 0;
+
+	while (received < args->total) {
+		if (args->lock)
+			pthread_mutex_lock(args->lock);
+		int popped = qb_pop(args->qb, sink, args->chunk);
+		if (args->lock)
+			pthread_mutex_unlock(args->lock);
+		++args->ops;
+
+		if (popped == 0)
+			sched_yield();
+		received += popped;
+	}
+
+	return NULL;
+}
+
+/*
+	Frame decoding patterns
+*/
+
+void runFramesPop(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result) {
+	(void)locked; // One thread: nothing to lock against
+
+	static uint8_t out[FRAME_MAX];
+	size_t   streamlen = buildStream(source, chunk);
+	uint32_t digest = 0;
+
+	while (result->bytes < total) {
+		qb_push(qb, source, streamlen);
+
+		double start = now();
+		result->ops += decodePop(qb, out, &digest);
+		result->seconds += now() - start;
+		result->bytes += streamlen;
+	}
+}
+
+void runFramesPeek(struct QueueBuffer *qb, int locked, size_t chunk,
+		size_t total, struct Result *result) {
+	(void)locked; // One thread: nothing to lock against
+
+	static uint8_t out[FRAME_MAX];
+	size_t   streamlen = buildStream(source, chunk);
+	uint32_t digest = 0;
+
+	while (result->bytes < total) {
+		qb_push(qb, source, streamlen);
+
+		double start = now();
+		result->ops += decodePeek(qb, out, &digest);
+		result->seconds += now() - start;
+		result->bytes += streamlen;
+	}
+}
+
+size_t buildStream(uint8_t *stream, size_t framelen) {
+	size_t pos = 0, i;
+	uint8_t seed = 0;
+
+	while (pos + framelen + 4 <= BURST_BYTES) {
+		uint8_t sum = 0;
+
+		stream[pos++] = FRAME_START;
+		stream[pos++] = (uint8_t)(framelen >> 8);
+		stream[pos++] = (uint8_t)framelen;
+		for (i = 0; i < framelen; ++i) {
+			stream[pos] = seed++;
+			sum += stream[pos++];
+		}
+		stream[pos++] = 0xFF - sum;
+	}
+
+	return pos;
+}
+
+size_t decodePop(struct QueueBuffer *qb, uint8_t *out, uint32_t *digest) {
+	uint8_t header[3],
+	        body[FRAME_MAX + 1];
+	size_t  frames = 0, i;
+
+	while (qb_getSize(qb) >= 3) {
+		qb_pop(qb, header, 3);
+		if (header[0] != FRAME_START)
+			continue;
+
+		size_t len = ((size_t)header[1] << 8) | header[2];
+		if (len > FRAME_MAX)
+			continue;
+		qb_pop(qb, body, len + 1);
+
+		uint8_t sum = 0;
+		for (i = 0; i <= len; ++i)
+			sum += body[i];
+		if (sum != 0xFF)
+			continue;
+
+		memcpy(out, body, len);
+		*digest = *digest * 31 + out[0] + out[len - 1];
+		++frames;
+	}
+
+	return frames;
+}
+
+size_t decodePeek(struct QueueBuffer *qb, uint8_t *out, uint32_t *digest) {
+	struct iovec iov[2];
+	size_t frames = 0;
+	int    count;
+
+	while ((count = qb_peek(qb, iov, 2)) > 0) {
+		const uint8_t *r0 = (const uint8_t *)iov[0].iov_base;
+		size_t avail = iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0);
+		if (avail < 3)
+			break;
+
+		// Header bytes, which may straddle the two regions
+		uint8_t header[3];
+		size_t  i;
+		for (i = 0; i < 3; ++i)
+			header[i] = i < iov[0].iov_len ? r0[i] :
+					((const uint8_t *)iov[1].iov_base)[i - iov[0].iov_len];
+
+		if (header[0] != FRAME_START) {
+			qb_consume(qb, 1);
+			continue;
+		}
+
+		size_t len = ((size_t)header[1] << 8) | header[2];
+		if (len > FRAME_MAX) {
+			qb_consume(qb, 1);
+			continue;
+		}
+		if (avail < len + 4)
+			break;
+
+		// Checksum and payload copy in place, one pass per region
+		uint8_t sum = 0;
+		size_t  offset = 3, want = len + 1, copied = 0;
+		int     reg;
+		for (reg = 0; reg < count && want > 0; ++reg) {
+			const uint8_t *base = (const uint8_t *)iov[reg].iov_base;
+			size_t regionlen = iov[reg].iov_len;
+			if (offset >= regionlen) {
+				offset -= regionlen;
+				continue;
+			}
+
+			size_t n = regionlen - offset;
+			if (n > want)
+				n = want;
+			for (i = 0; i < n; ++i)
+				sum += base[offset + i];
+
+			// The last byte of the frame is the checksum, not payload
+			size_t payload = n;
+			if (copied + payload > len)
+				payload = len - copied;
+			memcpy(out + copied, base + offset, payload);
+			copied += payload;
+
+			want -= n;
+			offset = 0;
+		}
+
+		if (sum != 0xFF) {
+			qb_consume(qb, 1);
+			continue;
+		}
+
+		*digest = *digest * 31 + out[0] + out[len - 1];
+		qb_consume(qb, len + 4);
+		++frames;
+	}
+
+	return frames;
+}
+
+/*
+	Measurement
+*/
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long maxRSS() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
@@ -0,0 +1,226 @@
+/**
+	Philip Romano
+	Contention benchmark for RecordQueue
+
+	1 to 4 producer threads push fixed-size records as fast as they can
+	while one consumer drains them, as several subsystems would feed one
+	telemetry link. Each configuration runs twice:
+
+	  recordqueue - lock-free rq_push, rq_peek/rq_consume drain
+	  mutex       - QueueBuffer (list backend) with every qb_push and qb_pop
+	                under one pthread mutex, the simplest way to keep records
+	                from interleaving
+
+	Results are written as CSV, one row per run:
+
+	  queue,producers,record,records,seconds,ns_per_record,mb_per_s,
+	  retries,full
+
+	retries counts lost compare-and-swap races; full counts pushes refused
+	because the consumer had fallen behind (each is retried).
+
+	Usage: bench_recordqueue.x [-q] [-o file]
+	  -q  quick run with 1/16 of the records
+	  -o  write results to file instead of standard output
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "recordqueue.h"
+#include "queuebuffer.h"
+
+#define MAX_PRODUCERS 4
+#define MAX_RECORD    256
+
+// Records pushed per run, shared between the producers
+#define RUN_RECORDS (4 * 1024 * 1024)
+
+#define QUEUE_CAPACITY (64 * 1024)
+
+struct Bench {
+	struct RecordQueue *rq;   // NULL for the mutex run
+	struct QueueBuffer *qb;
+	pthread_mutex_t    lock;
+	size_t             record,
+	                   each;  // Records per producer
+	size_t             full;  // Updated by producers under lock
+};
+
+static void  *rqProducer(void *arg);
+static void  *qbProducer(void *arg);
+static size_t rqDrain(struct Bench *bench, size_t total);
+static size_t qbDrain(struct Bench *bench, size_t total);
+static double now();
+
+int main(int argc, char **argv) {
+	FILE *out = stdout;
+	int   quick = 0, opt;
+
+	while ((opt = getopt(argc, argv, "qo:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quick = 1;
+				break;
+			case 'o':
+				out = fopen(optarg, "w");
+				if (!out) {
+					fprintf(stderr, "Could not open %s for writing\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-q] [-o file]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	size_t records[] = { 16, 64, 256 };
+	size_t total = quick ? RUN_RECORDS / 16 : RUN_RECORDS;
+
+	fprintf(out, "queue,producers,record,records,seconds,ns_per_record,"
+			"mb_per_s,retries,full\n");
+
+	size_t r;
+	int producers, locked;
+	for (r = 0; r < sizeof(records) / sizeof(records[0]); ++r) {
+		for (producers = 1; producers <= MAX_PRODUCERS; ++producers) {
+			for (locked = 0; locked <= 1; ++locked) {
+				struct Bench bench;
+				memset(&bench, 0, sizeof(bench));
+				pthread_mutex_init(&bench.lock, NULL);
+				bench.record = records[r];
+				bench.each = total / producers;
+
+				if (locked) {
+					qb_initialize(&bench.qb);
+				} else if (!rq_initialize(&bench.rq, QUEUE_CAPACITY)) {
+					fprintf(stderr, "Could not initialize RecordQueue\n");
+					return 1;
+				}
+
+				pthread_t threads[MAX_PRODUCERS];
+				double start = now();
+				int p;
+				for (p = 0; p < producers; ++p)
+					pthread_create(&threads[p], NULL,
+							locked ? qbProducer : rqProducer, &bench);
+
+				size_t received = locked ?
+						qbDrain(&bench, bench.each * producers) :
+						rqDrain(&bench, bench.each * producers);
+
+				for (p = 0; p < producers; ++p)
+					pthread_join(threads[p], NULL);
+				double seconds = now() - start;
+
+				size_t retries = 0, full = bench.full;
+				if (!locked) {
+					struct RecordQueueStats stats;
+					rq_getStats(bench.rq, &stats);
+					retries = stats.retries;
+					full = stats.rejected;
+					rq_free(&bench.rq);
+				} else {
+					qb_free(&bench.qb);
+				}
+				pthread_mutex_destroy(&bench.lock);
+
+				fprintf(out, "%s,%d,%zu,%zu,%.6f,%.1f,%.1f,%zu,%zu\n",
+						locked ? "mutex" : "recordqueue", producers,
+						bench.record, received, seconds,
+						seconds * 1e9 / received,
+						received * bench.record / seconds / 1e6, retries, full);
+				fflush(out);
+			}
+		}
+	}
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+void *rqProducer(void *arg) {
+	struct Bench *bench = (struct Bench *)arg;
+	uint8_t record[MAX_RECORD];
+	size_t i;
+
+	memset(record, 0x55, sizeof(record));
+	for (i = 0; i < bench->each; ++i)
+		while (rq_push(bench->rq, record, bench->record) == RQ_ERROR_FULL)
+			sched_yield();
+
+	return NULL;
+}
+
+void *qbProducer(void *arg) {
+	struct Bench *bench = (struct Bench *)arg;
+	uint8_t record[MAX_RECORD];
+	size_t i;
+
+	memset(record, 0x55, sizeof(record));
+	for (i = 0; i < bench->each; ++i) {
+		// Same bound as the RecordQueue, so a slow consumer is handled alike
+		for (;;) {
+			pthread_mutex_lock(&bench->lock);
+			if (qb_getSize(bench->qb) + bench->record <= QUEUE_CAPACITY)
+				break;
+			++bench->full;
+			pthread_mutex_unlock(&bench->lock);
+			sched_yield();
+		}
+		qb_push(bench->qb, record, bench->record);
+		pthread_mutex_unlock(&bench->lock);
+	}
+
+	return NULL;
+}
+
+size_t rqDrain(struct Bench *bench, size_t total) {
+	size_t received = 0, len;
+
+	while (received < total) {
+		if (!rq_peek(bench->rq, &len)) {
+			sched_yield();
+			continue;
+		}
+		rq_consume(bench->rq);
+		++received;
+	}
+
+	return received;
+}
+
+size_t qbDrain(struct Bench *bench, size_t total) {
+	uint8_t record[MAX_RECORD];
+	size_t received = 0;
+
+	while (received < total) {
+		pthread_mutex_lock(&bench->lock);
+		int bytes = qb_pop(bench->qb, record, bench->record);
+		pthread_mutex_unlock(&bench->lock);
+
+		if (bytes == 0) {
+			sched_yield();
+			continue;
+		}
+		++received;
+	}
+
+	return received;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
@@ -0,0 +1,1067 @@
+/**
+	Philip Romano
+	Benchmarks for UART
+
+	Runs the UART driver on the slave side of a pseudo-terminal pair, so no
+	hardware is needed. With -d, only the throughput, roundtrip and engine
+	runs are made, on a real device with its Tx wired to its Rx.
+
+	latency - For each receive mode, one byte at a time is written to the
+	          master side, and the time is measured until the application
+	          has it: woken through the uart_getEventFd() descriptor, then
+	          uart_readTimestamped(). The pickup metrics are the time until
+	          the driver read it, from its arrival timestamp; queue_* come
+	          from the driver's own histogram (uart_getLatency()) of the
+	          time from there until the application read it.
+
+	            signal - UART_RXSIGNAL, input read by the SIGIO handler
+	            thread - UART_RXTHREAD, input read by the epoll receive thread
+
+	          Each also runs with uart_setLowLatency(1), as signal-lowlat
+	          and thread-lowlat.
+
+	telemetry - A stream of small messages, each written field by field
+	            (start byte, id, three axes, timestamp, checksum) while a
+	            thread reads the master side.
+
+	            direct   - txbuffered = 0, each field written as it is queued
+	            buffered - txbuffered = 1, one uart_flush() per message
+
+	samples - Blocks of 16 3-axis samples (16-bit, big-endian on the wire),
+	          checked byte for byte by the reading thread.
+
+	            scalar - one uart_writeUBE16() per value
+	            array  - one uart_writeBE16Array() per block
+
+	pl011 - UART_BACKENDPL011 on a fake register block (pl011fake.c) at
+	        460800 baud: the time from a byte entering the receive FIFO
+	        until uart_readTimeout() returns it, and the rate of a stream
+	        fed into the FIFO as fast as it drains, with CPU per MB.
+
+	          poll   - the thread naps once the FIFO has stayed empty
+	          spin   - uart_setLowLatency(1), polling without a break
+
+	idle - An idle link: one byte every 10 ms for a second. Reports the
+	       process CPU use while waiting, and the delay from each write
+	       until the application had the byte.
+
+	         spin - uart_read() in a loop until it returns data
+	         wait - uart_readTimeout(), sleeping until input arrives
+
+	throughput - Messages of 16 to 1024 bytes streamed through uart_write()
+	             and uart_readTimeout() around an echoing loopback, at
+	             several rates, with 16 messages in flight. Reports MB/s
+	             and the process CPU time per MB, less the echoing peer's
+	             (so the driver, its receive thread and the benchmark).
+	             The mode is <size>B_<rate>baud.
+
+	roundtrip - The same messages sent one at a time, each timed from
+	            uart_write() until all of it was read back (p50, p99, max).
+
+	engine - For each receive engine, 64-byte messages at 115200 baud around
+	         the loopback: streamed as in throughput, then sent one at a time
+	         as in roundtrip. Reports the driver's system calls per second and
+	         per MB of the stream, CPU per MB, and the round trip times with
+	         the system calls per message.
+
+	           thread - UART_RXTHREAD, a read() per epoll wakeup and a writev()
+	                    per uart_write()
+	           uring  - UART_RXURING, reads kept queued on an io_uring and
+	                    writes queued behind the one in flight (skipped where
+	                    io_uring is unavailable)
+
+	A pseudo-terminal does not pace its output, so there the rate only
+	shows that setting it costs nothing; on a device the line is the limit.
+
+	Results are written as CSV, one row per measurement, so runs before and
+	after a change can be compared line by line:
+
+	  benchmark,mode,metric,value,unit
+
+	Usage: bench_uart.x [-q] [-d device] [-n samples] [-o file]
+	  -q  quick run: 1/4 of the samples, 1/16 of the throughput data
+	  -d  loopback device to use instead of a pseudo-terminal
+	  -n  samples per latency and roundtrip run (default 2000)
+	  -o  write results to file instead of standard output
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "uart.h"
+#include "ptyharness.h"
+#include "pl011fake.h"
+
+#define DEFAULT_SAMPLES 2000
+
+// Time to wait for one byte before giving up on it
+#define TIMEOUT_MS 1000
+
+// Messages sent per telemetry run, and the bytes in each
+#define TELEMETRY_MESSAGES 20000
+#define TELEMETRY_BYTES    14
+
+// Blocks sent per samples run, and the values in each
+#define SAMPLE_BLOCKS 5000
+#define SAMPLE_VALUES (16 * 3)
+
+// Bytes sent per idle run, and the time between them
+#define IDLE_BYTES       100
+#define IDLE_INTERVAL_US 10000
+
+// Bytes looped back per throughput run (1/16 with -q), and the messages in
+// flight at once
+#define THROUGHPUT_BYTES  (4 * 1024 * 1024)
+#define THROUGHPUT_WINDOW 16
+
+// Bytes streamed through the fake PL011 per pl011 run (1/16 with -q), and
+// the rate it runs at (the fastest its reference clock allows)
+#define PL011_BYTES (256 * 1024)
+#define PL011_RATE  460800
+
+// Size of the engine run's messages, and its rate
+#define ENGINE_SIZE 64
+#define ENGINE_RATE 115200
+
+// Message sizes and rates for the throughput and roundtrip runs
+static const int sizes[] = { 16, 64, 256, 1024 };
+static const int rates[] = { 115200, 921600, 4000000 };
+
+// A loopback: a pseudo-terminal with an echoing peer, or a device with Tx
+// wired to Rx
+struct Loopback {
+	int            master; // -1 for a device
+	struct PtyPeer peer;
+	struct PtyStep echo;
+};
+
+struct Idle {
+	int    master;
+	double sent[IDLE_BYTES]; // Time each byte was written
+};
+
+struct Feed {
+	struct PL011Fake *fake;
+	size_t           total;
+};
+
+struct Peer {
+	int    master;
+	size_t expected,
+	       received;
+
+	// If set, each byte received must match block[received % blocklen]
+	const uint8_t *block;
+	size_t        blocklen,
+	              mismatched;
+};
+
+static int    byteLatency(FILE *out, int count);
+static int    measure(int master, double *samples, double *pickup,
+		int count);
+static int    telemetry(FILE *out, int buffered);
+static int    sampleBlocks(FILE *out, int array);
+static int    idleLink(FILE *out, int wait);
+static void  *idleWriter(void *arg);
+static int    registerPoll(FILE *out, int spin, int count, int quick);
+static void  *feedRegisters(void *arg);
+static int    throughput(FILE *out, const char *device, int size,
+		int baudrate, int quick);
+static int    roundTrip(FILE *out, const char *device, int size,
+		int baudrate, int count);
+static int    engine(FILE *out, const char *device, UARTRxMode rxmode,
+		int count, int quick);
+static int    openLoopback(struct Loopback *loop, const char *device,
+		int baudrate, UARTRxMode rxmode);
+static void   closeLoopback(struct Loopback *loop);
+static double peerTime(struct Loopback *loop);
+static double cpuTime();
+static void  *peerReader(void *arg);
+static int    compareDouble(const void *a, const void *b);
+static double now();
+
+int main(int argc, char **argv) {
+	const char *device = NULL;
+	FILE *out = stdout;
+	int   count = DEFAULT_SAMPLES, quick = 0, opt;
+
+	while ((opt = getopt(argc, argv, "qd:n:o:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quick = 1;
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'o':
+				out = fopen(optarg, "w");
+				if (!out) {
+					fprintf(stderr, "Could not open %s for writing\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-q] [-d device] [-n samples] "
+						"[-o file]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (count <= 0)
+		count = DEFAULT_SAMPLES;
+	if (quick)
+		count /= 4;
+
+	fprintf(out, "benchmark,mode,metric,value,unit\n");
+
+	// These need the master side of a pseudo-terminal
+	if (!device) {
+		if (!byteLatency(out, count))
+			return 1;
+		if (!telemetry(out, 0) || !telemetry(out, 1))
+			return 1;
+		if (!sampleBlocks(out, 0) || !sampleBlocks(out, 1))
+			return 1;
+		if (!idleLink(out, 0) || !idleLink(out, 1))
+			return 1;
+		if (!registerPoll(out, 0, count, quick) ||
+				!registerPoll(out, 1, count, quick))
+			return 1;
+	}
+
+	size_t z, r;
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); ++r)
+		for (z = 0; z < sizeof(sizes) / sizeof(sizes[0]); ++z)
+			if (!throughput(out, device, sizes[z], rates[r], quick) ||
+					!roundTrip(out, device, sizes[z], rates[r], count))
+				return 1;
+
+	if (!engine(out, device, UART_RXTHREAD, count, quick) ||
+			!engine(out, device, UART_RXURING, count, quick))
+		return 1;
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+/**
+	Run the latency benchmark in each receive mode, with count bytes each.
+	Returns 1 on success, 0 on error.
+*/
+int byteLatency(FILE *out, int count) {
+	double *samples = malloc(count * sizeof(double)),
+	       *pickup = malloc(count * sizeof(double));
+	UARTRxMode  modes[] = { UART_RXSIGNAL, UART_RXTHREAD, UART_RXSIGNAL,
+	                        UART_RXTHREAD };
+	int         lowlatency[] = { 0, 0, 1, 1 };
+	const char *modenames[] = { "signal", "thread", "signal-lowlat",
+	                            "thread-lowlat" };
+
+	int m;
+	for (m = 0; m < 4; ++m) {
+		char slavepath[64];
+		int  master = pty_open(slavepath, sizeof(slavepath));
+		if (master == -1) {
+			fprintf(stderr, "Could not open a pseudo-terminal\n");
+			return 0;
+		}
+
+		struct UARTOptions options;
+		uart_defaultOptions(&options);
+		options.rxmode = modes[m];
+		if (!uart_initWithOptions(slavepath, 115200, UART_PARDISABLE,
+				&options)) {
+			fprintf(stderr, "uart_initWithOptions(): %s\n",
+					uart_getLastError());
+			return 0;
+		}
+		if (lowlatency[m] && !uart_setLowLatency(1)) {
+			fprintf(stderr, "uart_setLowLatency(): %s\n", uart_getLastError());
+			return 0;
+		}
+		uart_recordLatency(1);
+
+		int got = measure(master, samples, pickup, count);
+
+		struct UARTLatency latency;
+		uart_getLatency(&latency);
+		uart_deinit();
+		close(master);
+
+		if (got == 0) {
+			fprintf(stderr, "%s: no bytes received\n", modenames[m]);
+			continue;
+		}
+
+		double sum = 0.0;
+		int i;
+		for (i = 0; i < got; ++i)
+			sum += samples[i];
+		qsort(samples, got, sizeof(double), compareDouble);
+		qsort(pickup, got, sizeof(double), compareDouble);
+
+		fprintf(out, "latency,%s,samples,%d,count\n", modenames[m], got);
+		fprintf(out, "latency,%s,min,%.1f,us\n", modenames[m],
+				samples[0] * 1e6);
+		fprintf(out, "latency,%s,median,%.1f,us\n", modenames[m],
+				samples[got / 2] * 1e6);
+		fprintf(out, "latency,%s,p99,%.1f,us\n", modenames[m],
+				samples[(int)(got * 0.99)] * 1e6);
+		fprintf(out, "latency,%s,max,%.1f,us\n", modenames[m],
+				samples[got - 1] * 1e6);
+		fprintf(out, "latency,%s,mean,%.1f,us\n", modenames[m],
+				sum / got * 1e6);
+		fprintf(out, "latency,%s,pickup_median,%.1f,us\n", modenames[m],
+				pickup[got / 2] * 1e6);
+		fprintf(out, "latency,%s,pickup_p99,%.1f,us\n", modenames[m],
+				pickup[(int)(got * 0.99)] * 1e6);
+
+		fprintf(out, "latency,%s,queue_mean,%.1f,us\n", modenames[m],
+				latency.samples ? latency.totalns / 1e3 / latency.samples : 0);
+		fprintf(out, "latency,%s,queue_max,%.1f,us\n", modenames[m],
+				latency.maxns / 1e3);
+		for (i = 0; i < UART_LATENCYBINS; ++i)
+			if (latency.counts[i] > 0)
+				fprintf(out, "latency,%s,queue_under_%luus,%zu,count\n",
+						modenames[m], 1UL << i, latency.counts[i]);
+		fflush(out);
+	}
+
+	free(samples);
+	free(pickup);
+	return 1;
+}
+
+/**
+	Send count bytes through the pseudo-terminal one at a time, storing the
+	delivery time of each in samples, and the time until the driver read it
+	in pickup. Returns the number of bytes received.
+*/
+int measure(int master, double *samples, double *pickup, int count) {
+	struct pollfd pfd;
+	pfd.fd = uart_getEventFd();
+	pfd.events = POLLIN;
+
+	int got = 0, i;
+	for (i = 0; i < count; ++i) {
+		uint8_t  sent = (uint8_t)i, received;
+		uint64_t events;
+		struct timespec arrival;
+
+		double start = now();
+		write(master, &sent, 1);
+
+		// A SIGIO may interrupt poll(); the byte is still on its way
+		int bytes = 0;
+		while (bytes == 0) {
+			int ready = poll(&pfd, 1, TIMEOUT_MS);
+			if (ready == -1 && errno == EINTR)
+				continue;
+			if (ready <= 0)
+				break;
+
+			read(pfd.fd, &events, sizeof(events));
+			bytes = uart_readTimestamped(&received, 1, &arrival);
+		}
+		double end = now();
+
+		if (bytes == 1 && received == sent) {
+			pickup[got] = arrival.tv_sec + arrival.tv_nsec / 1e9 - start;
+			samples[got++] = end - start;
+		}
+	}
+
+	return got;
+}
+
+/**
+	Send TELEMETRY_MESSAGES messages field by field, with output buffered
+	or not, and write the system calls and time spent per message to out.
+	Returns 1 on success, 0 on error.
+*/
+int telemetry(FILE *out, int buffered) {
+	const char *mode = buffered ? "buffered" : "direct";
+	char slavepath[64];
+	int  master = pty_open(slavepath, sizeof(slavepath));
+	if (master == -1) {
+		fprintf(stderr, "Could not open a pseudo-terminal\n");
+		return 0;
+	}
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.rxmode = UART_RXTHREAD;
+	options.txbuffered = buffered;
+	if (!uart_initWithOptions(slavepath, 115200, UART_PARDISABLE, &options)) {
+		fprintf(stderr, "uart_initWithOptions(): %s\n", uart_getLastError());
+		return 0;
+	}
+
+	struct Peer peer;
+	pthread_t   reader;
+	peer.master = master;
+	peer.expected = (size_t)TELEMETRY_MESSAGES * TELEMETRY_BYTES;
+	peer.received = 0;
+	peer.block = NULL;
+	pthread_create(&reader, NULL, peerReader, &peer);
+
+	size_t accepted = 0;
+	double start = now();
+	int i, axis;
+	for (i = 0; i < TELEMETRY_MESSAGES; ++i) {
+		uint8_t checksum = (uint8_t)i;
+
+		accepted += uart_writeChar('$');
+		accepted += uart_writeUBE16((uint16_t)i);
+		for (axis = 0; axis < 3; ++axis)
+			accepted += uart_writeUBE16((uint16_t)(i * (axis + 1)));
+		accepted += uart_writeUBE32((uint32_t)i);
+		accepted += uart_writeChar((char)checksum);
+
+		if (buffered)
+			uart_flush(-1);
+	}
+	uart_flush(-1);
+	double seconds = now() - start;
+
+	struct UARTStats stats;
+	uart_getStats(&stats);
+	uart_deinit();
+
+	pthread_join(reader, NULL);
+	close(master);
+
+	fprintf(out, "telemetry,%s,messages,%d,count\n", mode, TELEMETRY_MESSAGES);
+	fprintf(out, "telemetry,%s,syscalls_per_message,%.2f,count\n", mode,
+			(double)stats.txwrites / TELEMETRY_MESSAGES);
+	fprintf(out, "telemetry,%s,time_per_message,%.2f,us\n", mode,
+			seconds * 1e6 / TELEMETRY_MESSAGES);
+	fprintf(out, "telemetry,%s,bytes_lost,%zu,bytes\n", mode,
+			peer.expected - peer.received);
+	fflush(out);
+
+	if (accepted != peer.expected)
+		fprintf(stderr, "%s: only %zu of %zu bytes accepted\n", mode,
+				accepted, peer.expected);
+	return 1;
+}
+
+/**
+	Send SAMPLE_BLOCKS blocks of samples, one value at a time or as one
+	array, and write the system calls and time spent per block to out.
+	Returns 1 on success, 0 on error.
+*/
+int sampleBlocks(FILE *out, int array) {
+	const char *mode = array ? "array" : "scalar";
+	char slavepath[64];
+	int  master = pty_open(slavepath, sizeof(slavepath));
+	if (master == -1) {
+		fprintf(stderr, "Could not open a pseudo-terminal\n");
+		return 0;
+	}
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.rxmode = UART_RXTHREAD;
+	if (!uart_initWithOptions(slavepath, 115200, UART_PARDISABLE, &options)) {
+		fprintf(stderr, "uart_initWithOptions(): %s\n", uart_getLastError());
+		return 0;
+	}
+
+	// The same block every time, so the reader knows what to expect
+	uint16_t values[SAMPLE_VALUES];
+	uint8_t  block[SAMPLE_VALUES * 2];
+	int i;
+	for (i = 0; i < SAMPLE_VALUES; ++i) {
+		values[i] = (uint16_t)(i * 1031 + 7);
+		block[i * 2] = values[i] >> 8;
+		block[i * 2 + 1] = values[i] & 0xFF;
+	}
+
+	struct Peer peer;
+	pthread_t   reader;
+	peer.master = master;
+	peer.expected = (size_t)SAMPLE_BLOCKS * sizeof(block);
+	peer.received = 0;
+	peer.block = block;
+	peer.blocklen = sizeof(block);
+	peer.mismatched = 0;
+	pthread_create(&reader, NULL, peerReader, &peer);
+
+	double start = now();
+	int b, v;
+	for (b = 0; b < SAMPLE_BLOCKS; ++b) {
+		if (array)
+			uart_writeBE16Array(values, SAMPLE_VALUES);
+		else
+			for (v = 0; v < SAMPLE_VALUES; ++v)
+				uart_writeUBE16(values[v]);
+	}
+	uart_flush(-1);
+	double seconds = now() - start;
+
+	struct UARTStats stats;
+	uart_getStats(&stats);
+	uart_deinit();
+
+	pthread_join(reader, NULL);
+	close(master);
+
+	fprintf(out, "samples,%s,blocks,%d,count\n", mode, SAMPLE_BLOCKS);
+	fprintf(out, "samples,%s,syscalls_per_block,%.2f,count\n", mode,
+			(double)stats.txwrites / SAMPLE_BLOCKS);
+	fprintf(out, "samples,%s,time_per_block,%.2f,us\n", mode,
+			seconds * 1e6 / SAMPLE_BLOCKS);
+	fprintf(out, "samples,%s,bytes_wrong,%zu,bytes\n", mode,
+			peer.mismatched + (peer.expected - peer.received));
+	fflush(out);
+
+	return 1;
+}
+
+/**
+	Receive IDLE_BYTES bytes sent IDLE_INTERVAL_US apart, either spinning on
+	uart_read() or sleeping in uart_readTimeout(), and write the CPU use and
+	delivery delay to out. Returns 1 on success, 0 on error.
+*/
+int idleLink(FILE *out, int wait) {
+	const char *mode = wait ? "wait" : "spin";
+	char slavepath[64];
+
+	struct Idle idle;
+	idle.master = pty_open(slavepath, sizeof(slavepath));
+	if (idle.master == -1) {
+		fprintf(stderr, "Could not open a pseudo-terminal\n");
+		return 0;
+	}
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.rxmode = UART_RXTHREAD;
+	if (!uart_initWithOptions(slavepath, 115200, UART_PARDISABLE, &options)) {
+		fprintf(stderr, "uart_initWithOptions(): %s\n", uart_getLastError());
+		return 0;
+	}
+
+	double delays[IDLE_BYTES];
+	int    got = 0, bytes;
+	uint8_t received;
+
+	pthread_t writer;
+	double start = now(), cpustart = cpuTime();
+	pthread_create(&writer, NULL, idleWriter, &idle);
+
+	while (got < IDLE_BYTES) {
+		if (wait)
+			bytes = uart_readTimeout(&received, 1, 1, TIMEOUT_MS);
+		else
+			bytes = uart_read(&received, 1);
+
+		if (bytes == 1 && received < IDLE_BYTES)
+			delays[got++] = now() - idle.sent[received];
+		else if (wait)
+			break;
+	}
+
+	double cpu = cpuTime() - cpustart, seconds = now() - start;
+	pthread_join(writer, NULL);
+	uart_deinit();
+	close(idle.master);
+
+	if (got == 0) {
+		fprintf(stderr, "%s: no bytes received\n", mode);
+		return 0;
+	}
+	qsort(delays, got, sizeof(double), compareDouble);
+
+	fprintf(out, "idle,%s,cpu,%.1f,percent\n", mode, cpu / seconds * 100);
+	fprintf(out, "idle,%s,delay_median,%.1f,us\n", mode,
+			delays[got / 2] * 1e6);
+	fprintf(out, "idle,%s,delay_max,%.1f,us\n", mode, delays[got - 1] * 1e6);
+	fflush(out);
+
+	return 1;
+}
+
+/**
+	Write IDLE_BYTES numbered bytes to the master side, IDLE_INTERVAL_US
+	apart, noting when each was sent.
+*/
+void *idleWriter(void *arg) {
+	struct Idle *idle = (struct Idle *)arg;
+	uint8_t i;
+
+	for (i = 0; i < IDLE_BYTES; ++i) {
+		usleep(IDLE_INTERVAL_US);
+		idle->sent[i] = now();
+		write(idle->master, &i, 1);
+	}
+
+	return NULL;
+}
+
+/**
+	Run the pl011 benchmark, napping or spinning, and write the results to
+	out. Returns 1 on success, 0 on error.
+*/
+int registerPoll(FILE *out, int spin, int count, int quick) {
+	const char *mode = spin ? "spin" : "poll";
+	struct PL011Fake *fake;
+	char path[64];
+
+	snprintf(path, sizeof(path), "/tmp/bench_uart.%d", (int)getpid());
+	if (!pf_open(&fake, path)) {
+		fprintf(stderr, "Could not create fake registers at %s\n", path);
+		return 0;
+	}
+	unlink(path);
+
+	struct UARTRegisterOps regops;
+	pf_getOps(fake, &regops);
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.backend = UART_BACKENDPL011;
+	options.regops = &regops;
+	options.rxmode = UART_RXTHREAD;
+	if (!uart_initWithOptions(NULL, PL011_RATE, UART_PARDISABLE, &options)) {
+		fprintf(stderr, "uart_initWithOptions(): %s\n", uart_getLastError());
+		pf_close(&fake);
+		return 0;
+	}
+	uart_setLowLatency(spin);
+
+	// One byte at a time, each after the thread has had time to settle
+	double *samples = malloc(count * sizeof(double));
+	int     got = 0, i;
+	uint8_t byte;
+
+	for (i = 0; i < count; ++i) {
+		usleep(100);
+		byte = (uint8_t)i;
+
+		double start = now();
+		pf_inject(fake, &byte, 1);
+		int bytes = uart_readTimeout(&byte, 1, 1, TIMEOUT_MS);
+		double end = now();
+
+		if (bytes != 1)
+			break;
+		samples[got++] = end - start;
+	}
+
+	// Then a stream
+	static uint8_t buffer[4096];
+	struct Feed feed;
+	pthread_t   feeder;
+	size_t      received = 0;
+
+	feed.fake = fake;
+	feed.total = quick ? PL011_BYTES / 16 : PL011_BYTES;
+
+	double cpu = cpuTime(), start = now();
+	pthread_create(&feeder, NULL, feedRegisters, &feed);
+	while (received < feed.total) {
+		int bytes = uart_readTimeout(buffer, sizeof(buffer), 1, TIMEOUT_MS);
+		if (bytes <= 0)
+			break;
+		received += bytes;
+	}
+	pthread_join(feeder, NULL);
+	double seconds = now() - start;
+	cpu = cpuTime() - cpu;
+
+	uart_deinit();
+	pf_close(&fake);
+
+	fprintf(out, "pl011,%s,samples,%d,count\n", mode, got);
+	if (got > 0) {
+		qsort(samples, got, sizeof(double), compareDouble);
+		fprintf(out, "pl011,%s,p50,%.1f,us\n", mode, samples[got / 2] * 1e6);
+		fprintf(out, "pl011,%s,p99,%.1f,us\n", mode,
+				samples[(int)(got * 0.99)] * 1e6);
+		fprintf(out, "pl011,%s,max,%.1f,us\n", mode,
+				samples[got - 1] * 1e6);
+	}
+	fprintf(out, "pl011,%s,rate,%.3f,mb_per_s\n", mode,
+			received / seconds / 1e6);
+	fprintf(out, "pl011,%s,line_rate,%.3f,mb_per_s\n", mode,
+			PL011_RATE / 10 / 1e6);
+	fprintf(out, "pl011,%s,cpu,%.1f,ms_per_mb\n", mode,
+			received > 0 ? cpu * 1e3 / (received / 1e6) : 0);
+	fprintf(out, "pl011,%s,lost,%zu,bytes\n", mode, feed.total - received);
+	fflush(out);
+
+	free(samples);
+	return 1;
+}
+
+/**
+	Feed a Feed's total bytes into the fake receive FIFO as fast as it has
+	room, as a line faster than the polling would
+*/
+void *feedRegisters(void *arg) {
+	struct Feed *feed = (struct Feed *)arg;
+	uint8_t chunk[UART_PL011FIFO];
+	size_t  sent = 0;
+
+	memset(chunk, 0x55, sizeof(chunk));
+	while (sent < feed->total) {
+		size_t len = feed->total - sent < sizeof(chunk) ?
+				feed->total - sent : sizeof(chunk);
+		size_t accepted = pf_inject(feed->fake, chunk, len);
+		if (accepted == 0)
+			sched_yield();
+		sent += accepted;
+	}
+
+	return NULL;
+}
+
+/**
+	Stream messages of size bytes around the loopback, keeping
+	THROUGHPUT_WINDOW in flight, and write the throughput and the driver's
+	CPU time per megabyte to out. Returns 1 on success, 0 on error.
+*/
+int throughput(FILE *out, const char *device, int size, int baudrate,
+		int quick) {
+	struct Loopback loop;
+	if (!openLoopback(&loop, device, baudrate, UART_RXTHREAD))
+		return 0;
+
+	// A real line needs time to carry the data; half a second of it
+	size_t total = quick ? THROUGHPUT_BYTES / 16 : THROUGHPUT_BYTES;
+	if (device && total > (size_t)baudrate / 10 / 2)
+		total = baudrate / 10 / 2;
+
+	size_t  messages = total / size > 0 ? total / size : 1,
+	        sent = 0, received = 0, errors = 0, i;
+	uint8_t message[1024], buffer[4096];
+
+	for (i = 0; i < (size_t)size; ++i)
+		message[i] = (uint8_t)(i * 7 + 1);
+
+	double cpu = cpuTime() - peerTime(&loop), start = now();
+	while (received < messages * size) {
+		while (sent < messages && sent - received / size < THROUGHPUT_WINDOW) {
+			if (uart_write(message, size) != size)
+				break;
+			++sent;
+		}
+
+		int bytes = uart_readTimeout(buffer, sizeof(buffer), 1, TIMEOUT_MS);
+		if (bytes <= 0)
+			break;
+		for (i = 0; i < (size_t)bytes; ++i)
+			if (buffer[i] != message[(received + i) % size])
+				++errors;
+		received += bytes;
+	}
+	double seconds = now() - start;
+	cpu = cpuTime() - peerTime(&loop) - cpu;
+
+	closeLoopback(&loop);
+	double mb = received / 1e6;
+
+	char mode[32];
+	snprintf(mode, sizeof(mode), "%dB_%dbaud", size, baudrate);
+	fprintf(out, "throughput,%s,bytes,%zu,count\n", mode, received);
+	fprintf(out, "throughput,%s,rate,%.3f,mb_per_s\n", mode,
+			seconds > 0 ? mb / seconds : 0);
+	fprintf(out, "throughput,%s,cpu,%.3f,ms_per_mb\n", mode,
+			mb > 0 ? cpu * 1e3 / mb : 0);
+	fprintf(out, "throughput,%s,errors,%zu,count\n", mode, errors);
+	fprintf(out, "throughput,%s,lost,%zu,count\n", mode,
+			messages * size - received);
+	fflush(out);
+
+	return 1;
+}
+
+/**
+	Send count messages of size bytes around the loopback one at a time,
+	timing each from uart_write() until uart_readTimeout() has all of it
+	back, and write the distribution to out. Returns 1 on success, 0 on
+	error.
+*/
+int roundTrip(FILE *out, const char *device, int size, int baudrate,
+		int count) {
+	struct Loopback loop;
+	if (!openLoopback(&loop, device, baudrate, UART_RXTHREAD))
+		return 0;
+
+	// Keep a real line to about a second
+	int most = baudrate / 10 / size;
+	if (device && count > most)
+		count = most > 0 ? most : 1;
+
+	double *samples = malloc(count * sizeof(double));
+	uint8_t message[1024], buffer[1024];
+	int     got = 0, i;
+
+	for (i = 0; i < size; ++i)
+		message[i] = (uint8_t)(i * 7 + 1);
+
+	for (i = 0; i < count; ++i) {
+		double start = now();
+		uart_write(message, size);
+		int bytes = uart_readTimeout(buffer, size, size, TIMEOUT_MS);
+		double end = now();
+
+		if (bytes != size)
+			break;
+		if (memcmp(buffer, message, size) == 0)
+			samples[got++] = end - start;
+	}
+
+	closeLoopback(&loop);
+
+	char mode[32];
+	snprintf(mode, sizeof(mode), "%dB_%dbaud", size, baudrate);
+	fprintf(out, "roundtrip,%s,samples,%d,count\n", mode, got);
+	if (got > 0) {
+		qsort(samples, got, sizeof(double), compareDouble);
+		fprintf(out, "roundtrip,%s,p50,%.1f,us\n", mode,
+				samples[got / 2] * 1e6);
+		fprintf(out, "roundtrip,%s,p99,%.1f,us\n", mode,
+				samples[(int)(got * 0.99)] * 1e6);
+		fprintf(out, "roundtrip,%s,max,%.1f,us\n", mode,
+				samples[got - 1] * 1e6);
+	}
+	fflush(out);
+
+	free(samples);
+	return 1;
+}
+
+/**
+	Run the engine benchmark with the given receive mode, and write the
+	results to out. Returns 1 on success, 0 on error.
+*/
+int engine(FILE *out, const char *device, UARTRxMode rxmode, int count,
+		int quick) {
+	const char *mode = rxmode == UART_RXURING ? "uring" : "thread";
+	struct Loopback loop;
+	if (!openLoopback(&loop, device, ENGINE_RATE, rxmode))
+		return 0;
+
+	if (uart_getRxMode() != (int)rxmode) {
+		fprintf(stderr, "%s: not available here, skipped\n", mode);
+		closeLoopback(&loop);
+		return 1;
+	}
+
+	// As in throughput and roundtrip, keep a real line to about a second
+	size_t total = quick ? THROUGHPUT_BYTES / 16 : THROUGHPUT_BYTES;
+	if (device && total > ENGINE_RATE / 10 / 2)
+		total = ENGINE_RATE / 10 / 2;
+	if (device && count > ENGINE_RATE / 10 / ENGINE_SIZE)
+		count = ENGINE_RATE / 10 / ENGINE_SIZE;
+
+	size_t  messages = total / ENGINE_SIZE, sent = 0, received = 0, i;
+	uint8_t message[ENGINE_SIZE], buffer[4096];
+	struct UARTStats before, after;
+
+	for (i = 0; i < ENGINE_SIZE; ++i)
+		message[i] = (uint8_t)(i * 7 + 1);
+
+	uart_getStats(&before);
+	double cpu = cpuTime() - peerTime(&loop), start = now();
+	while (received < messages * ENGINE_SIZE) {
+		while (sent < messages &&
+				sent - received / ENGINE_SIZE < THROUGHPUT_WINDOW) {
+			if (uart_write(message, ENGINE_SIZE) != ENGINE_SIZE)
+				break;
+			++sent;
+		}
+
+		int bytes = uart_readTimeout(buffer, sizeof(buffer), 1, TIMEOUT_MS);
+		if (bytes <= 0)
+			break;
+		received += bytes;
+	}
+	double seconds = now() - start;
+	cpu = cpuTime() - peerTime(&loop) - cpu;
+	uart_getStats(&after);
+
+	size_t streamcalls = after.syscalls - before.syscalls;
+	double mb = received / 1e6;
+
+	// Then one message at a time
+	double *samples = malloc(count * sizeof(double));
+	int     got = 0, k;
+
+	uart_getStats(&before);
+	for (k = 0; k < count; ++k) {
+		double begin = now();
+		uart_write(message, ENGINE_SIZE);
+		int bytes = uart_readTimeout(buffer, ENGINE_SIZE, ENGINE_SIZE,
+				TIMEOUT_MS);
+		double end = now();
+
+		if (bytes != ENGINE_SIZE)
+			break;
+		if (memcmp(buffer, message, ENGINE_SIZE) == 0)
+			samples[got++] = end - begin;
+	}
+	uart_getStats(&after);
+
+	closeLoopback(&loop);
+
+	fprintf(out, "engine,%s,rate,%.3f,mb_per_s\n", mode,
+			seconds > 0 ? mb / seconds : 0);
+	fprintf(out, "engine,%s,syscalls,%.0f,per_s\n", mode,
+			seconds > 0 ? streamcalls / seconds : 0);
+	fprintf(out, "engine,%s,syscalls,%.0f,per_mb\n", mode,
+			mb > 0 ? streamcalls / mb : 0);
+	fprintf(out, "engine,%s,cpu,%.3f,ms_per_mb\n", mode,
+			mb > 0 ? cpu * 1e3 / mb : 0);
+	fprintf(out, "engine,%s,lost,%zu,count\n", mode,
+			messages * ENGINE_SIZE - received);
+	fprintf(out, "engine,%s,samples,%d,count\n", mode, got);
+	if (got > 0) {
+		qsort(samples, got, sizeof(double), compareDouble);
+		fprintf(out, "engine,%s,p50,%.1f,us\n", mode, samples[got / 2] * 1e6);
+		fprintf(out, "engine,%s,p99,%.1f,us\n", mode,
+				samples[(int)(got * 0.99)] * 1e6);
+		fprintf(out, "engine,%s,max,%.1f,us\n", mode, samples[got - 1] * 1e6);
+		fprintf(out, "engine,%s,syscalls_per_message,%.2f,count\n", mode,
+				(double)(after.syscalls - before.syscalls) / got);
+	}
+	fflush(out);
+
+	free(samples);
+	return 1;
+}
+
+/**
+	Initialize UART on a loopback at baudrate, receiving in rxmode: the
+	device if given, or else a pseudo-terminal whose peer echoes everything
+	back. Returns 1 on success, 0 on error.
+*/
+int openLoopback(struct Loopback *loop, const char *device, int baudrate,
+		UARTRxMode rxmode) {
+	char slavepath[64];
+
+	loop->master = -1;
+	if (!device) {
+		loop->master = pty_open(slavepath, sizeof(slavepath));
+		if (loop->master == -1) {
+			fprintf(stderr, "Could not open a pseudo-terminal\n");
+			return 0;
+		}
+		device = slavepath;
+	}
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.rxmode = rxmode;
+	if (!uart_initWithOptions(device, baudrate, UART_PARDISABLE, &options)) {
+		fprintf(stderr, "uart_initWithOptions(): %s\n", uart_getLastError());
+		if (loop->master != -1)
+			close(loop->master);
+		return 0;
+	}
+
+	if (loop->master != -1) {
+		loop->echo.type = PTY_ECHO;
+		loop->echo.data = NULL;
+		loop->echo.len = 0;
+		pty_startPeer(&loop->peer, loop->master, &loop->echo, 1);
+	}
+
+	return 1;
+}
+
+/**
+	Close a loopback opened by openLoopback().
+*/
+void closeLoopback(struct Loopback *loop) {
+	uart_deinit();
+	if (loop->master != -1) {
+		pty_stopPeer(&loop->peer, 0);
+		close(loop->master);
+	}
+}
+
+/**
+	Returns the CPU time the loopback's echoing peer has used so far, so it
+	can be left out of the process's.
+*/
+double peerTime(struct Loopback *loop) {
+	struct timespec ts;
+	clockid_t clock;
+
+	if (loop->master == -1 ||
+			pthread_getcpuclockid(loop->peer.thread, &clock) != 0)
+		return 0.0;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+	Read the master side of the pseudo-terminal until everything expected
+	has arrived, or nothing has for TIMEOUT_MS.
+*/
+void *peerReader(void *arg) {
+	struct Peer *peer = (struct Peer *)arg;
+	struct pollfd pfd;
+	char buffer[4096];
+
+	pfd.fd = peer->master;
+	pfd.events = POLLIN;
+	while (peer->received < peer->expected) {
+		if (poll(&pfd, 1, TIMEOUT_MS) <= 0)
+			break;
+
+		// Once the driver closes the slave side, reads fail with EIO
+		ssize_t bytes = read(peer->master, buffer, sizeof(buffer)), i;
+		if (bytes == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (bytes <= 0)
+			break;
+
+		if (peer->block)
+			for (i = 0; i < bytes; ++i)
+				if ((uint8_t)buffer[i] !=
+						peer->block[(peer->received + i) % peer->blocklen])
+					++peer->mismatched;
+		peer->received += bytes;
+	}
+
+	return NULL;
+}
+
+int compareDouble(const void *a, const void *b) {
+	double x = *(const double *)a,
+	       y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+double cpuTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
@@ -0,0 +1,304 @@
+/**
+	Philip Romano
+	Framing layer for the UART byte stream
+*/
+
+#include <string.h>
+
+#include "framing.h"
+
+// Most data bytes in one COBS block; a code byte of 0xFF means a full block
+// that is not followed by a zero
+#define COBS_MAXBLOCK 254
+
+// CRC-16/CCITT of every byte value, one byte at a time
+static const uint16_t crctable[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+	0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+	0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+	0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+	0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+	0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+	0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+	0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+	0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+	0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+	0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+	0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+	0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+	0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+	0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+	0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+	0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+	0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+	0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+	0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+	0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+struct Encoder {
+	uint8_t *out,     // Next byte to write
+	        *codeptr; // Where the current block's code byte goes
+	uint8_t code;     // Block length so far, plus one
+};
+
+// Append len bytes to the frame being encoded
+static void encodeBytes(struct Encoder *encoder, const uint8_t *src,
+		size_t len);
+
+// Decode from each region in turn, stopping once a frame is complete.
+// *used is set to the number of bytes used across all regions.
+static int decodeRegions(struct FrameDecoder *decoder,
+		const struct iovec *iov, int count, size_t *used);
+
+// A zero byte was reached: check the frame, then start a new one.
+// Returns 1 if the frame is valid.
+static int endFrame(struct FrameDecoder *decoder);
+
+// Append len decoded bytes to the frame, or mark it oversized
+static void appendBytes(struct FrameDecoder *decoder, const uint8_t *src,
+		size_t len);
+
+uint16_t fr_crc16(const void *data, size_t len) {
+	const uint8_t *bytes = (const uint8_t *)data;
+	uint16_t crc = 0xFFFF;
+
+	while (len--)
+		crc = (crc << 8) ^ crctable[(crc >> 8) ^ *bytes++];
+
+	return crc;
+}
+
+int fr_encode(const void *payload, size_t len, void *out, size_t outsize) {
+	size_t stuffed = len + 2;
+
+	if (len > FR_MAXPAYLOAD ||
+			outsize < stuffed + stuffed / COBS_MAXBLOCK + 2)
+		return FR_ERROR_SIZE;
+
+	uint16_t crc = fr_crc16(payload, len);
+	uint8_t  crcbytes[2] = { crc >> 8, crc & 0xFF };
+
+	struct Encoder encoder;
+	encoder.codeptr = (uint8_t *)out;
+	encoder.out = encoder.codeptr + 1;
+	encoder.code = 1;
+
+	encodeBytes(&encoder, (const uint8_t *)payload, len);
+	encodeBytes(&encoder, crcbytes, 2);
+
+	*encoder.codeptr = encoder.code;
+	*encoder.out++ = 0;
+
+	return encoder.out - (uint8_t *)out;
+}
+
+int fr_write(struct UART *uart, const void *payload, size_t len) {
+	uint8_t encoded[FR_MAXENCODED];
+	int     size = fr_encode(payload, len, encoded, sizeof(encoded));
+
+	if (size < 0)
+		return size;
+
+	// A frame cut short would also take the next one with it, so wait for
+	// room rather than give up part way
+	int sent = uart_hwrite(uart, encoded, size);
+	while (sent < size) {
+		if (uart_hflush(uart, -1) == -1)
+			return FR_ERROR_WRITE;
+		sent += uart_hwrite(uart, encoded + sent, size - sent);
+	}
+
+	return len;
+}
+
+void fr_initDecoder(struct FrameDecoder *decoder) {
+	memset(decoder, 0, sizeof(struct FrameDecoder));
+}
+
+int fr_decode(struct FrameDecoder *decoder, const void *data, size_t len,
+		size_t *used) {
+	struct iovec iov;
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+
+	return decodeRegions(decoder, &iov, 1, used);
+}
+
+int fr_decodeQueue(struct FrameDecoder *decoder, struct QueueBuffer *qbuf) {
+	struct iovec iov[2];
+	size_t used;
+	int    count, complete;
+
+	// A ring holds at most two regions, a list may have more
+	while ((count = qb_peek(qbuf, iov, 2)) > 0) {
+		complete = decodeRegions(decoder, iov, count, &used);
+		qb_consume(qbuf, used);
+		if (complete)
+			return 1;
+	}
+
+	return 0;
+}
+
+int fr_read(struct FrameDecoder *decoder, struct UART *uart) {
+	struct iovec iov[2];
+	size_t used;
+	int    count, complete;
+
+	while ((count = uart_hpeek(uart, iov, 2)) > 0) {
+		complete = decodeRegions(decoder, iov, count, &used);
+		uart_hconsume(uart, used);
+		if (complete)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+	Encoding
+*/
+
+void encodeBytes(struct Encoder *encoder, const uint8_t *src, size_t len) {
+	while (len > 0) {
+		// Copy up to the next zero, or until the block is full
+		size_t run = COBS_MAXBLOCK + 1 - encoder->code;
+		if (run > len)
+			run = len;
+
+		const uint8_t *zero = memchr(src, 0, run);
+		size_t copy = zero ? (size_t)(zero - src) : run;
+
+		memcpy(encoder->out, src, copy);
+		encoder->out += copy;
+		encoder->code += copy;
+		src += copy;
+		len -= copy;
+
+		// A zero, or a full block, ends the block; the zero itself is
+		// implied by the code byte
+		if (zero) {
+			++src;
+			--len;
+		} else if (encoder->code != COBS_MAXBLOCK + 1)
+			continue;
+
+		*encoder->codeptr = encoder->code;
+		encoder->codeptr = encoder->out++;
+		encoder->code = 1;
+	}
+}
+
+/*
+	Decoding
+*/
+
+int decodeRegions(struct FrameDecoder *decoder, const struct iovec *iov,
+		int count, size_t *used) {
+	int r;
+
+	*used = 0;
+	for (r = 0; r < count; ++r) {
+		const uint8_t *data = (const uint8_t *)iov[r].iov_base;
+		size_t len = iov[r].iov_len,
+		       pos = 0;
+
+		while (pos < len) {
+			if (decoder->remaining == 0) {
+				// At a code byte, or the delimiter
+				uint8_t byte = data[pos++];
+				if (byte == 0) {
+					if (endFrame(decoder)) {
+						*used += pos;
+						return 1;
+					}
+					continue;
+				}
+
+				// The previous block ended with an implied zero, unless it
+				// was full. The first block starts a new frame.
+				if (!decoder->started)
+					decoder->length = 0;
+				else if (decoder->code != COBS_MAXBLOCK + 1)
+					appendBytes(decoder, (const uint8_t *)"", 1);
+
+				decoder->started = 1;
+				decoder->code = byte;
+				decoder->remaining = byte - 1;
+				continue;
+			}
+
+			// Copy the rest of the block, unless a zero cuts it short
+			size_t run = decoder->remaining;
+			if (run > len - pos)
+				run = len - pos;
+
+			const uint8_t *zero = memchr(data + pos, 0, run);
+			if (zero) {
+				// The frame ended early; drop it and start over after the
+				// delimiter
+				pos = zero - data + 1;
+				++decoder->truncated;
+				decoder->remaining = 0;
+				decoder->started = decoder->overflow = 0;
+				continue;
+			}
+
+			appendBytes(decoder, data + pos, run);
+			decoder->remaining -= run;
+			pos += run;
+		}
+
+		*used += len;
+	}
+
+	return 0;
+}
+
+int endFrame(struct FrameDecoder *decoder) {
+	int valid = 0;
+
+	// Consecutive delimiters are just idle line
+	if (decoder->started) {
+		if (decoder->overflow)
+			++decoder->oversized;
+		else if (decoder->length < 2)
+			++decoder->truncated;
+		else if (fr_crc16(decoder->frame, decoder->length) != 0)
+			++decoder->crcerrors;
+		else {
+			decoder->length -= 2;
+			++decoder->frames;
+			valid = 1;
+		}
+	}
+
+	decoder->started = decoder->overflow = 0;
+	return valid;
+}
+
+void appendBytes(struct FrameDecoder *decoder, const uint8_t *src,
+		size_t len) {
+	if (decoder->overflow)
+		return;
+
+	if (decoder->length + len > sizeof(decoder->frame)) {
+		decoder->overflow = 1;
+		return;
+	}
+
+	memcpy(decoder->frame + decoder->length, src, len);
+	decoder->length += len;
+}
@@ -0,0 +1,125 @@
+/**
+	Philip Romano
+	Framing layer for the UART byte stream
+
+	Carries binary packets over a serial link, where any byte value may
+	appear in the data and corruption must be detected. Each frame is:
+
+	  COBS(payload, CRC) 0x00
+
+	The payload is followed by its CRC-16/CCITT (polynomial 0x1021, initial
+	value 0xFFFF, most significant byte first), and the whole is encoded
+	with Consistent Overhead Byte Stuffing, which removes every zero byte
+	at a cost of one byte per 254. A zero then marks the end of each frame,
+	so a receiver that starts mid-stream or loses bytes resynchronizes at
+	the next one.
+
+	Decoding is incremental: bytes can be fed in as they arrive, in pieces
+	of any size, and complete frames come out once their CRC checks.
+	Corrupt, truncated and oversized frames are dropped and counted. All
+	state lives in a struct FrameDecoder owned by the caller; nothing is
+	allocated.
+*/
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queuebuffer.h"
+#include "uart.h"
+
+// Largest payload of a single frame
+#define FR_MAXPAYLOAD 1024
+
+// Largest encoded frame: payload and CRC, one COBS code byte per 254 bytes
+// plus one, and the delimiter
+#define FR_MAXENCODED (FR_MAXPAYLOAD + 2 + (FR_MAXPAYLOAD + 2) / 254 + 2)
+
+// Returned by fr_encode and fr_write when the payload is larger than
+// FR_MAXPAYLOAD or the output buffer is too small
+#define FR_ERROR_SIZE -1
+
+// Returned by fr_write when the frame could not be written to the UART
+#define FR_ERROR_WRITE -2
+
+struct FrameDecoder {
+	// The last complete frame, after a decode function returns 1. Valid
+	// until the next call on this decoder.
+	uint8_t frame[FR_MAXPAYLOAD + 2];
+	size_t  length;
+
+	// Counters since fr_initDecoder
+	size_t frames;    // Frames that passed the CRC check
+	size_t crcerrors; // Frames dropped because the CRC did not match
+	size_t truncated; // Frames dropped because a zero ended them in the
+	                  // middle of a COBS block, or too short for a CRC
+	size_t oversized; // Frames dropped for a payload over FR_MAXPAYLOAD
+
+	// Decoding state, private to framing.c
+	uint8_t code;
+	uint8_t remaining;
+	int     started,
+	        overflow;
+};
+
+/**
+	Compute the CRC-16/CCITT of len bytes of data.
+
+	Running it over a payload followed by its CRC (most significant byte
+	first) gives 0.
+*/
+uint16_t fr_crc16(const void *data, size_t len);
+
+/**
+	Encode a frame holding len bytes of payload into out, which has room for
+	outsize bytes (FR_MAXENCODED is always enough).
+
+	Returns the length of the encoded frame, including its delimiter, or
+	FR_ERROR_SIZE.
+*/
+int fr_encode(const void *payload, size_t len, void *out, size_t outsize);
+
+/**
+	Encode a frame holding len bytes of payload and write it to uart. If the
+	output queue cannot take the whole frame at once, this waits for the
+	device to make room, so frames are never cut short.
+
+	Returns len on success, or FR_ERROR_SIZE or FR_ERROR_WRITE.
+*/
+int fr_write(struct UART *uart, const void *payload, size_t len);
+
+/**
+	Prepare decoder for a new stream. Counters are reset.
+*/
+void fr_initDecoder(struct FrameDecoder *decoder);
+
+/**
+	Feed len bytes of the stream to decoder. Decoding stops as soon as a
+	frame is complete, so the bytes after it are not used yet.
+
+	*used is set to the number of bytes of data that were used. Returns 1
+	if a frame is complete (in decoder->frame, decoder->length bytes),
+	or 0 if all of data was used without completing one.
+*/
+int fr_decode(struct FrameDecoder *decoder, const void *data, size_t len,
+		size_t *used);
+
+/**
+	Decode straight from the contents of qbuf, removing the bytes that were
+	used. Only the consumer of a ring or mirror QueueBuffer may call this.
+
+	Returns 1 if a frame is complete, or 0 once qbuf is empty.
+*/
+int fr_decodeQueue(struct FrameDecoder *decoder, struct QueueBuffer *qbuf);
+
+/**
+	Decode straight from the input queue of uart (see uart_hpeek()),
+	removing the bytes that were used.
+
+	Returns 1 if a frame is complete, or 0 once no more input is queued.
+*/
+int fr_read(struct FrameDecoder *decoder, struct UART *uart);
+
+#endif
@@ -17,6 +17,8 @@
 #include <fcntl.h>
 #include <termios.h>
 
+#include "../ringbuffer.h"
+
 #define PI 3.1415926535
 
 void quit(int code);
@@ -60,7 +62,7 @@ int main(int argc, char **argv) {
 	printf("Set I2C slave\n");
 
 	int bufsize, bytes;
-	char buffer[16];
+	uint8_t buffer[16];
 
 	// Get out of sleep mode
 	buffer[0] = 0x2D; // POWER_CTL register
@@ -168,7 +170,7 @@ int main(int argc, char **argv) {
 		usleep(50000);
 
 		// Check if status register says data is ready
-		char status = 0;
+		uint8_t status = 0;
 		do {
 			bufsize = 1;
 			buffer[0] = 0x09; // Status Register
@@ -265,18 +267,18 @@ int main(int argc, char **argv) {
 
 	printf("Configured gyroscope\n");
 
-	// Sample averaging
+	// Sample averaging over the last NUMSAMPLES readings of each axis
 #define NUMSAMPLES 5
-	int16_t values[NUMSAMPLES][3];
-	int16_t average[3];
-	int currentsample = 0;
+	AxisRingBuffer<int16_t, NUMSAMPLES, 3> gyrohistory;
+	int16_t sample[3];
+	int newsamples = 0;
 
 	done = 0;
 	while (!done) {
 
 		usleep(5000);
 
-		char status = 0;
+		uint8_t status = 0;
 
 		buffer[0] = 0x27; // STATUS_REG. No auto-increment (MSb is 0)
 
@@ -309,7 +311,7 @@ int main(int argc, char **argv) {
 			messages[1].addr  = slaveaddr;
 			messages[1].flags = I2C_M_RD;
 			messages[1].len   = 6;
-			messages[1].buf   = (uint8_t *)&values[currentsample][0];
+			messages[1].buf   = (uint8_t *)sample;
 
 			iodata.nmsgs = 2;
 
@@ -318,26 +320,28 @@ int main(int argc, char **argv) {
 				quit(-1);
 			}
 
-			++currentsample;
-
-			if (currentsample >= NUMSAMPLES) {
-				// Average the gathered samples
-				int i, s;
-				for (i = 0; i < NUMSAMPLES; ++i) {
-					for (s = 0; s < 3; ++s)
-						average[s] += values[i][s];
+			gyrohistory.push(sample);
+			++newsamples;
+
+			if (newsamples >= NUMSAMPLES) {
+				// Average the gathered samples, one contiguous axis at a time
+				int32_t average[3];
+				size_t  i, s;
+				for (s = 0; s < 3; ++s) {
+					const int16_t *axis = gyrohistory.data(s);
+					average[s] = 0;
+					for (i = 0; i < gyrohistory.size(); ++i)
+						average[s] += axis[i];
+					average[s] /= (int32_t)gyrohistory.size();
 				}
-				for (s = 0; s < 3; ++s)
-					average[s] = average[s] / NUMSAMPLES;
 
 				// Print results
 				printf("Status = 0x%02X | ", status);
-				for (i = 0; i < 3; ++i)
-					printf("Value %d = %+06d | ", i, average[i]);
+				for (s = 0; s < 3; ++s)
+					printf("Value %zu = %+06d | ", s, average[s]);
 				printf("\n");
 
-				// Reset back to beginning of sample buffer
-				currentsample = 0;
+				newsamples = 0;
 			}
 		}
 
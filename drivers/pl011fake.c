@@ -0,0 +1,196 @@
+/**
+	Philip Romano
+	Fake PL011 register block for testing the UART driver off-target
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pl011fake.h"
+
+// Registers held, enough to cover every offset up to UART_REGICR
+#define PF_REGISTERS 32
+
+// The block as laid out in the file. Each FIFO is a ring with a single
+// producer and consumer; positions run freely and wrap by masking. The
+// receive FIFO holds each byte with its error flags, as DR reads it.
+struct PL011Block {
+	uint32_t    regs[PF_REGISTERS];
+	uint16_t    rx[UART_PL011FIFO];
+	uint8_t     tx[UART_PL011FIFO];
+	atomic_uint rxhead, rxtail,
+	            txhead, txtail;
+};
+
+struct PL011Fake {
+	struct PL011Block *block;
+};
+
+_Static_assert((UART_PL011FIFO & (UART_PL011FIFO - 1)) == 0,
+		"FIFO depth must be a power of two");
+
+static uint32_t fakeRead(void *context, uint32_t offset);
+static void     fakeWrite(void *context, uint32_t offset, uint32_t value);
+
+// Current value of FR, from the state of the FIFOs
+static uint32_t flags(struct PL011Block *block);
+
+int pf_open(struct PL011Fake **fake, const char *path) {
+	*fake = NULL;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return 0;
+
+	if (ftruncate(fd, sizeof(struct PL011Block)) != 0) {
+		close(fd);
+		return 0;
+	}
+
+	void *map = mmap(NULL, sizeof(struct PL011Block), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	*fake = malloc(sizeof(struct PL011Fake));
+	if (!*fake) {
+		munmap(map, sizeof(struct PL011Block));
+		return 0;
+	}
+
+	// A freshly truncated file reads as zeroes: registers clear, FIFOs empty
+	(*fake)->block = (struct PL011Block *)map;
+	return 1;
+}
+
+void pf_close(struct PL011Fake **fake) {
+	if (!*fake)
+		return;
+
+	munmap((*fake)->block, sizeof(struct PL011Block));
+	free(*fake);
+	*fake = NULL;
+}
+
+void pf_getOps(struct PL011Fake *fake, struct UARTRegisterOps *ops) {
+	ops->read = fakeRead;
+	ops->write = fakeWrite;
+	ops->context = fake->block;
+}
+
+size_t pf_inject(struct PL011Fake *fake, const void *data, size_t len) {
+	return pf_injectErrors(fake, data, len, 0);
+}
+
+size_t pf_injectErrors(struct PL011Fake *fake, const void *data, size_t len,
+		uint32_t errors) {
+	struct PL011Block *block = fake->block;
+	const uint8_t *bytes = (const uint8_t *)data;
+	uint32_t cr = block->regs[UART_REGCR / 4];
+
+	if ((cr & (UART_CRUARTEN | UART_CRRXE)) != (UART_CRUARTEN | UART_CRRXE))
+		return 0;
+
+	unsigned head = atomic_load_explicit(&block->rxhead, memory_order_relaxed),
+	         tail = atomic_load_explicit(&block->rxtail, memory_order_acquire);
+	size_t   count = 0;
+
+	while (count < len && head - tail < UART_PL011FIFO) {
+		block->rx[head % UART_PL011FIFO] =
+				bytes[count++] | (errors & 0xF00);
+		++head;
+	}
+	atomic_store_explicit(&block->rxhead, head, memory_order_release);
+
+	return count;
+}
+
+size_t pf_collect(struct PL011Fake *fake, void *buffer, size_t len) {
+	struct PL011Block *block = fake->block;
+	uint8_t *bytes = (uint8_t *)buffer;
+
+	unsigned tail = atomic_load_explicit(&block->txtail, memory_order_relaxed),
+	         head = atomic_load_explicit(&block->txhead, memory_order_acquire);
+	size_t   count = 0;
+
+	while (count < len && tail != head) {
+		bytes[count++] = block->tx[tail % UART_PL011FIFO];
+		++tail;
+	}
+	atomic_store_explicit(&block->txtail, tail, memory_order_release);
+
+	return count;
+}
+
+uint32_t pf_getRegister(struct PL011Fake *fake, uint32_t offset) {
+	if (offset == UART_REGFR)
+		return flags(fake->block);
+	return fake->block->regs[(offset / 4) % PF_REGISTERS];
+}
+
+uint32_t fakeRead(void *context, uint32_t offset) {
+	struct PL011Block *block = (struct PL011Block *)context;
+
+	if (offset == UART_REGFR)
+		return flags(block);
+
+	if (offset == UART_REGDR) {
+		unsigned tail = atomic_load_explicit(&block->rxtail,
+				memory_order_relaxed);
+		if (tail == atomic_load_explicit(&block->rxhead, memory_order_acquire))
+			return 0; // Empty: undefined on the real UART
+
+		uint32_t value = block->rx[tail % UART_PL011FIFO];
+		atomic_store_explicit(&block->rxtail, tail + 1, memory_order_release);
+		return value;
+	}
+
+	return block->regs[(offset / 4) % PF_REGISTERS];
+}
+
+void fakeWrite(void *context, uint32_t offset, uint32_t value) {
+	struct PL011Block *block = (struct PL011Block *)context;
+
+	if (offset != UART_REGDR) {
+		block->regs[(offset / 4) % PF_REGISTERS] = value;
+		return;
+	}
+
+	uint32_t cr = block->regs[UART_REGCR / 4];
+	if ((cr & (UART_CRUARTEN | UART_CRTXE)) != (UART_CRUARTEN | UART_CRTXE))
+		return;
+
+	// A write to a full FIFO is lost, as on the real UART
+	unsigned head = atomic_load_explicit(&block->txhead, memory_order_relaxed);
+	if (head - atomic_load_explicit(&block->txtail, memory_order_acquire) >=
+			UART_PL011FIFO)
+		return;
+
+	block->tx[head % UART_PL011FIFO] = (uint8_t)value;
+	atomic_store_explicit(&block->txhead, head + 1, memory_order_release);
+}
+
+uint32_t flags(struct PL011Block *block) {
+	unsigned rx = atomic_load(&block->rxhead) - atomic_load(&block->rxtail),
+	         tx = atomic_load(&block->txhead) - atomic_load(&block->txtail);
+	uint32_t fr = 0;
+
+	if (rx == 0)
+		fr |= UART_FRRXFE;
+	if (rx >= UART_PL011FIFO)
+		fr |= UART_FRRXFF;
+	if (tx == 0)
+		fr |= UART_FRTXFE;
+	else
+		fr |= UART_FRBUSY;
+	if (tx >= UART_PL011FIFO)
+		fr |= UART_FRTXFF;
+
+	return fr;
+}
@@ -0,0 +1,71 @@
+/**
+	Philip Romano
+	Fake PL011 register block for testing the UART driver off-target
+
+	Stands in for the UART's registers under UART_BACKENDPL011 (pass the
+	ops from pf_getOps() in UARTOptions.regops). The registers and both
+	FIFOs live in a file mapped shared, so the test or benchmark that plays
+	the far end of the line (pf_inject() and pf_collect()) can be another
+	thread or another process mapping the same file.
+
+	Reads of DR pop the receive FIFO and writes push the transmit FIFO,
+	each UART_PL011FIFO bytes deep; FR reflects both. Every other register
+	just holds what was last written. Bytes only move while CR has UARTEN
+	and RXE (or TXE) set, as on the real UART.
+*/
+
+#ifndef PL011FAKE_H
+#define PL011FAKE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uart.h"
+
+// Contents are private to pl011fake.c
+struct PL011Fake;
+
+/**
+	Create (or truncate) the file at path and map a fresh register block
+	from it, with both FIFOs empty.
+
+	Returns 1 on success, 0 on error.
+*/
+int pf_open(struct PL011Fake **fake, const char *path);
+
+/**
+	Unmap the register block. The file is left in place.
+*/
+void pf_close(struct PL011Fake **fake);
+
+/**
+	Fill in register access to the block, for UARTOptions.regops
+*/
+void pf_getOps(struct PL011Fake *fake, struct UARTRegisterOps *ops);
+
+/**
+	Put up to len bytes on the line into the UART: as many as fit in the
+	receive FIFO. Returns the number accepted.
+*/
+size_t pf_inject(struct PL011Fake *fake, const void *data, size_t len);
+
+/**
+	Like pf_inject(), but each byte arrives flagged with errors: any of
+	UART_DRFE, UART_DRPE, UART_DRBE and UART_DROE.
+*/
+size_t pf_injectErrors(struct PL011Fake *fake, const void *data, size_t len,
+		uint32_t errors);
+
+/**
+	Take up to len bytes the UART has sent out of the transmit FIFO.
+	Returns the number taken.
+*/
+size_t pf_collect(struct PL011Fake *fake, void *buffer, size_t len);
+
+/**
+	Returns the value last written to the register at offset (e.g.
+	UART_REGIBRD), or the current flags for UART_REGFR.
+*/
+uint32_t pf_getRegister(struct PL011Fake *fake, uint32_t offset);
+
+#endif
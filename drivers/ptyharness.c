@@ -0,0 +1,160 @@
+/**
+	Philip Romano
+	Pseudo-terminal harness for testing and benchmarking the UART driver
+*/
+
+#define _GNU_SOURCE // posix_openpt and friends
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "ptyharness.h"
+
+// How often a waiting peer checks whether it has been stopped
+#define PTY_SLICE_MS 50
+
+// Peer thread: run every step in order
+static void *runPeer(void *arg);
+
+// Run a single step. Returns 1 if it completed.
+static int runStep(struct PtyPeer *peer, const struct PtyStep *step);
+
+// Write len bytes to the master side. Returns 1 if all were written.
+static int sendAll(struct PtyPeer *peer, const void *data, size_t len);
+
+int pty_open(char *slavepath, size_t len) {
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (master == -1)
+		return -1;
+
+	if (grantpt(master) != 0 || unlockpt(master) != 0 ||
+			ptsname_r(master, slavepath, len) != 0) {
+		close(master);
+		return -1;
+	}
+
+	struct termios tprops;
+	tcgetattr(master, &tprops);
+	cfmakeraw(&tprops);
+	tcsetattr(master, TCSANOW, &tprops);
+
+	return master;
+}
+
+int pty_startPeer(struct PtyPeer *peer, int master,
+		const struct PtyStep *steps, int count) {
+	memset(peer, 0, sizeof(struct PtyPeer));
+	peer->master = master;
+	peer->steps = steps;
+	peer->count = count;
+
+	return pthread_create(&peer->thread, NULL, runPeer, peer) == 0;
+}
+
+int pty_stopPeer(struct PtyPeer *peer, int timeout) {
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// completed is only a hint here; the join below makes it exact
+	while (*(volatile int *)&peer->completed < peer->count) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timeout >= 0 && (now.tv_sec - start.tv_sec) * 1000 +
+				(now.tv_nsec - start.tv_nsec) / 1000000 >= timeout)
+			break;
+		usleep(1000);
+	}
+
+	peer->stop = 1;
+	pthread_join(peer->thread, NULL);
+
+	return peer->completed == peer->count && peer->mismatched == 0;
+}
+
+void *runPeer(void *arg) {
+	struct PtyPeer *peer = (struct PtyPeer *)arg;
+	int s;
+
+	for (s = 0; s < peer->count && !peer->stop; ++s) {
+		if (!runStep(peer, &peer->steps[s]))
+			break;
+		peer->completed = s + 1;
+	}
+
+	return NULL;
+}
+
+int runStep(struct PtyPeer *peer, const struct PtyStep *step) {
+	if (step->type == PTY_SEND)
+		return sendAll(peer, step->data, step->len);
+
+	const uint8_t *expect = (const uint8_t *)step->data;
+	uint8_t buffer[4096];
+	size_t  done = 0, i;
+	int     idle = 0;
+
+	struct pollfd pfd;
+	pfd.fd = peer->master;
+	pfd.events = POLLIN;
+
+	while (step->len == 0 || done < step->len) {
+		if (peer->stop)
+			return step->len == 0;
+
+		int ready = poll(&pfd, 1, PTY_SLICE_MS);
+		if (ready == -1 && errno != EINTR)
+			return 0;
+		if (ready <= 0) {
+			// Only a fixed-length step can time out
+			idle += PTY_SLICE_MS;
+			if (step->len > 0 && idle >= PTY_TIMEOUT_MS)
+				return 0;
+			continue;
+		}
+		idle = 0;
+
+		size_t want = sizeof(buffer);
+		if (step->len > 0 && want > step->len - done)
+			want = step->len - done;
+
+		ssize_t bytes = read(peer->master, buffer, want);
+		if (bytes <= 0)
+			continue;
+
+		if (step->type == PTY_EXPECT && expect)
+			for (i = 0; i < (size_t)bytes; ++i)
+				if (buffer[i] != expect[done + i])
+					++peer->mismatched;
+
+		peer->received += bytes;
+		done += bytes;
+
+		if (step->type == PTY_ECHO && !sendAll(peer, buffer, bytes))
+			return 0;
+	}
+
+	return 1;
+}
+
+int sendAll(struct PtyPeer *peer, const void *data, size_t len) {
+	const uint8_t *bytes = (const uint8_t *)data;
+	size_t sent = 0;
+
+	while (sent < len) {
+		ssize_t result = write(peer->master, bytes + sent, len - sent);
+		if (result > 0) {
+			sent += result;
+			peer->sent += result;
+		} else if (result == -1 && errno != EINTR && errno != EAGAIN)
+			return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,84 @@
+/**
+	Philip Romano
+	Pseudo-terminal harness for testing and benchmarking the UART driver
+
+	A pseudo-terminal pair stands in for a serial port: the driver opens
+	the slave side by path, as it would /dev/ttyAMA0, and a peer thread
+	plays the device on the master side by following a script of steps
+	(send these bytes, expect those, echo everything). No hardware is
+	needed, so this runs on any Linux machine.
+
+	A pty is not paced by its baud rate, so throughput measured through it
+	is that of the driver and kernel, not of a serial line.
+*/
+
+#ifndef PTYHARNESS_H
+#define PTYHARNESS_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// How long the peer waits for expected bytes before giving up on a step
+#define PTY_TIMEOUT_MS 2000
+
+typedef enum _PtyStepType {
+	// Write len bytes of data to the driver
+	PTY_SEND = 0,
+
+	// Read len bytes from the driver, counting those that differ from data
+	// (if data is not NULL). len 0 reads until pty_stopPeer.
+	PTY_EXPECT = 1,
+
+	// Write back everything read, len bytes (0 until pty_stopPeer), as a
+	// wire from Tx to Rx would
+	PTY_ECHO = 2
+} PtyStepType;
+
+struct PtyStep {
+	PtyStepType type;
+	const void  *data;
+	size_t      len;
+};
+
+struct PtyPeer {
+	// Results, complete once pty_stopPeer returns
+	int    completed;  // Steps finished
+	size_t sent,       // Bytes written to the driver
+	       received,   // Bytes read from the driver
+	       mismatched; // Bytes that differed from PTY_EXPECT data
+
+	// Private to ptyharness.c
+	int                  master;
+	const struct PtyStep *steps;
+	int                  count;
+	volatile int         stop;
+	pthread_t            thread;
+};
+
+/**
+	Open a pseudo-terminal in raw mode, storing the path of its slave side
+	in slavepath (len bytes).
+
+	Returns the master descriptor, or -1 on error.
+*/
+int pty_open(char *slavepath, size_t len);
+
+/**
+	Start a peer thread on master that runs count steps in order. steps
+	must stay valid until pty_stopPeer.
+
+	Returns 1 on success, 0 on error.
+*/
+int pty_startPeer(struct PtyPeer *peer, int master,
+		const struct PtyStep *steps, int count);
+
+/**
+	Wait up to timeout milliseconds (-1 for as long as it takes) for the
+	peer to finish its steps, then stop it. Steps that run until stopped
+	(len 0) end here.
+
+	Returns 1 if every step completed without a mismatch, 0 otherwise.
+*/
+int pty_stopPeer(struct PtyPeer *peer, int timeout);
+
+#endif
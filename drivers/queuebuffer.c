@@ -5,64 +5,604 @@
 	Stores data byte-per-byte in a FIFO structure.
 */
 
+#define _GNU_SOURCE // memfd_create
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <stdio.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "queuebuffer.h"
 
+// Keeps the producer and consumer indices of the ring on separate cache
+// lines, so the two sides don't fight over the same line.
+#define QB_CACHELINE 64
+
+// Largest qb_findAny set compared with SIMD; bigger sets use the table
+#define QB_FIND_SIMDMAX 8
+
+// Bytes searched for by qb_find and qb_findAny
+struct FindSet {
+	const unsigned char *bytes;
+	size_t count;
+	unsigned char table[256]; // Only filled when count > QB_FIND_SIMDMAX
+};
+
+struct QueueBuffer {
+	QBBackend  backend;
+	QBOverflow overflow;
+
+	// QB_BACKEND_LIST
+	struct QueueBufferNode {
+		char buffer[QB_BUFSIZE];
+		char *front, *back;
+		struct QueueBufferNode *next;
+	} *head, *tail,
+	  *freelist;      // Spare nodes, linked through next
+	size_t freecount,
+	       reserve,
+	       size;      // Bytes stored, kept current by push and pop
+
+	// Counters reported by qb_getStats (QB_BACKEND_LIST)
+	size_t highwater,
+	       pushed,
+	       popped,
+	       allocations,
+	       frees,
+	       reused;
+
+	// Overflow counters, written only by the producer (both backends)
+	atomic_size_t dropped,
+	              discarded,
+	              rejected;
+
+	// QB_BACKEND_RING and QB_BACKEND_MIRROR
+	// Indices are free-running; the position in ring is (index & mask).
+	// The difference tail - head is the number of bytes stored.
+	// For QB_BACKEND_MIRROR, ring is followed by a second mapping of the
+	// same pages, so ring[pos + i] == ring[(pos + i) & mask] for any i up to
+	// capacity.
+	char   *ring;
+	size_t capacity,
+	       mask;
+	int    mirrored;
+
+	// Written only by the consumer, except under QB_OVERFLOW_DROP_OLDEST
+	// where the producer may also advance ringhead (with a CAS)
+	_Alignas(QB_CACHELINE) atomic_size_t ringhead;
+	size_t cachedtail; // Consumer's last view of ringtail
+	size_t peekhead;   // ringhead when qb_peek was last called
+	int    peeked;     // Whether peekhead is current
+
+	// Written only by the producer
+	_Alignas(QB_CACHELINE) atomic_size_t ringtail;
+	size_t cachedhead; // Producer's last view of ringhead
+	atomic_size_t ringhighwater;
+};
+
+static void countOverflow(atomic_size_t *counter, size_t n);
+
+static char *mirrorMap(size_t capacity);
+
+static int    findSet(struct QueueBuffer *qbuf, const struct FindSet *set);
+static size_t scanSet(const unsigned char *data, size_t len,
+		const struct FindSet *set);
+
+static struct QueueBufferNode *listNewNode(struct QueueBuffer *qbuf);
+static void listRecycleNode(struct QueueBuffer *qbuf,
+		struct QueueBufferNode *node);
+
+static int    listPush(struct QueueBuffer *qbuf, const char *cbuffer,
+		size_t len);
+static int    listPop(struct QueueBuffer *qbuf, char *cbuffer, size_t numbytes);
+static int    listGetSize(struct QueueBuffer *qbuf);
+static int    listReserve(struct QueueBuffer *qbuf, void **ptr, size_t *len);
+static size_t listCommit(struct QueueBuffer *qbuf, size_t numbytes);
+static int    listPeek(struct QueueBuffer *qbuf, struct iovec *iov, int iovcnt);
+static size_t listConsume(struct QueueBuffer *qbuf, size_t numbytes);
+
+static size_t ringContiguous(struct QueueBuffer *qbuf, size_t pos);
+static int    ringPush(struct QueueBuffer *qbuf, const char *cbuffer,
+		size_t len);
+static int    ringPop(struct QueueBuffer *qbuf, char *cbuffer, size_t numbytes);
+static int    ringPopShared(struct QueueBuffer *qbuf, char *cbuffer,
+		size_t numbytes);
+static int    ringGetSize(struct QueueBuffer *qbuf);
+static int    ringReserve(struct QueueBuffer *qbuf, void **ptr, size_t *len);
+static size_t ringCommit(struct QueueBuffer *qbuf, size_t numbytes);
+static int    ringPeek(struct QueueBuffer *qbuf, struct iovec *iov, int iovcnt);
+static size_t ringConsume(struct QueueBuffer *qbuf, size_t numbytes);
+
 void qb_initialize(struct QueueBuffer **qbuf) {
+	struct QueueBufferConfig config;
+	config.backend = QB_BACKEND_LIST;
+	config.capacity = 0;
+	config.reserve = QB_DEFAULT_RESERVE;
+	config.overflow = QB_OVERFLOW_DROP_NEWEST;
+
+	qb_initializeWithConfig(qbuf, &config);
+}
+
+int qb_initializeWithConfig(struct QueueBuffer **qbuf,
+		const struct QueueBufferConfig *config) {
 	if (!qbuf)
-		return;
+		return 0;
+
+	*qbuf = NULL;
+	if (!config)
+		return 0;
+
+	struct QueueBuffer *q;
+	if (posix_memalign((void **)&q, QB_CACHELINE, sizeof(struct QueueBuffer)))
+		return 0;
+	memset(q, 0, sizeof(struct QueueBuffer));
+	q->backend = config->backend;
+	q->overflow = config->overflow;
+	atomic_init(&q->dropped, 0);
+	atomic_init(&q->discarded, 0);
+	atomic_init(&q->rejected, 0);
+
+	if (config->capacity > (size_t)INT32_MAX ||
+			config->overflow < QB_OVERFLOW_DROP_NEWEST ||
+			config->overflow > QB_OVERFLOW_REJECT) {
+		free(q);
+		return 0;
+	}
+
+	switch (config->backend) {
+		case QB_BACKEND_LIST: {
+			// One node in use plus the spares on the free list
+			size_t n;
+			for (n = 0; n < config->reserve + 1; ++n) {
+				struct QueueBufferNode *node =
+						malloc(sizeof(struct QueueBufferNode));
+				if (!node) {
+					qb_free(&q);
+					return 0;
+				}
+				++q->allocations;
+				node->next = q->freelist;
+				q->freelist = node;
+				++q->freecount;
+			}
+			q->reserve = config->reserve;
+			q->capacity = config->capacity;
+
+			q->head = q->tail = listNewNode(q);
+			break;
+		}
+
+		case QB_BACKEND_RING: {
+			if (config->capacity == 0) {
+				free(q);
+				return 0;
+			}
 
-	*qbuf = malloc(sizeof(struct QueueBuffer));
+			size_t capacity = 1;
+			while (capacity < config->capacity)
+				capacity <<= 1;
 
-	(*qbuf)->head = malloc(sizeof(struct QueueBufferNode));
-	(*qbuf)->tail = (*qbuf)->head;
+			if (posix_memalign((void **)&q->ring, QB_CACHELINE, capacity)) {
+				free(q);
+				return 0;
+			}
+			q->capacity = capacity;
+			q->mask = capacity - 1;
+			atomic_init(&q->ringhead, 0);
+			atomic_init(&q->ringtail, 0);
+			atomic_init(&q->ringhighwater, 0);
+			break;
+		}
+
+		case QB_BACKEND_MIRROR: {
+			if (config->capacity == 0) {
+				free(q);
+				return 0;
+			}
 
-	(*qbuf)->head->front =
-	(*qbuf)->head->back  = (*qbuf)->head->buffer;
-	(*qbuf)->head->next  = NULL;
+			// Each half must be whole pages to be mapped twice
+			size_t capacity = sysconf(_SC_PAGESIZE);
+			while (capacity < config->capacity)
+				capacity <<= 1;
+
+			q->ring = mirrorMap(capacity);
+			if (!q->ring) {
+				free(q);
+				return 0;
+			}
+			q->mirrored = 1;
+			q->capacity = capacity;
+			q->mask = capacity - 1;
+			atomic_init(&q->ringhead, 0);
+			atomic_init(&q->ringtail, 0);
+			atomic_init(&q->ringhighwater, 0);
+			break;
+		}
+
+		default:
+			free(q);
+			return 0;
+	}
+
+	*qbuf = q;
+	return 1;
 }
 
 void qb_free(struct QueueBuffer **qbuf) {
 	if (!qbuf || !*qbuf)
 		return;
 
-	struct QueueBufferNode *current = (*qbuf)->head, *temp;
-	while (current != NULL) {
-		temp = current->next;
-		free(current);
-		current = temp;
+	struct QueueBufferNode *lists[2] = { (*qbuf)->head, (*qbuf)->freelist },
+	                       *current, *temp;
+	int l;
+	for (l = 0; l < 2; ++l) {
+		current = lists[l];
+		while (current != NULL) {
+			temp = current->next;
+			free(current);
+			current = temp;
+		}
 	}
 
+	if ((*qbuf)->mirrored)
+		munmap((*qbuf)->ring, 2 * (*qbuf)->capacity);
+	else
+		free((*qbuf)->ring);
 	free(*qbuf);
 	*qbuf = NULL;
 }
 
-void qb_push(struct QueueBuffer *qbuf, const void *buffer, size_t len) {
+int qb_push(struct QueueBuffer *qbuf, const void *buffer, size_t len) {
 	if (!qbuf)
+		return 0;
+
+	if (qbuf->backend != QB_BACKEND_LIST)
+		return ringPush(qbuf, (const char *)buffer, len);
+	else
+		return listPush(qbuf, (const char *)buffer, len);
+}
+
+int qb_reserve(struct QueueBuffer *qbuf, void **ptr, size_t *len) {
+	if (!qbuf || !ptr || !len)
+		return 0;
+
+	if (qbuf->backend != QB_BACKEND_LIST)
+		return ringReserve(qbuf, ptr, len);
+	else
+		return listReserve(qbuf, ptr, len);
+}
+
+size_t qb_commit(struct QueueBuffer *qbuf, size_t numbytes) {
+	if (!qbuf)
+		return 0;
+
+	if (qbuf->backend != QB_BACKEND_LIST)
+		return ringCommit(qbuf, numbytes);
+	else
+		return listCommit(qbuf, numbytes);
+}
+
+int qb_pop(struct QueueBuffer *qbuf, void *buffer, size_t numbytes) {
+	if (!qbuf)
+		return 0;
+
+	if (qbuf->backend != QB_BACKEND_LIST)
+		return ringPop(qbuf, (char *)buffer, numbytes);
+	else
+		return listPop(qbuf, (char *)buffer, numbytes);
+}
+
+int qb_peek(struct QueueBuffer *qbuf, struct iovec *iov, int iovcnt) {
+	if (!qbuf || !iov || iovcnt <= 0)
+		return 0;
+
+	if (qbuf->backend != QB_BACKEND_LIST)
+		return ringPeek(qbuf, iov, iovcnt);
+	else
+		return listPeek(qbuf, iov, iovcnt);
+}
+
+size_t qb_consume(struct QueueBuffer *qbuf, size_t numbytes) {
+	if (!qbuf)
+		return 0;
+
+	if (qbuf->backend != QB_BACKEND_LIST)
+		return ringConsume(qbuf, numbytes);
+	else
+		return listConsume(qbuf, numbytes);
+}
+
+int qb_find(struct QueueBuffer *qbuf, int byte) {
+	unsigned char c = (unsigned char)byte;
+	struct FindSet set;
+
+	if (!qbuf)
+		return QB_NOT_FOUND;
+
+	set.bytes = &c;
+	set.count = 1;
+	return findSet(qbuf, &set);
+}
+
+int qb_findAny(struct QueueBuffer *qbuf, const void *set, size_t setlen) {
+	struct FindSet findset;
+	size_t i;
+
+	if (!qbuf || !set || setlen == 0)
+		return QB_NOT_FOUND;
+
+	findset.bytes = (const unsigned char *)set;
+	findset.count = setlen;
+	if (setlen > QB_FIND_SIMDMAX) {
+		memset(findset.table, 0, sizeof(findset.table));
+		for (i = 0; i < setlen; ++i)
+			findset.table[findset.bytes[i]] = 1;
+	}
+
+	return findSet(qbuf, &findset);
+}
+
+int qb_popUntil(struct QueueBuffer *qbuf, void *buffer, size_t numbytes,
+		const void *set, size_t setlen) {
+	int offset = qb_findAny(qbuf, set, setlen);
+
+	if (offset == QB_NOT_FOUND || (size_t)offset >= numbytes) {
+		if ((size_t)qb_getSize(qbuf) < numbytes)
+			return 0;
+		return qb_pop(qbuf, buffer, numbytes);
+	}
+
+	return qb_pop(qbuf, buffer, offset + 1);
+}
+
+int qb_getSize(struct QueueBuffer *qbuf) {
+	if (!qbuf)
+		return 0;
+
+	if (qbuf->backend != QB_BACKEND_LIST)
+		return ringGetSize(qbuf);
+	else
+		return listGetSize(qbuf);
+}
+
+void qb_getStats(struct QueueBuffer *qbuf, struct QueueBufferStats *stats) {
+	if (!stats)
 		return;
 
-	const char *cbuffer = (const char*)buffer;
-	int i = 0,
-	    delta;
+	memset(stats, 0, sizeof(struct QueueBufferStats));
+	if (!qbuf)
+		return;
+
+	if (qbuf->backend != QB_BACKEND_LIST) {
+		// The free-running indices double as byte totals
+		stats->popped = atomic_load_explicit(&qbuf->ringhead,
+				memory_order_relaxed);
+		stats->pushed = atomic_load_explicit(&qbuf->ringtail,
+				memory_order_relaxed);
+		stats->size = stats->pushed - stats->popped;
+		if (stats->size > qbuf->capacity)
+			stats->size = qbuf->capacity; // Raced with a drop
+		stats->highwater = atomic_load_explicit(&qbuf->ringhighwater,
+				memory_order_relaxed);
+		stats->allocations = 1;
+	} else {
+		stats->size = qbuf->size;
+		stats->highwater = qbuf->highwater;
+		stats->pushed = qbuf->pushed;
+		stats->popped = qbuf->popped;
+		stats->allocations = qbuf->allocations;
+		stats->frees = qbuf->frees;
+		stats->reused = qbuf->reused;
+	}
+
+	stats->dropped = atomic_load_explicit(&qbuf->dropped, memory_order_relaxed);
+	stats->discarded = atomic_load_explicit(&qbuf->discarded,
+			memory_order_relaxed);
+	stats->rejected = atomic_load_explicit(&qbuf->rejected,
+			memory_order_relaxed);
+
+	// Bytes dropped from the front were removed without being popped
+	stats->popped -= stats->dropped;
+}
+
+size_t qb_getCapacity(struct QueueBuffer *qbuf) {
+	if (!qbuf)
+		return 0;
+
+	return qbuf->capacity;
+}
+
+void countOverflow(atomic_size_t *counter, size_t n) {
+	// Each counter has a single writer, so no read-modify-write is needed
+	if (n > 0)
+		atomic_store_explicit(counter,
+				atomic_load_explicit(counter, memory_order_relaxed) + n,
+				memory_order_relaxed);
+}
+
+int findSet(struct QueueBuffer *qbuf, const struct FindSet *set) {
+	size_t offset = 0, found;
+
+	if (qbuf->backend == QB_BACKEND_LIST) {
+		struct QueueBufferNode *current;
+		for (current = qbuf->head; current != NULL; current = current->next) {
+			size_t len = current->back - current->front;
+			found = scanSet((const unsigned char *)current->front, len, set);
+			if (found < len)
+				return offset + found;
+			offset += len;
+		}
+	} else {
+		// At most two regions: up to the end of the ring, then from its start
+		struct iovec iov[2];
+		int count = ringPeek(qbuf, iov, 2), r;
+		for (r = 0; r < count; ++r) {
+			found = scanSet((const unsigned char *)iov[r].iov_base,
+					iov[r].iov_len, set);
+			if (found < iov[r].iov_len)
+				return offset + found;
+			offset += iov[r].iov_len;
+		}
+	}
+
+	return QB_NOT_FOUND;
+}
+
+/*
+	Returns the index of the first byte of data that is in set, or len if
+	there is none.
+*/
+size_t scanSet(const unsigned char *data, size_t len,
+		const struct FindSet *set) {
+	size_t i = 0, k;
+
+	if (set->count == 1) {
+		// The C library's memchr is already vectorized
+		const unsigned char *match = memchr(data, set->bytes[0], len);
+		return match ? (size_t)(match - data) : len;
+	}
+
+	if (set->count > QB_FIND_SIMDMAX) {
+		for (; i < len; ++i)
+			if (set->table[data[i]])
+				return i;
+		return len;
+	}
+
+#if defined(__SSE2__)
+	__m128i needles[QB_FIND_SIMDMAX];
+	for (k = 0; k < set->count; ++k)
+		needles[k] = _mm_set1_epi8((char)set->bytes[k]);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + i)),
+		        hits  = _mm_cmpeq_epi8(chunk, needles[0]);
+		for (k = 1; k < set->count; ++k)
+			hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[k]));
+
+		int mask = _mm_movemask_epi8(hits);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t needles[QB_FIND_SIMDMAX];
+	for (k = 0; k < set->count; ++k)
+		needles[k] = vdupq_n_u8(set->bytes[k]);
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t chunk = vld1q_u8(data + i),
+		           hits  = vceqq_u8(chunk, needles[0]);
+		for (k = 1; k < set->count; ++k)
+			hits = vorrq_u8(hits, vceqq_u8(chunk, needles[k]));
+
+		// Narrow each 8-bit lane result to 4 bits of a 64-bit mask
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+		if (mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+
+	for (; i < len; ++i)
+		for (k = 0; k < set->count; ++k)
+			if (data[i] == set->bytes[k])
+				return i;
+
+	return len;
+}
+
+char *mirrorMap(size_t capacity) {
+	int fd = memfd_create("queuebuffer", MFD_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	if (ftruncate(fd, capacity) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	// Reserve address space for both halves, then map the file over each
+	char *base = mmap(NULL, 2 * capacity, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	if (mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+				fd, 0) == MAP_FAILED ||
+			mmap(base + capacity, capacity, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, 2 * capacity);
+		close(fd);
+		return NULL;
+	}
+
+	// The mappings keep the memory alive
+	close(fd);
+	return base;
+}
+
+/*
+	QB_BACKEND_LIST
+*/
+
+int listPush(struct QueueBuffer *qbuf, const char *cbuffer, size_t len) {
+	size_t i = 0,
+	       delta;
+
+	if (qbuf->capacity && len > qbuf->capacity - qbuf->size) {
+		switch (qbuf->overflow) {
+			case QB_OVERFLOW_REJECT:
+				countOverflow(&qbuf->rejected, 1);
+				countOverflow(&qbuf->discarded, len);
+				return QB_ERROR_FULL;
+
+			case QB_OVERFLOW_DROP_OLDEST:
+				// Only the newest capacity bytes could ever fit
+				if (len > qbuf->capacity) {
+					countOverflow(&qbuf->discarded, len - qbuf->capacity);
+					cbuffer += len - qbuf->capacity;
+					len = qbuf->capacity;
+				}
+				countOverflow(&qbuf->dropped,
+						listPop(qbuf, NULL, len - (qbuf->capacity - qbuf->size)));
+				break;
+
+			default:
+				countOverflow(&qbuf->discarded,
+						len - (qbuf->capacity - qbuf->size));
+				len = qbuf->capacity - qbuf->size;
+				break;
+		}
+	}
 
 	while (i < len) {
 		// If the current node is full, add a new node to the back
 		if (qbuf->tail->back - qbuf->tail->buffer >= QB_BUFSIZE) {
-			qbuf->tail->next = malloc(sizeof(struct QueueBufferNode));
-			qbuf->tail = qbuf->tail->next;
-
-			qbuf->tail->front = 
-			qbuf->tail->back  = qbuf->tail->buffer;
-			qbuf->tail->next  = NULL;
+			struct QueueBufferNode *node = listNewNode(qbuf);
+			if (!node)
+				break;
+			qbuf->tail->next = node;
+			qbuf->tail = node;
 		}
 
 		// If not enough space in this block, only fill to end of the block
-		if (len - i > QB_BUFSIZE - (qbuf->tail->back - qbuf->tail->buffer))
-			delta = QB_BUFSIZE - (qbuf->tail->back - qbuf->tail->buffer);
+		size_t room = QB_BUFSIZE - (size_t)(qbuf->tail->back -
+				qbuf->tail->buffer);
+		if (len - i > room)
+			delta = room;
 
 		// Otherwise, copy the remainder of the buffer into this block
 		else
@@ -77,27 +617,33 @@ void qb_push(struct QueueBuffer *qbuf, const void *buffer, size_t len) {
 //		++qbuf->tail->back;
 //		++i;
 	}
-}
 
-int qb_pop(struct QueueBuffer *qbuf, void *buffer, size_t numbytes) {
-	if (!qbuf)
-		return 0;
+	qbuf->size += i;
+	qbuf->pushed += i;
+	if (qbuf->size > qbuf->highwater)
+		qbuf->highwater = qbuf->size;
 
-	struct QueueBufferNode *current = qbuf->head;
-	char *cbuffer = (char *)buffer;
-	int i = 0,
-	    delta;
+	return i;
+}
+
+int listPop(struct QueueBuffer *qbuf, char *cbuffer, size_t numbytes) {
+	size_t i = 0,
+	       delta;
 
 	while (i < numbytes) {
 		// Check if the head node is empty
 		if (qbuf->head->front == qbuf->head->back) {
 			if (qbuf->head->next == NULL) {
-				// There is no more data; buffer is now empty
-				return i;
+				// There is no more data; buffer is now empty. Rewind the
+				// node so the next push starts at the beginning of it
+				// instead of needing a new node.
+				qbuf->head->front =
+				qbuf->head->back  = qbuf->head->buffer;
+				break;
 			} else {
-				// Move onto the next node, freeing the old head
+				// Move onto the next node, recycling the old head
 				struct QueueBufferNode *temp = qbuf->head->next;
-				free(qbuf->head);
+				listRecycleNode(qbuf, qbuf->head);
 				qbuf->head = temp;
 			}
 		}
@@ -106,7 +652,10 @@ int qb_pop(struct QueueBuffer *qbuf, void *buffer, size_t numbytes) {
 		if (numbytes - i < delta)
 			delta = numbytes - i;
 
-		memcpy(cbuffer + i, qbuf->head->front, delta);
+		// cbuffer is NULL when called through qb_consume (listConsume), or
+		// to drop the oldest data from listPush
+		if (cbuffer)
+			memcpy(cbuffer + i, qbuf->head->front, delta);
 		qbuf->head->front += delta;
 		i += delta;
 
@@ -116,20 +665,369 @@ int qb_pop(struct QueueBuffer *qbuf, void *buffer, size_t numbytes) {
 //		++i;
 	}
 
+	qbuf->size -= i;
+	qbuf->popped += i;
+
 	return i;
 }
 
-int qb_getSize(struct QueueBuffer *qbuf) {
-	if (!qbuf)
+int listGetSize(struct QueueBuffer *qbuf) {
+	return qbuf->size;
+}
+
+int listReserve(struct QueueBuffer *qbuf, void **ptr, size_t *len) {
+	if (qbuf->capacity && qbuf->size >= qbuf->capacity)
 		return 0;
 
-	int size = 0;
+	if (qbuf->tail->back - qbuf->tail->buffer >= QB_BUFSIZE) {
+		struct QueueBufferNode *node = listNewNode(qbuf);
+		if (!node)
+			return 0;
+		qbuf->tail->next = node;
+		qbuf->tail = node;
+	}
+
+	*ptr = qbuf->tail->back;
+	*len = QB_BUFSIZE - (qbuf->tail->back - qbuf->tail->buffer);
+	if (qbuf->capacity && *len > qbuf->capacity - qbuf->size)
+		*len = qbuf->capacity - qbuf->size;
+	return 1;
+}
+
+size_t listCommit(struct QueueBuffer *qbuf, size_t numbytes) {
+	size_t space = QB_BUFSIZE - (qbuf->tail->back - qbuf->tail->buffer);
+	if (qbuf->capacity && space > qbuf->capacity - qbuf->size)
+		space = qbuf->capacity - qbuf->size;
+	if (numbytes > space)
+		numbytes = space;
+
+	qbuf->tail->back += numbytes;
+
+	qbuf->size += numbytes;
+	qbuf->pushed += numbytes;
+	if (qbuf->size > qbuf->highwater)
+		qbuf->highwater = qbuf->size;
+
+	return numbytes;
+}
+
+int listPeek(struct QueueBuffer *qbuf, struct iovec *iov, int iovcnt) {
 	struct QueueBufferNode *current = qbuf->head;
-	while (current != NULL) {
-		size += current->back - current->front;
+	int n = 0;
+
+	while (current != NULL && n < iovcnt) {
+		if (current->back != current->front) {
+			iov[n].iov_base = current->front;
+			iov[n].iov_len  = current->back - current->front;
+			++n;
+		}
 		current = current->next;
 	}
 
-	return size;
+	return n;
+}
+
+size_t listConsume(struct QueueBuffer *qbuf, size_t numbytes) {
+	return listPop(qbuf, NULL, numbytes);
+}
+
+struct QueueBufferNode *listNewNode(struct QueueBuffer *qbuf) {
+	struct QueueBufferNode *node;
+
+	if (qbuf->freelist) {
+		node = qbuf->freelist;
+		qbuf->freelist = node->next;
+		--qbuf->freecount;
+		++qbuf->reused;
+	} else {
+		node = malloc(sizeof(struct QueueBufferNode));
+		if (!node)
+			return NULL;
+		++qbuf->allocations;
+	}
+
+	node->front =
+	node->back  = node->buffer;
+	node->next  = NULL;
+
+	return node;
+}
+
+void listRecycleNode(struct QueueBuffer *qbuf, struct QueueBufferNode *node) {
+	// Keep up to reserve spares; anything beyond that was a burst and is
+	// given back to the system
+	if (qbuf->freecount < qbuf->reserve) {
+		node->next = qbuf->freelist;
+		qbuf->freelist = node;
+		++qbuf->freecount;
+	} else {
+		free(node);
+		++qbuf->frees;
+	}
+}
+
+/*
+	QB_BACKEND_RING and QB_BACKEND_MIRROR
+
+	Single-producer/single-consumer. The producer owns ringtail and the
+	consumer owns ringhead; each side publishes its index with a release
+	store after touching the data, and reads the other side's index with an
+	acquire load before touching the data.
+*/
+
+size_t ringContiguous(struct QueueBuffer *qbuf, size_t pos) {
+	// With the mirror mapping, capacity bytes from any position are
+	// contiguous
+	return qbuf->mirrored ? qbuf->capacity : qbuf->capacity - pos;
+}
+
+int ringPush(struct QueueBuffer *qbuf, const char *cbuffer, size_t len) {
+	size_t tail = atomic_load_explicit(&qbuf->ringtail, memory_order_relaxed);
+
+	// Only refresh the view of the consumer's index when it looks full
+	if (qbuf->capacity - (tail - qbuf->cachedhead) < len)
+		qbuf->cachedhead =
+			atomic_load_explicit(&qbuf->ringhead, memory_order_acquire);
+
+	size_t space = qbuf->capacity - (tail - qbuf->cachedhead);
+	if (len > space) {
+		switch (qbuf->overflow) {
+			case QB_OVERFLOW_REJECT:
+				countOverflow(&qbuf->rejected, 1);
+				countOverflow(&qbuf->discarded, len);
+				return QB_ERROR_FULL;
+
+			case QB_OVERFLOW_DROP_OLDEST: {
+				if (len > qbuf->capacity) {
+					countOverflow(&qbuf->discarded, len - qbuf->capacity);
+					cbuffer += len - qbuf->capacity;
+					len = qbuf->capacity;
+				}
+
+				// Claim the oldest bytes by moving the consumer's index past
+				// them. A failed CAS means the consumer moved it first, which
+				// may already have made enough room.
+				size_t head = qbuf->cachedhead, room;
+				while ((room = qbuf->capacity - (tail - head)) < len) {
+					if (atomic_compare_exchange_weak_explicit(&qbuf->ringhead,
+							&head, head + (len - room), memory_order_acq_rel,
+							memory_order_acquire)) {
+						countOverflow(&qbuf->dropped, len - room);
+						head += len - room;
+						// Make the drop visible before the bytes that
+						// overwrite it (see ringPopShared)
+						atomic_thread_fence(memory_order_release);
+						break;
+					}
+				}
+				qbuf->cachedhead = head;
+				break;
+			}
+
+			default:
+				countOverflow(&qbuf->discarded, len - space);
+				len = space;
+				break;
+		}
+	}
+	if (len == 0)
+		return 0;
+
+	// Copy in at most two pieces: up to the end of the ring, then from
+	// the start
+	size_t pos   = tail & qbuf->mask,
+	       first = ringContiguous(qbuf, pos);
+	if (first > len)
+		first = len;
+
+	memcpy(qbuf->ring + pos, cbuffer, first);
+	memcpy(qbuf->ring, cbuffer + first, len - first);
+
+	atomic_store_explicit(&qbuf->ringtail, tail + len, memory_order_release);
+
+	// The cached head may be stale and overstate the size; only pay for a
+	// fresh look when it suggests a new high-water mark
+	size_t highwater = atomic_load_explicit(&qbuf->ringhighwater,
+			memory_order_relaxed);
+	if (tail + len - qbuf->cachedhead > highwater) {
+		qbuf->cachedhead =
+			atomic_load_explicit(&qbuf->ringhead, memory_order_acquire);
+		if (tail + len - qbuf->cachedhead > highwater)
+			atomic_store_explicit(&qbuf->ringhighwater,
+					tail + len - qbuf->cachedhead, memory_order_relaxed);
+	}
+
+	return len;
+}
+
+int ringPop(struct QueueBuffer *qbuf, char *cbuffer, size_t numbytes) {
+	if (qbuf->overflow == QB_OVERFLOW_DROP_OLDEST)
+		return ringPopShared(qbuf, cbuffer, numbytes);
+
+	size_t head = atomic_load_explicit(&qbuf->ringhead, memory_order_relaxed);
+
+	if (qbuf->cachedtail - head < numbytes)
+		qbuf->cachedtail =
+			atomic_load_explicit(&qbuf->ringtail, memory_order_acquire);
+
+	size_t avail = qbuf->cachedtail - head;
+	if (numbytes > avail)
+		numbytes = avail;
+	if (numbytes == 0)
+		return 0;
+
+	size_t pos   = head & qbuf->mask,
+	       first = ringContiguous(qbuf, pos);
+	if (first > numbytes)
+		first = numbytes;
+
+	// cbuffer is NULL when called through qb_consume
+	if (cbuffer) {
+		memcpy(cbuffer, qbuf->ring + pos, first);
+		memcpy(cbuffer + first, qbuf->ring, numbytes - first);
+	}
+
+	atomic_store_explicit(&qbuf->ringhead, head + numbytes,
+			memory_order_release);
+	qbuf->peeked = 0;
+	return numbytes;
+}
+
+/*
+	ringPop for QB_OVERFLOW_DROP_OLDEST, where the producer may move ringhead
+	too. The producer may drop the front of what was copied and reuse its
+	space while the copy is being made, but nothing at or past the current
+	ringhead has been overwritten, so that part of the copy is kept. The pop
+	only starts over when all of it was dropped.
+*/
+int ringPopShared(struct QueueBuffer *qbuf, char *cbuffer, size_t numbytes) {
+	size_t head, tail, front, count, skip, want = numbytes;
+
+	head = atomic_load_explicit(&qbuf->ringhead, memory_order_acquire);
+	for (;;) {
+		tail = atomic_load_explicit(&qbuf->ringtail, memory_order_acquire);
+
+		if (!cbuffer && qbuf->peeked) {
+			// qb_consume after qb_peek: only remove bytes the caller saw
+			if (head - qbuf->peekhead >= want)
+				count = 0;
+			else
+				count = want - (head - qbuf->peekhead);
+		} else
+			count = want;
+
+		if (count > tail - head)
+			count = tail - head;
+		if (count == 0)
+			break;
+
+		if (cbuffer) {
+			size_t pos   = head & qbuf->mask,
+			       first = ringContiguous(qbuf, pos);
+			if (first > count)
+				first = count;
+
+			memcpy(cbuffer, qbuf->ring + pos, first);
+			memcpy(cbuffer + first, qbuf->ring, count - first);
+		}
+
+		// Pairs with the fence in ringPush: a head read after the copy is at
+		// least as far as any drop whose new bytes the copy could have seen
+		atomic_thread_fence(memory_order_acquire);
+		front = atomic_load_explicit(&qbuf->ringhead, memory_order_relaxed);
+		while (front - head < count) {
+			if (atomic_compare_exchange_weak_explicit(&qbuf->ringhead, &front,
+					head + count, memory_order_acq_rel, memory_order_relaxed)) {
+				skip = front - head;
+				if (cbuffer && skip > 0)
+					memmove(cbuffer, cbuffer + skip, count - skip);
+				qbuf->peeked = 0;
+				return count - skip;
+			}
+		}
+
+		// Everything copied was dropped; try again from the new front
+		head = front;
+	}
+
+	qbuf->peeked = 0;
+	return 0;
+}
+
+int ringReserve(struct QueueBuffer *qbuf, void **ptr, size_t *len) {
+	size_t tail = atomic_load_explicit(&qbuf->ringtail, memory_order_relaxed);
+	qbuf->cachedhead =
+		atomic_load_explicit(&qbuf->ringhead, memory_order_acquire);
+
+	size_t space = qbuf->capacity - (tail - qbuf->cachedhead);
+	if (space == 0)
+		return 0;
+
+	// Only the part up to the end of the ring is contiguous
+	size_t pos   = tail & qbuf->mask,
+	       first = ringContiguous(qbuf, pos);
+	if (first > space)
+		first = space;
+
+	*ptr = qbuf->ring + pos;
+	*len = first;
+	return 1;
+}
+
+size_t ringCommit(struct QueueBuffer *qbuf, size_t numbytes) {
+	size_t tail = atomic_load_explicit(&qbuf->ringtail, memory_order_relaxed),
+	       space = qbuf->capacity - (tail - qbuf->cachedhead);
+	if (numbytes > space)
+		numbytes = space;
+
+	atomic_store_explicit(&qbuf->ringtail, tail + numbytes,
+			memory_order_release);
+
+	size_t highwater = atomic_load_explicit(&qbuf->ringhighwater,
+			memory_order_relaxed);
+	if (tail + numbytes - qbuf->cachedhead > highwater)
+		atomic_store_explicit(&qbuf->ringhighwater,
+				tail + numbytes - qbuf->cachedhead, memory_order_relaxed);
+
+	return numbytes;
+}
+
+int ringPeek(struct QueueBuffer *qbuf, struct iovec *iov, int iovcnt) {
+	size_t head = atomic_load_explicit(&qbuf->ringhead, memory_order_acquire);
+	qbuf->cachedtail =
+		atomic_load_explicit(&qbuf->ringtail, memory_order_acquire);
+
+	size_t avail = qbuf->cachedtail - head;
+	qbuf->peekhead = head;
+	qbuf->peeked = 1;
+	if (avail == 0)
+		return 0;
+
+	size_t pos   = head & qbuf->mask,
+	       first = ringContiguous(qbuf, pos);
+	if (first > avail)
+		first = avail;
+
+	iov[0].iov_base = qbuf->ring + pos;
+	iov[0].iov_len  = first;
+	if (first == avail || iovcnt < 2)
+		return 1;
+
+	iov[1].iov_base = qbuf->ring;
+	iov[1].iov_len  = avail - first;
+	return 2;
+}
+
+size_t ringConsume(struct QueueBuffer *qbuf, size_t numbytes) {
+	return ringPop(qbuf, NULL, numbytes);
+}
+
+int ringGetSize(struct QueueBuffer *qbuf) {
+	// Load head first: tail can only move further ahead afterward, so the
+	// difference can never go negative
+	size_t head = atomic_load_explicit(&qbuf->ringhead, memory_order_acquire),
+	       tail = atomic_load_explicit(&qbuf->ringtail, memory_order_acquire);
+
+	return tail - head;
 }
 
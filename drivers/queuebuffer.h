@@ -3,28 +3,128 @@
 	QueueBuffer data structure
 
 	Stores data byte-per-byte in a FIFO structure.
+
+	Three storage backends are available, selected when the QueueBuffer is
+	initialized:
+
+	QB_BACKEND_LIST
+		Unbounded linked list of QB_BUFSIZE-byte nodes. Emptied nodes are kept
+		on a per-QueueBuffer free list (up to the configured reserve) and
+		reused, so a queue that stays within its reserve never calls malloc()
+		or free() after initialization. Not safe to use from more than one
+		thread, or from a signal handler.
+
+	QB_BACKEND_RING
+		Fixed-capacity ring buffer (capacity rounded up to a power of two).
+		Safe for exactly one producer (qb_push) and one consumer (qb_pop),
+		which may be different threads, or a signal handler and the thread it
+		interrupts. Never allocates memory after initialization, and qb_push
+		is async-signal-safe.
+
+	QB_BACKEND_MIRROR
+		Same as QB_BACKEND_RING, but the storage is mapped twice, back to
+		back, in virtual memory (capacity rounded up to a power-of-two number
+		of pages). Every stored span is therefore contiguous: qb_peek always
+		returns a single region, and qb_reserve returns all free space at
+		once. Requires memfd_create() (Linux 3.17).
+
+	Either backend can be bounded, with one of these policies deciding what
+	happens when qb_push has more data than there is room for:
+
+	QB_OVERFLOW_DROP_NEWEST
+		Store what fits and discard the rest of the incoming data.
+
+	QB_OVERFLOW_DROP_OLDEST
+		Discard stored bytes from the front to make room, so the queue always
+		holds the most recent data.
+
+	QB_OVERFLOW_REJECT
+		Store nothing and return QB_ERROR_FULL.
+
+	The number of bytes lost to each policy is reported by qb_getStats.
 */
 
 #ifndef QUEUEBUFFER_H
 #define QUEUEBUFFER_H
 
+#include <stddef.h>
+#include <sys/uio.h>
+
 #define QB_BUFSIZE 4096
-struct QueueBuffer {
-	struct QueueBufferNode {
-		char buffer[QB_BUFSIZE];
-		char *front, *back;
-		struct QueueBufferNode *next;
-	} *head, *tail;
+
+// Nodes preallocated by qb_initialize() for QB_BACKEND_LIST
+#define QB_DEFAULT_RESERVE 2
+
+// Returned by qb_push under QB_OVERFLOW_REJECT when the data does not fit
+#define QB_ERROR_FULL -1
+
+// Returned by qb_find and qb_findAny when no byte matches
+#define QB_NOT_FOUND -1
+
+typedef enum _QBBackend {
+	QB_BACKEND_LIST = 0,
+	QB_BACKEND_RING = 1,
+	QB_BACKEND_MIRROR = 2
+} QBBackend;
+
+typedef enum _QBOverflow {
+	QB_OVERFLOW_DROP_NEWEST = 0,
+	QB_OVERFLOW_DROP_OLDEST = 1,
+	QB_OVERFLOW_REJECT = 2
+} QBOverflow;
+
+struct QueueBufferConfig {
+	QBBackend backend;
+
+	// Number of bytes the QueueBuffer can hold.
+	// Required for QB_BACKEND_RING and QB_BACKEND_MIRROR (rounded up to a
+	// power of two, and a whole number of pages for the mirror). For
+	// QB_BACKEND_LIST, 0 means unbounded.
+	size_t capacity;
+
+	// What qb_push does when capacity would be exceeded
+	QBOverflow overflow;
+
+	// Number of spare nodes to preallocate and keep on the free list.
+	// Used by QB_BACKEND_LIST only.
+	size_t reserve;
 };
 
+struct QueueBufferStats {
+	size_t size;        // Bytes currently stored
+	size_t highwater;   // Largest number of bytes stored at once
+	size_t pushed;      // Total bytes stored by qb_push
+	size_t popped;      // Total bytes removed by qb_pop
+	size_t allocations; // Calls to malloc() for storage, including init
+	size_t frees;       // Calls to free() for storage before qb_free
+	size_t reused;      // Nodes taken from the free list instead of malloc()
+	size_t dropped;     // Stored bytes discarded by QB_OVERFLOW_DROP_OLDEST
+	size_t discarded;   // Incoming bytes not stored because the queue was full
+	size_t rejected;    // qb_push calls refused by QB_OVERFLOW_REJECT
+};
+
+// Contents are private to queuebuffer.c
+struct QueueBuffer;
+
 /**
 	Initialize a QueueBuffer.
 
 	Provide an uninitialized struct QueueBuffer pointer, and this function
-	will initialize it to point to a valid QueueBuffer.
+	will initialize it to point to a valid QueueBuffer using the
+	QB_BACKEND_LIST backend.
 */
 void qb_initialize(struct QueueBuffer **qbuf);
 
+/**
+	Initialize a QueueBuffer with the backend, capacity and overflow policy
+	in config.
+
+	Returns 1 on success, 0 on error (invalid config or out of memory). On
+	error, *qbuf is set to NULL.
+*/
+int qb_initializeWithConfig(struct QueueBuffer **qbuf,
+		const struct QueueBufferConfig *config);
+
 /**
 	Free resources used by given QueueBuffer.
 */
@@ -32,22 +132,139 @@ void qb_free(struct QueueBuffer **qbuf);
 
 /**
 	Add len bytes from argument buffer to the provided QueueBuffer.
+
+	Returns the number of bytes actually stored, which is always len for an
+	unbounded QueueBuffer. When the QueueBuffer is full, the result depends
+	on its overflow policy:
+	  QB_OVERFLOW_DROP_NEWEST - only the bytes that fit are stored
+	  QB_OVERFLOW_DROP_OLDEST - len is stored, or the last capacity bytes of
+	                            buffer if len is larger than the capacity
+	  QB_OVERFLOW_REJECT      - nothing is stored and QB_ERROR_FULL is
+	                            returned
+*/
+int qb_push(struct QueueBuffer *qbuf, const void *buffer, size_t len);
+
+/**
+	Get direct access to free space at the back of the QueueBuffer, so data
+	can be written (e.g. by read()) straight into its storage instead of
+	going through a temporary buffer and qb_push.
+
+	On success, *ptr points to *len contiguous writable bytes, and 1 is
+	returned. Nothing is stored until qb_commit is called. Returns 0 if
+	there is no free space, or a node could not be allocated
+	(QB_BACKEND_LIST). For QB_BACKEND_RING and QB_BACKEND_MIRROR, only the
+	producer may call this.
+
+	Overflow policies do not apply here: only space that is actually free
+	is ever returned.
+
+	The region may be smaller than the total free space; after committing
+	it, call qb_reserve again for more.
 */
-void qb_push(struct QueueBuffer *qbuf, const void *buffer, size_t len);
+int qb_reserve(struct QueueBuffer *qbuf, void **ptr, size_t *len);
+
+/**
+	Store the first numbytes of the region returned by the last qb_reserve.
+	numbytes must not exceed the reserved length.
+
+	Returns the number of bytes committed.
+*/
+size_t qb_commit(struct QueueBuffer *qbuf, size_t numbytes);
 
 /**
 	Pop the next numbytes off the QueueBuffer into the given buffer.
-	
+
 	Returns the number of bytes actually popped. This could be less than
 	numbytes if the number of bytes stored in the QueueBuffer is less than
 	numbytes.
 */
 int qb_pop(struct QueueBuffer *qbuf, void *buffer, size_t numbytes);
 
+/**
+	Describe the bytes at the front of the QueueBuffer without removing or
+	copying them.
+
+	Fills up to iovcnt entries of iov with pointers into qbuf's own storage,
+	in FIFO order. Each entry covers one contiguous region, so data that
+	crosses a node boundary (or the end of a ring) spans two entries. A
+	QB_BACKEND_MIRROR buffer always needs only one.
+
+	Returns the number of entries filled; 0 if qbuf is empty. The regions
+	stay valid until the next qb_consume or qb_pop on qbuf. For the ring
+	and mirror backends, only the consumer may call this.
+*/
+int qb_peek(struct QueueBuffer *qbuf, struct iovec *iov, int iovcnt);
+
+/**
+	Remove the next numbytes from the QueueBuffer without copying them,
+	typically after inspecting them with qb_peek.
+
+	Returns the number of bytes actually removed, which is less than
+	numbytes if fewer bytes are stored.
+
+	For a ring or mirror backend with QB_OVERFLOW_DROP_OLDEST, the producer may
+	discard bytes described by an earlier qb_peek before they are consumed.
+	Only those bytes still stored are removed, so a return value less than
+	numbytes means the peeked data was overwritten and must not be used.
+*/
+size_t qb_consume(struct QueueBuffer *qbuf, size_t numbytes);
+
+/**
+	Search the stored bytes for the first one equal to byte, without
+	removing anything.
+
+	Returns its offset from the front of the QueueBuffer (so qb_consume of
+	the offset skips everything before it), or QB_NOT_FOUND. The search
+	continues across node boundaries and the end of a ring. For the ring and
+	mirror backends, only the consumer may call this.
+*/
+int qb_find(struct QueueBuffer *qbuf, int byte);
+
+/**
+	Search the stored bytes for the first one equal to any of the setlen
+	bytes in set, without removing anything.
+
+	Returns its offset from the front of the QueueBuffer, or QB_NOT_FOUND.
+	Sets of up to 8 bytes are matched 16 bytes at a time where SSE2 or NEON
+	is available; larger sets use a lookup table. For the ring and mirror
+	backends, only the consumer may call this.
+*/
+int qb_findAny(struct QueueBuffer *qbuf, const void *set, size_t setlen);
+
+/**
+	Pop everything up to and including the first byte that is in set (e.g.
+	one line ending in "\r\n", or everything before the next frame start)
+	into buffer.
+
+	Returns the number of bytes popped, with the matching byte last. If no
+	byte in set is stored yet, nothing is popped and 0 is returned, unless
+	at least numbytes are stored: then numbytes bytes are popped, so an
+	overlong line cannot stall the queue. Check the last byte to tell the
+	two cases apart.
+*/
+int qb_popUntil(struct QueueBuffer *qbuf, void *buffer, size_t numbytes,
+		const void *set, size_t setlen);
+
 /**
 	Returns the number of bytes currently stored by qbuf.
 */
 int qb_getSize(struct QueueBuffer *qbuf);
 
+/**
+	Fill stats with counters describing the use of qbuf since it was
+	initialized.
+
+	For the ring and mirror backends, this may be called from either the
+	producer or the consumer; counters owned by the other side may be
+	slightly out of date.
+*/
+void qb_getStats(struct QueueBuffer *qbuf, struct QueueBufferStats *stats);
+
+/**
+	Returns the maximum number of bytes qbuf can hold, or 0 if it is
+	unbounded.
+*/
+size_t qb_getCapacity(struct QueueBuffer *qbuf);
+
 #endif
 
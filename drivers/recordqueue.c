@@ -0,0 +1,285 @@
+/**
+	Philip Romano
+	RecordQueue data structure
+
+	Multi-producer, single-consumer FIFO of variable-length records.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "recordqueue.h"
+
+// Keeps the producers' tail away from the consumer's head
+#define RQ_CACHELINE 64
+
+// Every record starts with an 8-byte header slot, and records are padded
+// to a multiple of the slot size so headers and payloads stay aligned
+#define RQ_HEADER 8
+#define RQ_ALIGN(n) (((n) + RQ_HEADER - 1) & ~(size_t)(RQ_HEADER - 1))
+
+#define RQ_MINCAPACITY 64
+
+// Records stay under half the capacity, so this keeps every length within
+// RQ_LENMASK
+#define RQ_MAXCAPACITY ((size_t)1 << 31)
+
+// Header word, the first 32 bits of the slot: payload length in the low 30
+// bits, plus flags. 32 bits are lock-free everywhere, where 64 may need
+// libatomic (ARMv6). A header of 0 (what the consumer leaves behind) means
+// "not committed yet".
+#define RQ_COMMITTED ((uint32_t)1 << 31)
+#define RQ_PADDING   ((uint32_t)1 << 30) // Skip to the start of the ring
+#define RQ_LENMASK   0x3FFFFFFFu
+
+struct RecordQueue {
+	// Indices are free-running; the position in ring is (index & mask).
+	// Every index in [head, tail) has been claimed by a producer.
+	unsigned char *ring;
+	size_t capacity,
+	       mask;
+
+	// Written only by the consumer
+	_Alignas(RQ_CACHELINE) atomic_size_t head;
+	size_t peeklen,   // Length of the record returned by rq_peek
+	       peeksize;  // Storage it takes, including header and padding
+	size_t records,
+	       bytes;
+
+	// Claimed by producers with a compare-and-swap
+	_Alignas(RQ_CACHELINE) atomic_size_t tail;
+
+	// Producer slow-path counters
+	_Alignas(RQ_CACHELINE) atomic_size_t rejected;
+	atomic_size_t retries;
+};
+
+static atomic_uint_least32_t *headerAt(struct RecordQueue *rqueue,
+		size_t index);
+
+int rq_initialize(struct RecordQueue **rqueue, size_t capacity) {
+	struct RecordQueue *rq;
+	size_t roundcap = RQ_MINCAPACITY;
+
+	*rqueue = NULL;
+	if (capacity > RQ_MAXCAPACITY)
+		return 0;
+	while (roundcap < capacity)
+		roundcap <<= 1;
+
+	rq = aligned_alloc(RQ_CACHELINE, sizeof(struct RecordQueue));
+	if (!rq)
+		return 0;
+	memset(rq, 0, sizeof(struct RecordQueue));
+
+	// Zeroed storage: no header reads as committed until a producer
+	// writes it
+	rq->ring = aligned_alloc(RQ_CACHELINE, roundcap);
+	if (!rq->ring) {
+		free(rq);
+		return 0;
+	}
+	memset(rq->ring, 0, roundcap);
+
+	rq->capacity = roundcap;
+	rq->mask = roundcap - 1;
+	atomic_init(&rq->head, 0);
+	atomic_init(&rq->tail, 0);
+	atomic_init(&rq->rejected, 0);
+	atomic_init(&rq->retries, 0);
+
+	*rqueue = rq;
+	return 1;
+}
+
+void rq_free(struct RecordQueue **rqueue) {
+	if (!rqueue || !*rqueue)
+		return;
+
+	free((*rqueue)->ring);
+	free(*rqueue);
+	*rqueue = NULL;
+}
+
+int rq_push(struct RecordQueue *rqueue, const void *record, size_t len) {
+	if (!rqueue)
+		return 0;
+	if (len == 0 || len > rq_getMaxRecord(rqueue))
+		return RQ_ERROR_SIZE;
+
+	size_t need = RQ_HEADER + RQ_ALIGN(len),
+	       tail = atomic_load_explicit(&rqueue->tail, memory_order_relaxed),
+	       pos, room, total;
+
+	// Claim need bytes, plus the rest of the ring as padding if the record
+	// would otherwise run past the end
+	for (;;) {
+		size_t head =
+				atomic_load_explicit(&rqueue->head, memory_order_acquire);
+
+		// The consumer may have moved past an out-of-date tail
+		if ((ptrdiff_t)(tail - head) < 0) {
+			tail = atomic_load_explicit(&rqueue->tail, memory_order_relaxed);
+			continue;
+		}
+
+		pos = tail & rqueue->mask;
+		room = rqueue->capacity - pos;
+		total = need <= room ? need : room + need;
+
+		if (tail + total - head > rqueue->capacity) {
+			atomic_fetch_add_explicit(&rqueue->rejected, 1,
+					memory_order_relaxed);
+			return RQ_ERROR_FULL;
+		}
+
+		if (atomic_compare_exchange_weak_explicit(&rqueue->tail, &tail,
+				tail + total, memory_order_relaxed, memory_order_relaxed))
+			break;
+
+		// tail now holds the latest value; try again from there
+		atomic_fetch_add_explicit(&rqueue->retries, 1, memory_order_relaxed);
+	}
+
+	if (total != need) {
+		atomic_store_explicit(headerAt(rqueue, tail),
+				RQ_COMMITTED | RQ_PADDING | (uint32_t)(room - RQ_HEADER),
+				memory_order_release);
+		tail += room;
+	}
+
+	// The release store publishes the copied payload along with the header
+	memcpy(rqueue->ring + (tail & rqueue->mask) + RQ_HEADER, record, len);
+	atomic_store_explicit(headerAt(rqueue, tail), RQ_COMMITTED | (uint32_t)len,
+			memory_order_release);
+
+	return len;
+}
+
+const void *rq_peek(struct RecordQueue *rqueue, size_t *len) {
+	if (!rqueue || !len)
+		return NULL;
+
+	size_t head = atomic_load_explicit(&rqueue->head, memory_order_relaxed);
+	uint32_t header;
+
+	for (;;) {
+		header = atomic_load_explicit(headerAt(rqueue, head),
+				memory_order_acquire);
+		if (!(header & RQ_COMMITTED))
+			return NULL;
+		if (!(header & RQ_PADDING))
+			break;
+
+		// Release the padding at the end of the ring straight away
+		size_t skip = RQ_HEADER + (header & RQ_LENMASK);
+		memset(rqueue->ring + (head & rqueue->mask), 0, skip);
+		head += skip;
+		atomic_store_explicit(&rqueue->head, head, memory_order_release);
+	}
+
+	*len = header & RQ_LENMASK;
+	rqueue->peeklen = *len;
+	rqueue->peeksize = RQ_HEADER + RQ_ALIGN(*len);
+	return rqueue->ring + (head & rqueue->mask) + RQ_HEADER;
+}
+
+void rq_consume(struct RecordQueue *rqueue) {
+	if (!rqueue || rqueue->peeksize == 0)
+		return;
+
+	size_t head = atomic_load_explicit(&rqueue->head, memory_order_relaxed);
+
+	// Any 8-byte word may be a header on the next lap, so the whole record
+	// is cleared before producers are allowed to claim it again
+	memset(rqueue->ring + (head & rqueue->mask), 0, rqueue->peeksize);
+	atomic_store_explicit(&rqueue->head, head + rqueue->peeksize,
+			memory_order_release);
+
+	++rqueue->records;
+	rqueue->bytes += rqueue->peeklen;
+	rqueue->peeksize = 0;
+}
+
+int rq_pop(struct RecordQueue *rqueue, void *buffer, size_t size) {
+	const void *record;
+	size_t len;
+
+	record = rq_peek(rqueue, &len);
+	if (!record)
+		return 0;
+	if (len > size)
+		return RQ_ERROR_SIZE;
+
+	memcpy(buffer, record, len);
+	rq_consume(rqueue);
+	return len;
+}
+
+int rq_drainTo(struct RecordQueue *rqueue, struct UART *uart) {
+	const void *record;
+	size_t len;
+	int    count = 0;
+
+	if (!rqueue || !uart)
+		return 0;
+
+	while ((record = rq_peek(rqueue, &len)) != NULL) {
+		// A record cut short would run into the next one, so wait for room
+		// rather than give up part way
+		int sent = uart_hwrite(uart, record, len);
+		while ((size_t)sent < len) {
+			if (uart_hflush(uart, -1) == -1) {
+				rq_consume(rqueue);
+				return RQ_ERROR_WRITE;
+			}
+			sent += uart_hwrite(uart, (const uint8_t *)record + sent,
+					len - sent);
+		}
+
+		rq_consume(rqueue);
+		++count;
+	}
+
+	if (count > 0 && uart_hflush(uart, 0) == -1)
+		return RQ_ERROR_WRITE;
+
+	return count;
+}
+
+size_t rq_getMaxRecord(struct RecordQueue *rqueue) {
+	if (!rqueue)
+		return 0;
+
+	// Worst case, a record is claimed together with the padding before it,
+	// which is always shorter than the record
+	return rqueue->capacity / 2 - RQ_HEADER;
+}
+
+void rq_getStats(struct RecordQueue *rqueue, struct RecordQueueStats *stats) {
+	if (!stats)
+		return;
+
+	memset(stats, 0, sizeof(struct RecordQueueStats));
+	if (!rqueue)
+		return;
+
+	size_t head = atomic_load_explicit(&rqueue->head, memory_order_acquire),
+	       tail = atomic_load_explicit(&rqueue->tail, memory_order_acquire);
+
+	stats->size = tail - head;
+	stats->records = rqueue->records;
+	stats->bytes = rqueue->bytes;
+	stats->rejected =
+			atomic_load_explicit(&rqueue->rejected, memory_order_relaxed);
+	stats->retries =
+			atomic_load_explicit(&rqueue->retries, memory_order_relaxed);
+}
+
+atomic_uint_least32_t *headerAt(struct RecordQueue *rqueue, size_t index) {
+	return (atomic_uint_least32_t *)(rqueue->ring + (index & rqueue->mask));
+}
+
@@ -0,0 +1,132 @@
+/**
+	Philip Romano
+	RecordQueue data structure
+
+	Multi-producer, single-consumer FIFO of variable-length records, for
+	funnelling data from several threads (e.g. sensor loop, control loop,
+	logger) into one serial link.
+
+	Any number of threads may call rq_push at once. Each record is stored
+	whole and contiguous, and is never interleaved with another: a producer
+	claims space for the entire record with a single compare-and-swap, then
+	copies into it without any lock. Exactly one thread may consume records
+	with rq_peek/rq_consume or rq_pop.
+
+	rq_drainTo is the usual consumer: a single drain thread calls it to
+	write records to a UART as they become complete.
+
+	Records are returned in the order their space was claimed. A record
+	whose producer is still copying holds back the records behind it until
+	it is complete.
+
+	Storage is a fixed ring, allocated once by rq_initialize. Each record
+	takes an 8-byte header plus its length rounded up to a multiple of 8.
+	The header is a 32-bit atomic word, lock-free on every Raspberry Pi.
+*/
+
+#ifndef RECORDQUEUE_H
+#define RECORDQUEUE_H
+
+#include <stddef.h>
+
+#include "uart.h"
+
+// Returned by rq_push when there is not enough free space for the record
+#define RQ_ERROR_FULL -1
+
+// Returned by rq_push when the record can never fit (see rq_getMaxRecord),
+// and by rq_pop when the next record is larger than the buffer
+#define RQ_ERROR_SIZE -2
+
+// Returned by rq_drainTo when a record could not be written to the UART
+#define RQ_ERROR_WRITE -3
+
+// Producers only touch these counters when a push is refused or retried,
+// so a successful push writes nothing but the tail index and the record
+struct RecordQueueStats {
+	size_t size;      // Bytes of storage in use, including headers
+	size_t records;   // Records removed by rq_consume or rq_pop
+	size_t bytes;     // Payload bytes removed by rq_consume or rq_pop
+	size_t rejected;  // rq_push calls refused with RQ_ERROR_FULL
+	size_t retries;   // Times a producer lost a race for space and retried
+};
+
+// Contents are private to recordqueue.c
+struct RecordQueue;
+
+/**
+	Initialize a RecordQueue able to hold capacity bytes of records and
+	headers (rounded up to a power of two, at least 64, at most 2 GiB).
+
+	Returns 1 on success, 0 on error (out of memory, or capacity too large). On error, *rqueue is
+	set to NULL.
+*/
+int rq_initialize(struct RecordQueue **rqueue, size_t capacity);
+
+/**
+	Free resources used by given RecordQueue. No other thread may be using
+	it.
+*/
+void rq_free(struct RecordQueue **rqueue);
+
+/**
+	Store one record of len bytes, copied from record. Safe to call from
+	any number of threads at once.
+
+	Returns len on success. If there is not enough free space, nothing is
+	stored and RQ_ERROR_FULL is returned. If len is 0 or larger than
+	rq_getMaxRecord, RQ_ERROR_SIZE is returned.
+*/
+int rq_push(struct RecordQueue *rqueue, const void *record, size_t len);
+
+/**
+	Get direct access to the oldest complete record, without removing it.
+
+	Returns a pointer to its contents and sets *len to its length, or
+	returns NULL if no complete record is available. The pointer stays
+	valid until rq_consume. Consumer only.
+*/
+const void *rq_peek(struct RecordQueue *rqueue, size_t *len);
+
+/**
+	Remove the record returned by the last rq_peek, freeing its space for
+	producers. Consumer only.
+*/
+void rq_consume(struct RecordQueue *rqueue);
+
+/**
+	Remove the oldest complete record, copying it into buffer.
+
+	Returns the length of the record, or 0 if no complete record is
+	available. If the record is larger than size, it is left in place and
+	RQ_ERROR_SIZE is returned. Consumer only.
+*/
+int rq_pop(struct RecordQueue *rqueue, void *buffer, size_t size);
+
+/**
+	Write every complete record to uart, oldest first. Each goes out whole:
+	if the output queue cannot take a record at once, this waits for the
+	device to make room, so records are never cut short. With
+	UARTOptions.txbuffered, the records are written together by one
+	uart_flush() at the end. Consumer only.
+
+	Returns the number of records written (0 if none were waiting), or
+	RQ_ERROR_WRITE. The record being written is then dropped, since part
+	of it may already have gone out.
+*/
+int rq_drainTo(struct RecordQueue *rqueue, struct UART *uart);
+
+/**
+	Returns the largest record length rq_push accepts.
+*/
+size_t rq_getMaxRecord(struct RecordQueue *rqueue);
+
+/**
+	Fill stats with counters describing the use of rqueue since it was
+	initialized. Counters may be slightly out of date while other threads
+	are pushing.
+*/
+void rq_getStats(struct RecordQueue *rqueue, struct RecordQueueStats *stats);
+
+#endif
+
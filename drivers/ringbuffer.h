@@ -0,0 +1,196 @@
+/*
+	Fixed-capacity ring buffers for sensor sample history
+
+	RingBuffer<T, N>
+		Holds the last N values of type T (e.g. a struct of three axes).
+
+	AxisRingBuffer<T, N, AXES>
+		Holds the last N samples of AXES values each, stored as one array per
+		axis (structure-of-arrays), so a filter can run over a single axis
+		with unit stride.
+
+	Both keep every value twice, at position p and p + N, so the history is
+	always one contiguous block from oldest to newest. A push costs two
+	stores instead of one, but filters and averages can run over the whole
+	window with a plain loop (which the compiler can vectorize) and never
+	have to handle the wrap-around. Storage is aligned to a cache line.
+
+	Nothing is allocated; the buffers can live on the stack or as members.
+*/
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#ifndef __cplusplus
+#error This header requires C++
+#endif
+
+#include <stddef.h>
+
+#define RINGBUFFER_ALIGN 64
+
+template <typename T, size_t N>
+class RingBuffer {
+	static_assert(N > 0, "RingBuffer needs a capacity of at least 1");
+
+	public:
+		/**
+			Constructor
+			Creates an empty RingBuffer.
+		*/
+		RingBuffer() : mNext(0), mSize(0) { }
+
+		/**
+			Add a value as the newest, overwriting the oldest value if the
+			buffer is full.
+		*/
+		void push(const T &value) {
+			mData[mNext] = value;
+			mData[mNext + N] = value;
+
+			if (++mNext == N)
+				mNext = 0;
+			if (mSize < N)
+				++mSize;
+		}
+
+		/**
+			Remove all values.
+		*/
+		void clear() {
+			mNext = 0;
+			mSize = 0;
+		}
+
+		/**
+			Number of values currently held (at most N).
+		*/
+		size_t size() const { return mSize; }
+
+		/**
+			Maximum number of values held.
+		*/
+		static size_t capacity() { return N; }
+
+		bool empty() const { return mSize == 0; }
+		bool full() const { return mSize == N; }
+
+		/**
+			Access a value by age order: 0 is the oldest, size() - 1 is the
+			newest.
+		*/
+		const T &operator[](size_t i) const { return data()[i]; }
+
+		/**
+			Access a value counting back from the newest: newest(0) is the
+			value pushed last.
+		*/
+		const T &newest(size_t age = 0) const {
+			return data()[mSize - 1 - age];
+		}
+
+		/**
+			All size() values as one contiguous array, oldest first.
+			Invalidated by the next push() or clear().
+		*/
+		const T *data() const { return &mData[oldest()]; }
+
+	private:
+		// Position of the oldest value. Until the buffer first fills up,
+		// values start at position 0.
+		size_t oldest() const { return mSize == N ? mNext : 0; }
+
+		alignas(RINGBUFFER_ALIGN) T mData[2 * N];
+		size_t mNext, // Position the next push() writes to
+		       mSize;
+};
+
+template <typename T, size_t N, size_t AXES>
+class AxisRingBuffer {
+	static_assert(N > 0, "AxisRingBuffer needs a capacity of at least 1");
+	static_assert(AXES > 0, "AxisRingBuffer needs at least 1 axis");
+
+	public:
+		/**
+			Constructor
+			Creates an empty AxisRingBuffer.
+		*/
+		AxisRingBuffer() : mNext(0), mSize(0) { }
+
+		/**
+			Add one sample (AXES values, in axis order) as the newest,
+			overwriting the oldest sample if the buffer is full.
+		*/
+		void push(const T *sample) {
+			for (size_t a = 0; a < AXES; ++a) {
+				mAxes[a].values[mNext] = sample[a];
+				mAxes[a].values[mNext + N] = sample[a];
+			}
+
+			if (++mNext == N)
+				mNext = 0;
+			if (mSize < N)
+				++mSize;
+		}
+
+		/**
+			Remove all samples.
+		*/
+		void clear() {
+			mNext = 0;
+			mSize = 0;
+		}
+
+		/**
+			Number of samples currently held (at most N).
+		*/
+		size_t size() const { return mSize; }
+
+		/**
+			Maximum number of samples held.
+		*/
+		static size_t capacity() { return N; }
+
+		/**
+			Number of values per sample.
+		*/
+		static size_t axes() { return AXES; }
+
+		bool empty() const { return mSize == 0; }
+		bool full() const { return mSize == N; }
+
+		/**
+			Access one axis of a sample by age order: 0 is the oldest,
+			size() - 1 is the newest.
+		*/
+		const T &at(size_t axis, size_t i) const { return data(axis)[i]; }
+
+		/**
+			Access one axis of a sample counting back from the newest:
+			newest(axis, 0) is from the sample pushed last.
+		*/
+		const T &newest(size_t axis, size_t age = 0) const {
+			return data(axis)[mSize - 1 - age];
+		}
+
+		/**
+			All size() values of one axis as one contiguous array, oldest
+			first. Invalidated by the next push() or clear().
+		*/
+		const T *data(size_t axis) const {
+			return &mAxes[axis].values[mSize == N ? mNext : 0];
+		}
+
+	private:
+		// Each axis starts on its own cache line
+		struct alignas(RINGBUFFER_ALIGN) Axis {
+			T values[2 * N];
+		};
+
+		Axis   mAxes[AXES];
+		size_t mNext, // Position the next push() writes to
+		       mSize;
+};
+
+#endif
+
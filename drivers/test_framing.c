@@ -0,0 +1,189 @@
+/**
+	Philip Romano
+	Tests for the framing layer
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "framing.h"
+
+static int failures = 0;
+
+static void fillPayload(uint8_t *payload, size_t len, unsigned seed);
+static void check(int passed, const char *what);
+
+int main(int argc, char **argv) {
+	struct FrameDecoder decoder;
+	uint8_t payload[FR_MAXPAYLOAD + 16],
+	        encoded[FR_MAXENCODED + 64];
+	size_t  used;
+	int     size, errors, i;
+
+	/*
+		Test 1
+		Known CRC value, and the CRC of a payload followed by its CRC
+	*/
+	printf("\n == Test 1 == \n\n");
+
+	uint16_t crc = fr_crc16("123456789", 9);
+	uint8_t  withcrc[11] = "123456789";
+	withcrc[9] = crc >> 8;
+	withcrc[10] = crc & 0xFF;
+	printf("CRC of \"123456789\": 0x%04X (expect 0x29B1)\n", crc);
+	printf("CRC including its own CRC: 0x%04X (expect 0x0000)\n",
+			fr_crc16(withcrc, 11));
+	check(crc == 0x29B1, "CRC of \"123456789\"");
+	check(fr_crc16(withcrc, 11) == 0, "CRC including its own CRC is zero");
+
+	/*
+		Test 2
+		Payloads of every length around the COBS block size, with and without
+		zeros, must encode without zeros and decode unchanged
+	*/
+	printf("\n == Test 2 == \n\n");
+
+	size_t lengths[] = { 0, 1, 2, 251, 252, 253, 254, 255, 256, 507, 508,
+	                     509, 1000, FR_MAXPAYLOAD };
+	unsigned patterns[] = { 0, 1, 2 }; // Mixed, no zeros, all zeros
+	size_t l;
+	int    p;
+
+	errors = 0;
+	for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+		for (p = 0; p < 3; ++p) {
+			if (patterns[p] == 0)
+				fillPayload(payload, lengths[l], l);
+			else
+				memset(payload, patterns[p] == 1 ? 0xFF : 0x00, lengths[l]);
+
+			size = fr_encode(payload, lengths[l], encoded, FR_MAXENCODED);
+			if (size <= 0 || memchr(encoded, 0, size - 1) ||
+					encoded[size - 1] != 0) {
+				++errors;
+				continue;
+			}
+
+			fr_initDecoder(&decoder);
+			if (!fr_decode(&decoder, encoded, size, &used) ||
+					used != (size_t)size || decoder.length != lengths[l] ||
+					memcmp(decoder.frame, payload, lengths[l]) != 0)
+				++errors;
+		}
+	}
+	printf("%d errors over %zu payloads\n", errors,
+			3 * sizeof(lengths) / sizeof(lengths[0]));
+
+	check(errors == 0, "every payload round-trips");
+
+	size = fr_encode(payload, FR_MAXPAYLOAD + 1, encoded, sizeof(encoded));
+	printf("Oversized payload: fr_encode returned %d (expect %d)\n", size,
+			FR_ERROR_SIZE);
+	check(size == FR_ERROR_SIZE, "oversized payload refused");
+
+	/*
+		Test 3
+		A stream of frames fed one byte at a time, with a corrupted frame, a
+		truncated frame and idle delimiters in between
+	*/
+	printf("\n == Test 3 == \n\n");
+
+	uint8_t stream[8 * FR_MAXENCODED];
+	size_t  streamlen = 0;
+
+	for (i = 0; i < 6; ++i) {
+		fillPayload(payload, 40 + i * 100, i);
+		size = fr_encode(payload, 40 + i * 100, stream + streamlen,
+				FR_MAXENCODED);
+
+		if (i == 2)
+			stream[streamlen + 10] ^= 0x04; // Corrupt a data byte
+		if (i == 4)
+			size = 20;                      // Cut short, no delimiter
+
+		streamlen += size;
+		if (i == 3)
+			stream[streamlen++] = 0;        // Idle line
+	}
+	// The truncated frame takes the next one with it; end with a clean one
+	fillPayload(payload, 77, 77);
+	streamlen += fr_encode(payload, 77, stream + streamlen, FR_MAXENCODED);
+
+	fr_initDecoder(&decoder);
+	int frames = 0, lastlength = 0;
+	size_t pos;
+	for (pos = 0; pos < streamlen; ++pos) {
+		if (fr_decode(&decoder, stream + pos, 1, &used)) {
+			++frames;
+			lastlength = decoder.length;
+		}
+	}
+	printf("%d frames delivered (expect 4), last of %d bytes (expect 77)\n",
+			frames, lastlength);
+	printf("%zu CRC errors (expect 1), %zu truncated, %zu oversized\n",
+			decoder.crcerrors, decoder.truncated, decoder.oversized);
+	check(frames == 4 && lastlength == 77, "intact frames delivered");
+	check(decoder.crcerrors == 1, "corrupted frame counted as a CRC error");
+
+	/*
+		Test 4
+		Decode straight out of a ring QueueBuffer, with frames wrapping around
+		its end
+	*/
+	printf("\n == Test 4 == \n\n");
+
+	struct QueueBuffer *qbuf;
+	struct QueueBufferConfig config = {0};
+	config.backend = QB_BACKEND_RING;
+	config.capacity = 4096;
+	config.overflow = QB_OVERFLOW_REJECT;
+	config.reserve = 0;
+	if (!qb_initializeWithConfig(&qbuf, &config)) {
+		check(0, "ring QueueBuffer initialized");
+		printf("\n%d checks failed\n\n", failures);
+		return failures;
+	}
+
+	fr_initDecoder(&decoder);
+	errors = frames = 0;
+	for (i = 0; i < 500; ++i) {
+		size_t len = 1 + (i * 37) % 600;
+		fillPayload(payload, len, i);
+		size = fr_encode(payload, len, encoded, sizeof(encoded));
+		qb_push(qbuf, encoded, size);
+
+		if (!fr_decodeQueue(&decoder, qbuf) || decoder.length != len ||
+				memcmp(decoder.frame, payload, len) != 0)
+			++errors;
+		else
+			++frames;
+	}
+	printf("%d frames through the ring, %d errors, %d bytes left\n", frames,
+			errors, qb_getSize(qbuf));
+	check(frames == 500 && errors == 0 && qb_getSize(qbuf) == 0,
+			"frames decoded across the ring's end");
+	qb_free(&qbuf);
+
+	printf("\n%d checks failed\n\n", failures);
+	return failures;
+}
+
+/**
+	Fill payload with len pseudo-random bytes, about one in eight zero.
+*/
+void fillPayload(uint8_t *payload, size_t len, unsigned seed) {
+	uint32_t state = seed * 2654435761u + 1;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		state = state * 1103515245 + 12345;
+		payload[i] = (state >> 16) % 8 == 0 ? 0 : (uint8_t)(state >> 24);
+	}
+}
+
+void check(int passed, const char *what) {
+	printf("  %s: %s\n", passed ? "PASS" : "FAIL", what);
+	if (!passed)
+		++failures;
+}
@@ -0,0 +1,279 @@
+/**
+	Philip Romano
+	Test for the UART PL011 backend, against a fake register block
+
+	Runs anywhere: pl011fake.c plays the UART's registers and FIFOs, and
+	this program plays the far end of the line. The exit status is the
+	number of checks that failed.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <unistd.h>
+
+#include "uart.h"
+#include "pl011fake.h"
+
+// Bytes pushed through the receive FIFO in Test 4
+#define STREAM_BYTES (64 * 1024)
+
+static int failures = 0;
+
+static int    openFake(struct PL011Fake *fake, int baudrate,
+		UARTParity parity, UARTFlowControl flowcontrol);
+static void  *injector(void *arg);
+static void   check(int passed, const char *what);
+static double now();
+
+int main(int argc, char **argv) {
+	struct PL011Fake *fake;
+	char path[64], buffer[64];
+	int  bytes;
+
+	snprintf(path, sizeof(path), "/tmp/test_pl011.%d", (int)getpid());
+	if (!pf_open(&fake, path)) {
+		fprintf(stderr, "Could not create fake registers at %s\n", path);
+		return 1;
+	}
+
+	/*
+		Test 1
+		Opening programs the divisors, line control and control registers
+	*/
+	printf("\n == Test 1 == \n\n");
+
+	if (!openFake(fake, 115200, UART_PARDISABLE, UART_FLOWNONE))
+		return 1;
+	printf("115200: IBRD %u, FBRD %u (expect 4, 0), applied %d\n",
+			pf_getRegister(fake, UART_REGIBRD),
+			pf_getRegister(fake, UART_REGFBRD), uart_getBaudRate());
+	check(pf_getRegister(fake, UART_REGIBRD) == 4 &&
+			pf_getRegister(fake, UART_REGFBRD) == 0 &&
+			uart_getBaudRate() == 115200, "115200 baud divisor");
+	check(pf_getRegister(fake, UART_REGLCRH) ==
+			(UART_LCRHFEN | UART_LCRHWL8), "8N1 with FIFOs");
+	check(pf_getRegister(fake, UART_REGCR) ==
+			(UART_CRUARTEN | UART_CRTXE | UART_CRRXE), "enabled");
+	check(pf_getRegister(fake, UART_REGIMSC) == 0, "interrupts masked");
+	uart_deinit();
+
+	// 7372800 * 4 / 250000 = 117.96, so 1 + 54/64
+	if (!openFake(fake, 250000, UART_PAREVEN, UART_FLOWNONE))
+		return 1;
+	printf("250000: IBRD %u, FBRD %u (expect 1, 54), applied %d "
+			"(expect 249925)\n", pf_getRegister(fake, UART_REGIBRD),
+			pf_getRegister(fake, UART_REGFBRD), uart_getBaudRate());
+	check(pf_getRegister(fake, UART_REGIBRD) == 1 &&
+			pf_getRegister(fake, UART_REGFBRD) == 54 &&
+			uart_getBaudRate() == 249925, "fractional divisor");
+	check(pf_getRegister(fake, UART_REGLCRH) ==
+			(UART_LCRHFEN | UART_LCRHWL8 | UART_LCRHPEN | UART_LCRHEPS),
+			"even parity");
+	uart_deinit();
+
+	check(!openFake(fake, 4000000, UART_PARDISABLE, UART_FLOWNONE),
+			"rate beyond the reference clock refused");
+
+	// RTS/CTS is left to the UART; XON/XOFF would need the driver to parse
+	// the stream, which it does not
+	if (!openFake(fake, 115200, UART_PARDISABLE, UART_FLOWRTSCTS))
+		return 1;
+	check(pf_getRegister(fake, UART_REGCR) == (UART_CRUARTEN | UART_CRTXE |
+			UART_CRRXE | UART_CRRTSEN | UART_CRCTSEN), "RTS/CTS enabled");
+	uart_deinit();
+
+	check(!openFake(fake, 115200, UART_PARDISABLE, UART_FLOWXONXOFF),
+			"XON/XOFF refused");
+
+	/*
+		Test 2
+		Bytes put on the line come out of uart_read(), and bytes written go
+		out through the transmit FIFO
+	*/
+	printf("\n == Test 2 == \n\n");
+
+	if (!openFake(fake, 115200, UART_PARDISABLE, UART_FLOWNONE))
+		return 1;
+
+	pf_inject(fake, "hello", 5);
+	bytes = uart_readTimeout(buffer, 5, 5, 1000);
+	printf("Injected hello, read %d bytes\n", bytes);
+	check(bytes == 5 && memcmp(buffer, "hello", 5) == 0, "receive");
+
+	uart_write("world", 5);
+	double start = now();
+	bytes = 0;
+	while (bytes < 5 && now() - start < 1.0)
+		bytes += pf_collect(fake, buffer + bytes, 5 - bytes);
+	printf("Wrote world, collected %d bytes\n", bytes);
+	check(bytes == 5 && memcmp(buffer, "world", 5) == 0, "transmit");
+
+	// More than the FIFO holds goes out as the far end takes it
+	char line[100];
+	memset(line, 'x', sizeof(line));
+	uart_write(line, sizeof(line));
+	bytes = 0;
+	start = now();
+	while (bytes < (int)sizeof(line) && now() - start < 1.0)
+		bytes += pf_collect(fake, buffer, sizeof(buffer));
+	check(bytes == (int)sizeof(line) && uart_flush(0) == 0,
+			"transmit beyond the FIFO depth");
+
+	/*
+		Test 3
+		Low latency keeps the thread polling; the setting reads back
+	*/
+	printf("\n == Test 3 == \n\n");
+
+	check(uart_setLowLatency(1) && uart_getLowLatency() == 1,
+			"low latency on");
+	pf_inject(fake, "!", 1);
+	check(uart_readTimeout(buffer, 1, 1, 1000) == 1 && buffer[0] == '!',
+			"receive while spinning");
+	check(uart_setLowLatency(0) && uart_getLowLatency() == 0,
+			"low latency off");
+
+	/*
+		Test 4
+		A long stream through the 16-byte FIFO, fed as fast as it drains,
+		arrives whole and in order. The fake is not paced by the line, so
+		the rate shows how far ahead of the line the polling keeps; it must
+		stay ahead, or a real FIFO would overrun.
+	*/
+	printf("\n == Test 4 == \n\n");
+
+	uart_deinit();
+	if (!openFake(fake, 460800, UART_PARDISABLE, UART_FLOWNONE))
+		return 1;
+
+	static uint8_t received[STREAM_BYTES];
+	pthread_t feeder;
+	size_t    got = 0, wrong = 0, i;
+
+	start = now();
+	pthread_create(&feeder, NULL, injector, fake);
+	while (got < STREAM_BYTES) {
+		bytes = uart_readTimeout(received + got, STREAM_BYTES - got, 1, 1000);
+		if (bytes <= 0)
+			break;
+		got += bytes;
+	}
+	double seconds = now() - start;
+	pthread_join(feeder, NULL);
+
+	for (i = 0; i < got; ++i)
+		if (received[i] != (uint8_t)(i * 7))
+			++wrong;
+
+	printf("%zu of %d bytes, %zu wrong, %.3f MB/s (line: %.3f MB/s)\n", got,
+			STREAM_BYTES, wrong, got / seconds / 1e6, 460800 / 10 / 1e6);
+	check(got == STREAM_BYTES && wrong == 0, "stream intact");
+
+	/*
+		Test 5
+		Bytes flagged with line errors in DR are still delivered, and each
+		kind of error is counted
+	*/
+	printf("\n == Test 5 == \n\n");
+
+	struct UARTStats stats;
+	uart_getStats(&stats);
+	check(stats.overrun == 0 && stats.parity == 0 && stats.framing == 0 &&
+			stats.breaks == 0, "no errors on a clean stream");
+	check(stats.rxbytes == STREAM_BYTES && stats.rxpeak > 0 &&
+			stats.rxpeak <= STREAM_BYTES, "bytes and peak depth counted");
+
+	pf_injectErrors(fake, "pp", 2, UART_DRPE);
+	pf_injectErrors(fake, "f", 1, UART_DRFE);
+	pf_injectErrors(fake, "ob", 2, UART_DROE | UART_DRBE);
+	bytes = uart_readTimeout(buffer, 5, 5, 1000);
+	uart_getStats(&stats);
+
+	printf("Read %d bytes: %zu overrun, %zu parity, %zu framing, %zu break\n",
+			bytes, stats.overrun, stats.parity, stats.framing, stats.breaks);
+	check(bytes == 5 && memcmp(buffer, "ppfob", 5) == 0,
+			"flagged bytes delivered");
+	check(stats.parity == 2 && stats.framing == 1 && stats.overrun == 2 &&
+			stats.breaks == 2, "errors counted");
+
+	/*
+		Test 6
+		Closing disables the UART, after which the line goes nowhere
+	*/
+	printf("\n == Test 6 == \n\n");
+
+	uart_deinit();
+	check(pf_getRegister(fake, UART_REGCR) == 0, "disabled on close");
+	check(pf_inject(fake, "late", 4) == 0, "input refused once disabled");
+
+	pf_close(&fake);
+	unlink(path);
+
+	printf("\n%d checks failed\n\n", failures);
+	return failures;
+}
+
+/**
+	Initialize UART on the fake registers.
+	Returns 1 on success, 0 on error.
+*/
+int openFake(struct PL011Fake *fake, int baudrate, UARTParity parity,
+		UARTFlowControl flowcontrol) {
+	struct UARTRegisterOps regops;
+	pf_getOps(fake, &regops);
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.backend = UART_BACKENDPL011;
+	options.regops = &regops;
+	options.rxmode = UART_RXTHREAD;
+	options.flowcontrol = flowcontrol;
+	if (!uart_initWithOptions(NULL, baudrate, parity, &options)) {
+		printf("uart_initWithOptions(%d): %s\n", baudrate,
+				uart_getLastError());
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+	Feed STREAM_BYTES of a counting pattern into the receive FIFO as fast
+	as it has room
+*/
+void *injector(void *arg) {
+	struct PL011Fake *fake = (struct PL011Fake *)arg;
+	uint8_t chunk[UART_PL011FIFO];
+	size_t  sent = 0, i;
+
+	while (sent < STREAM_BYTES) {
+		for (i = 0; i < sizeof(chunk); ++i)
+			chunk[i] = (uint8_t)((sent + i) * 7);
+
+		size_t len = STREAM_BYTES - sent < sizeof(chunk) ?
+				STREAM_BYTES - sent : sizeof(chunk);
+		size_t accepted = pf_inject(fake, chunk, len);
+		if (accepted == 0)
+			sched_yield();
+		sent += accepted;
+	}
+
+	return NULL;
+}
+
+void check(int passed, const char *what) {
+	printf("  %s: %s\n", passed ? "PASS" : "FAIL", what);
+	if (!passed)
+		++failures;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
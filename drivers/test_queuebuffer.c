@@ -5,10 +5,51 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "queuebuffer.h"
 
+static int failures = 0;
+
 static void ignoreInput();
+static int  initialize(struct QueueBuffer **qb,
+		const struct QueueBufferConfig *config, const char *name);
+static void check(int passed, const char *what);
+
+// Backends exercised by the tests that apply to all of them
+#define NUMBACKENDS 3
+static const QBBackend backends[NUMBACKENDS] = {
+	QB_BACKEND_LIST, QB_BACKEND_RING, QB_BACKEND_MIRROR
+};
+static const char *backendnames[NUMBACKENDS] = { "list", "ring", "mirror" };
+
+// Producer/consumer stress test (Test 5)
+#define STRESS_BYTES   (64 * 1024 * 1024)
+#define STRESS_RINGCAP 65536
+
+struct StressArgs {
+	struct QueueBuffer *qb;
+	pthread_mutex_t    *lock; // NULL for the lock-free ring backend
+	size_t             chunk;
+	size_t             errors;
+};
+
+static void  *stressProducer(void *arg);
+static void  *stressConsumer(void *arg);
+static double stressRun(struct QueueBuffer *qb, pthread_mutex_t *lock,
+		size_t chunk, size_t *errors);
+
+// Drop-oldest producer/consumer test (Test 9)
+#define FRESH_COUNT   (4 * 1024 * 1024)
+#define FRESH_RINGCAP 256
+
+static atomic_int freshdone;
+
+static void *freshProducer(void *arg);
 
 int main(int argc, char **argv) {
 	struct QueueBuffer *qb;
@@ -35,6 +76,7 @@ int main(int argc, char **argv) {
 		printf("%08d bytes remaining after pop : \"%s\"\n",
 				qb_getSize(qb), buffer);
 	}
+	check(qb_getSize(qb) == 0, "everything pushed was popped");
 
 	qb_free(&qb);
 
@@ -75,14 +117,488 @@ int main(int argc, char **argv) {
 	qb_free(&qb);
 
 	// Check that qb is NULL after qb_free()
-	if (qb == NULL)
-		printf("qb is correctly now a NULL pointer\n");
-	else
-		printf("qb is NOT a NULL pointer as it should be\n");
+	check(qb == NULL, "qb is NULL after qb_free()");
+
+
+	/*
+		Test 5
+		One thread pushes while another pops, as the SIGIO handler and the
+		application do in uart.c. Every byte carries its sequence number, so
+		reordering or loss is detected. The list backend is not thread-safe,
+		so it is run under a mutex for comparison.
+	*/
+	printf("\n == Test 5 == \n\n");
+
+	struct QueueBufferConfig config = {0};
+	config.backend = QB_BACKEND_RING;
+	config.capacity = STRESS_RINGCAP;
+	config.reserve = 0;
+	config.overflow = QB_OVERFLOW_DROP_NEWEST;
+
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	size_t chunks[] = { 64, 1024 };
+	size_t c, errors;
+	double mbps;
+	char   what[96];
+
+	for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+		if (!initialize(&qb, &config, "ring"))
+			break;
+		mbps = stressRun(qb, NULL, chunks[c], &errors);
+		qb_free(&qb);
+		printf("ring (lock-free)  %5zu-byte chunks: %8.1f MB/s, %zu errors\n",
+				chunks[c], mbps, errors);
+		snprintf(what, sizeof(what), "ring, %zu-byte chunks arrive in order",
+				chunks[c]);
+		check(errors == 0, what);
+
+		qb_initialize(&qb);
+		mbps = stressRun(qb, &lock, chunks[c], &errors);
+		qb_free(&qb);
+		printf("list (mutex)      %5zu-byte chunks: %8.1f MB/s, %zu errors\n",
+				chunks[c], mbps, errors);
+		snprintf(what, sizeof(what), "list, %zu-byte chunks arrive in order",
+				chunks[c]);
+		check(errors == 0, what);
+	}
+
+	/*
+		Test 6
+		Bursty push/pop within the node reserve should be served entirely
+		from the free list once the queue has warmed up
+	*/
+	printf("\n == Test 6 == \n\n");
+
+	struct QueueBufferStats stats;
+	size_t warmallocs;
+
+	config.backend = QB_BACKEND_LIST;
+	config.capacity = 0;
+	config.reserve = 8;
+	if (initialize(&qb, &config, "list")) {
+		qb_getStats(qb, &stats);
+		warmallocs = stats.allocations;
+
+		for (i = 0; i < 10000; ++i) {
+			qb_push(qb, bigbuffer, 4 * QB_BUFSIZE + 100);
+			while (qb_pop(qb, buffer, 200) > 0);
+		}
+
+		qb_getStats(qb, &stats);
+		printf("size %zu, high-water %zu, pushed %zu, popped %zu\n",
+				stats.size, stats.highwater, stats.pushed, stats.popped);
+		printf("allocations %zu (%zu at init), frees %zu, reused %zu\n",
+				stats.allocations, warmallocs, stats.frees, stats.reused);
+		check(stats.allocations == warmallocs && stats.frees == 0,
+				"no allocator traffic after initialization");
+		qb_free(&qb);
+	}
+
+	/*
+		Test 7
+		qb_peek regions must describe the stored bytes in order across node
+		boundaries, and qb_consume must skip exactly the requested bytes
+	*/
+	printf("\n == Test 7 == \n\n");
+
+	for (i = 0; i < sizeof(bigbuffer); ++i)
+		bigbuffer[i] = (char)(i % 251);
+
+	for (c = 0; c < NUMBACKENDS; ++c) {
+		struct iovec iov[8];
+		int count, r, matches = 1;
+		size_t offset = 0, peeked = 0;
+
+		config.backend = backends[c];
+		config.capacity = 4 * QB_BUFSIZE;
+		config.reserve = QB_DEFAULT_RESERVE;
+		if (!initialize(&qb, &config, backendnames[c]))
+			continue;
+
+		// Leave the front part-way into the first node / ring
+		qb_push(qb, bigbuffer, 3000);
+		qb_consume(qb, 1000);
+		offset = 1000;
+		qb_push(qb, bigbuffer + 3000, 2 * QB_BUFSIZE);
+
+		count = qb_peek(qb, iov, 8);
+		for (r = 0; r < count; ++r) {
+			if (memcmp(iov[r].iov_base, bigbuffer + offset + peeked,
+					iov[r].iov_len) != 0)
+				matches = 0;
+			peeked += iov[r].iov_len;
+		}
+
+		printf("%s: %d regions, %zu bytes peeked of %d stored, %s\n",
+				backendnames[c], count, peeked, qb_getSize(qb),
+				matches ? "contents match" : "contents DO NOT match");
+		snprintf(what, sizeof(what), "%s peek covers the stored bytes",
+				backendnames[c]);
+		check(matches && peeked == (size_t)qb_getSize(qb), what);
+
+		qb_consume(qb, 5000);
+		bytes = qb_pop(qb, buffer, 16);
+		snprintf(what, sizeof(what), "%s consume skips exactly 5000 bytes",
+				backendnames[c]);
+		check(bytes == 16 &&
+				memcmp(buffer, bigbuffer + offset + 5000, bytes) == 0, what);
+
+		qb_free(&qb);
+	}
+
+	/*
+		Test 8
+		Fill through qb_reserve/qb_commit, as the SIGIO handler does, until
+		the ring is full; the data must come back out unchanged
+	*/
+	printf("\n == Test 8 == \n\n");
+
+	for (c = 0; c < NUMBACKENDS; ++c) {
+		void   *space;
+		size_t len, filled = 0;
+		int    regions = 0;
+
+		config.backend = backends[c];
+		config.capacity = 4 * QB_BUFSIZE;
+		config.reserve = QB_DEFAULT_RESERVE;
+		if (!initialize(&qb, &config, backendnames[c]))
+			continue;
+
+		// Start off-center so the ring wraps
+		qb_push(qb, bigbuffer, 100);
+		qb_consume(qb, 100);
+
+		while (filled < 4 * QB_BUFSIZE && qb_reserve(qb, &space, &len)) {
+			if (len > 4 * QB_BUFSIZE - filled)
+				len = 4 * QB_BUFSIZE - filled;
+			memcpy(space, bigbuffer + filled, len);
+			filled += qb_commit(qb, len);
+			++regions;
+		}
+
+		int full = !qb_reserve(qb, &space, &len),
+		    same = 1;
+		for (i = 0; i < 4 * QB_BUFSIZE; i += bytes) {
+			bytes = qb_pop(qb, buffer, sizeof(buffer));
+			if (bytes <= 0 || memcmp(buffer, bigbuffer + i, bytes) != 0) {
+				same = 0;
+				break;
+			}
+		}
+
+		printf("%s: committed %zu bytes in %d regions, full: %s, %s\n",
+				backendnames[c], filled, regions,
+				full ? "yes" : "no",
+				same ? "contents match" : "contents DO NOT match");
+		snprintf(what, sizeof(what), "%s reserve/commit fills and reads back",
+				backendnames[c]);
+		check(filled == 4 * QB_BUFSIZE && full && same, what);
+
+		qb_free(&qb);
+	}
+
+	/*
+		Test 9
+		Overflow policies: push half again as much as the capacity (1024, or
+		a page for the mirror) in 100-byte pieces, then check what was kept
+		and what was counted as lost
+	*/
+	printf("\n == Test 9 == \n\n");
+
+	const char *policynames[] = { "drop-newest", "drop-oldest", "reject" };
+	QBOverflow p;
+	for (c = 0; c < NUMBACKENDS; ++c) {
+		for (p = QB_OVERFLOW_DROP_NEWEST; p <= QB_OVERFLOW_REJECT; ++p) {
+			int fails = 0;
+
+			config.backend = backends[c];
+			config.capacity = 1024;
+			config.reserve = QB_DEFAULT_RESERVE;
+			config.overflow = p;
+			if (!initialize(&qb, &config, backendnames[c]))
+				continue;
 
+			size_t capacity = qb_getCapacity(qb),
+			       total = capacity * 3 / 2 / 100 * 100;
+			for (i = 0; i < total; i += 100)
+				if (qb_push(qb, bigbuffer + i, 100) == QB_ERROR_FULL)
+					++fails;
+
+			// What should be at the front: the oldest bytes, unless the
+			// oldest were dropped to make room for the last ones
+			size_t front = p == QB_OVERFLOW_DROP_OLDEST ? total - capacity : 0;
+			bytes = qb_pop(qb, buffer, 64);
+
+			qb_getStats(qb, &stats);
+			printf("%-6s %-11s: size %4d, dropped %4zu, discarded %4zu, "
+					"rejected %zu, failed pushes %d, front %s\n",
+					backendnames[c], policynames[p],
+					qb_getSize(qb) + bytes, stats.dropped, stats.discarded,
+					stats.rejected, fails,
+					memcmp(buffer, bigbuffer + front, bytes) == 0 ?
+					"correct" : "WRONG");
+			snprintf(what, sizeof(what), "%s %s keeps the right bytes",
+					backendnames[c], policynames[p]);
+			check(memcmp(buffer, bigbuffer + front, bytes) == 0 &&
+					qb_getSize(qb) + bytes + stats.dropped + stats.discarded ==
+					total && (size_t)fails == stats.rejected, what);
+
+			qb_free(&qb);
+		}
+	}
+
+	/*
+		Drop-oldest with a concurrent consumer: the producer overwrites a
+		small ring with increasing counters. Whatever the consumer gets must
+		still be strictly increasing (never torn or stale), and it must get
+		some of them while the producer is still running.
+	*/
+	config.backend = QB_BACKEND_RING;
+	config.capacity = FRESH_RINGCAP;
+	config.overflow = QB_OVERFLOW_DROP_OLDEST;
+	if (initialize(&qb, &config, "ring drop-oldest")) {
+		pthread_t producer;
+		uint32_t  counters[16], last = 0, received = 0, during = 0;
+		size_t    disorder = 0;
+		int       k, running, done = 0;
+
+		atomic_store(&freshdone, 0);
+		pthread_create(&producer, NULL, freshProducer, qb);
+		while (!done) {
+			running = !atomic_load(&freshdone);
+			bytes = qb_pop(qb, counters, sizeof(counters));
+			if (bytes == 0) {
+				sched_yield();
+				continue;
+			}
+
+			for (k = 0; k < bytes / 4; ++k) {
+				if (counters[k] <= last && received > 0)
+					++disorder;
+				last = counters[k];
+				++received;
+				// Past the first ring's worth, so the ring was being
+				// overwritten when this was popped
+				if (running && last >= FRESH_RINGCAP / 4)
+					++during;
+				if (last == FRESH_COUNT - 1)
+					done = 1;
+			}
+		}
+		pthread_join(producer, NULL);
+
+		qb_getStats(qb, &stats);
+		printf("ring drop-oldest, threaded: received %u of %u counters "
+				"(%u while producing), %zu bytes dropped, %zu out of order\n",
+				received, FRESH_COUNT, during, stats.dropped, disorder);
+		check(during > 0, "consumer received counters while the producer ran");
+		check(disorder == 0, "received counters strictly increasing");
+		qb_free(&qb);
+	}
+
+	/*
+		Test 10
+		qb_find, qb_findAny and qb_popUntil must find delimiters that sit
+		right after a node boundary or the end of the ring, with every kind
+		of set (single byte, SIMD-sized, lookup table)
+	*/
+	printf("\n == Test 10 == \n\n");
+
+	const char *smallset = "\r\n",
+	           *largeset = "\t!@#$%^&*()";
+	for (c = 0; c < NUMBACKENDS; ++c) {
+		config.backend = backends[c];
+		config.capacity = 4 * QB_BUFSIZE;
+		config.reserve = QB_DEFAULT_RESERVE;
+		config.overflow = QB_OVERFLOW_DROP_NEWEST;
+		if (!initialize(&qb, &config, backendnames[c]))
+			continue;
+
+		// Move the front part-way in, so the ring wraps during the test
+		memset(bigbuffer, '.', sizeof(bigbuffer));
+		qb_push(qb, bigbuffer, 3 * QB_BUFSIZE);
+		qb_consume(qb, 3 * QB_BUFSIZE - 100);
+
+		// Delimiters: 0x7E and '\r' at the first byte past the wrap /
+		// second node, '*' (table only) after that
+		size_t wrap = QB_BUFSIZE + 100;
+		bigbuffer[wrap - 100] = 0x7E;
+		bigbuffer[wrap - 100 + 1] = '\r';
+		bigbuffer[wrap - 100 + 5] = '*';
+		qb_push(qb, bigbuffer, 2 * QB_BUFSIZE);
+
+		int found = qb_find(qb, 0x7E),
+		    foundsmall = qb_findAny(qb, smallset, 2),
+		    foundlarge = qb_findAny(qb, largeset, strlen(largeset)),
+		    missing = qb_find(qb, 'x');
+		printf("%s: find 0x7E at %d (expect %zu), findAny \\r\\n at %d "
+				"(expect %zu), findAny table at %d (expect %zu), "
+				"find x %s\n",
+				backendnames[c], found, wrap, foundsmall, wrap + 1,
+				foundlarge, wrap + 5,
+				missing == QB_NOT_FOUND ? "not found" : "FOUND");
+		snprintf(what, sizeof(what), "%s finds delimiters past the wrap",
+				backendnames[c]);
+		check(found == (int)wrap && foundsmall == (int)wrap + 1 &&
+				foundlarge == (int)wrap + 5 && missing == QB_NOT_FOUND, what);
+
+		// Nothing popped by searching; then take everything up to the frame
+		// start, then one line
+		int before = qb_getSize(qb);
+		qb_consume(qb, found);
+		bytes = qb_popUntil(qb, buffer, sizeof(buffer), smallset, 2);
+		printf("%s: size unchanged by search %s, popUntil returned %d "
+				"ending in %s\n", backendnames[c],
+				before == qb_getSize(qb) + found + bytes ? "yes" : "NO",
+				bytes, buffer[bytes - 1] == '\r' ? "\\r" : "WRONG byte");
+		snprintf(what, sizeof(what), "%s popUntil stops after the delimiter",
+				backendnames[c]);
+		check(before == qb_getSize(qb) + found + bytes && bytes == 2 &&
+				buffer[bytes - 1] == '\r', what);
+
+		// No delimiter left: short of numbytes pops nothing, then an overlong
+		// line pops numbytes
+		qb_free(&qb);
+		if (!initialize(&qb, &config, backendnames[c]))
+			continue;
+		memset(bigbuffer, '.', sizeof(bigbuffer));
+		qb_push(qb, bigbuffer, 100);
+		bytes = qb_popUntil(qb, buffer, sizeof(buffer), smallset, 2);
+		printf("%s: popUntil without delimiter returned %d", backendnames[c],
+				bytes);
+		int partial = bytes;
+		qb_push(qb, bigbuffer, 200);
+		bytes = qb_popUntil(qb, buffer, sizeof(buffer), smallset, 2);
+		printf(", then %d once the line was too long\n", bytes);
+		snprintf(what, sizeof(what), "%s popUntil without a delimiter",
+				backendnames[c]);
+		check(partial == 0 && bytes == (int)sizeof(buffer), what);
+
+		qb_free(&qb);
+	}
+
+	printf("\n%d checks failed\n\n", failures);
+	return failures;
+}
+
+double stressRun(struct QueueBuffer *qb, pthread_mutex_t *lock, size_t chunk,
+		size_t *errors) {
+	struct StressArgs args;
+	args.qb = qb;
+	args.lock = lock;
+	args.chunk = chunk;
+	args.errors = 0;
+
+	struct timespec start, end;
+	pthread_t producer, consumer;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&producer, NULL, stressProducer, &args);
+	pthread_create(&consumer, NULL, stressConsumer, &args);
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+
+	*errors = args.errors;
+	return STRESS_BYTES / seconds / 1e6;
+}
+
+void *stressProducer(void *arg) {
+	struct StressArgs *args = (struct StressArgs *)arg;
+	uint8_t buffer[1024];
+	size_t  sent = 0, i;
+	int     pushed;
+
+	while (sent < STRESS_BYTES) {
+		size_t len = args->chunk;
+		if (len > STRESS_BYTES - sent)
+			len = STRESS_BYTES - sent;
+		for (i = 0; i < len; ++i)
+			buffer[i] = (uint8_t)(sent + i);
+
+		// The ring may accept only part of the chunk when it is full
+		i = 0;
+		while (i < len) {
+			if (args->lock)
+				pthread_mutex_lock(args->lock);
+			pushed = qb_push(args->qb, buffer + i, len - i);
+			if (args->lock)
+				pthread_mutex_unlock(args->lock);
+
+			if (pushed == 0)
+				sched_yield();
+			i += pushed;
+		}
+		sent += len;
+	}
+
+	return NULL;
+}
+
+void *freshProducer(void *arg) {
+	struct QueueBuffer *qb = (struct QueueBuffer *)arg;
+	uint32_t counters[16], next = 0;
+	int      k;
+
+	while (next < FRESH_COUNT) {
+		for (k = 0; k < 16; ++k)
+			counters[k] = next++;
+		qb_push(qb, counters, sizeof(counters));
+
+		// Let the consumer in now and then, as gaps between bursts of input
+		// would, so it gets turns even on a single CPU
+		if (next % (64 * 1024) == 0)
+			sched_yield();
+	}
+
+	atomic_store(&freshdone, 1);
+	return NULL;
+}
+
+void *stressConsumer(void *arg) {
+	struct StressArgs *args = (struct StressArgs *)arg;
+	uint8_t buffer[1024];
+	size_t  received = 0;
+	int     bytes, i;
+
+	while (received < STRESS_BYTES) {
+		if (args->lock)
+			pthread_mutex_lock(args->lock);
+		bytes = qb_pop(args->qb, buffer, args->chunk);
+		if (args->lock)
+			pthread_mutex_unlock(args->lock);
+
+		if (bytes == 0) {
+			sched_yield();
+			continue;
+		}
+
+		for (i = 0; i < bytes; ++i)
+			if (buffer[i] != (uint8_t)(received + i))
+				++args->errors;
+		received += bytes;
+	}
+
+	return NULL;
+}
+
+int initialize(struct QueueBuffer **qb, const struct QueueBufferConfig *config,
+		const char *name) {
+	char what[64];
+	int  ok = qb_initializeWithConfig(qb, config);
+
+	snprintf(what, sizeof(what), "%s QueueBuffer initialized", name);
+	check(ok, what);
+	return ok;
+}
 
-	printf("\nDone!\n\n");
-	return 0;
+void check(int passed, const char *what) {
+	printf("  %s: %s\n", passed ? "PASS" : "FAIL", what);
+	if (!passed)
+		++failures;
 }
 
 void ignoreInput() {
@@ -0,0 +1,205 @@
+/**
+	Philip Romano
+	Tests for RecordQueue
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "recordqueue.h"
+
+// Threaded test (Test 3)
+#define NUMPRODUCERS 4
+#define RECORDS_EACH 200000
+
+struct Record {
+	uint32_t producer,
+	         sequence;
+	uint8_t  fill[40]; // Every byte equal to (producer + sequence)
+};
+
+static void *recordProducer(void *arg);
+static void  check(int passed, const char *what);
+
+static struct RecordQueue *shared;
+static int failures = 0;
+
+int main(int argc, char **argv) {
+	struct RecordQueue *rq;
+	struct RecordQueueStats stats;
+	char buffer[256];
+	const void *record;
+	size_t len;
+	int i, bytes;
+
+	/*
+		Test 1
+		Push records of varying length in one thread, so they wrap around the
+		ring many times; each must come back whole and in order
+	*/
+	printf("\n == Test 1 == \n\n");
+
+	rq_initialize(&rq, 1024);
+
+	int errors = 0, pushed = 0, popped = 0;
+	for (i = 0; i < 10000; ++i) {
+		int n = 1 + i % 61;
+		memset(buffer, 'a' + i % 26, n);
+		if (rq_push(rq, buffer, n) != n)
+			++errors;
+		++pushed;
+
+		// Let a few records build up before draining, and drain the rest
+		// at the end
+		if (i % 3 == 2 || i == 9999) {
+			while ((bytes = rq_pop(rq, buffer, sizeof(buffer))) > 0) {
+				int expect = 1 + popped % 61, k;
+				if (bytes != expect)
+					++errors;
+				for (k = 0; k < bytes; ++k)
+					if (buffer[k] != 'a' + popped % 26)
+						++errors;
+				++popped;
+			}
+		}
+	}
+
+	rq_getStats(rq, &stats);
+	printf("Pushed %d, popped %d, %d errors, %zu bytes left in use\n",
+			pushed, popped, errors, stats.size);
+	check(errors == 0 && popped == pushed,
+			"records come back whole and in order");
+	check(stats.size == 0, "no space left in use");
+	rq_free(&rq);
+
+	/*
+		Test 2
+		Full and oversized records are refused without storing anything, and
+		a record too big for the caller's buffer stays queued
+	*/
+	printf("\n == Test 2 == \n\n");
+
+	rq_initialize(&rq, 256);
+	memset(buffer, 'x', sizeof(buffer));
+
+	int accepted = 0, full = 0;
+	for (i = 0; i < 20; ++i) {
+		int result = rq_push(rq, buffer, 24);
+		if (result == 24)
+			++accepted;
+		else if (result == RQ_ERROR_FULL)
+			++full;
+	}
+	printf("Accepted %d records of 24 bytes (expect 8), %d refused as full\n",
+			accepted, full);
+
+	check(accepted == 8 && full == 12, "pushes refused once full");
+
+	bytes = rq_push(rq, buffer, rq_getMaxRecord(rq) + 1);
+	printf("Oversized push returned %d (expect %d)\n", bytes, RQ_ERROR_SIZE);
+	check(bytes == RQ_ERROR_SIZE, "oversized push refused");
+
+	bytes = rq_pop(rq, buffer, 10);
+	printf("Pop into a short buffer returned %d (expect %d)\n", bytes,
+			RQ_ERROR_SIZE);
+	check(bytes == RQ_ERROR_SIZE, "pop into a short buffer refused");
+
+	record = rq_peek(rq, &len);
+	printf("Peek after that: %s, %zu bytes\n",
+			record ? "record still there" : "NO record", len);
+	check(record && len == 24, "record kept after a short pop");
+	rq_consume(rq);
+
+	rq_getStats(rq, &stats);
+	printf("Stats: %zu records, %zu bytes consumed, %zu rejected\n",
+			stats.records, stats.bytes, stats.rejected);
+	rq_free(&rq);
+
+	/*
+		Test 3
+		Several producer threads push numbered records into a small queue.
+		Each record must arrive whole, and each producer's records in order.
+	*/
+	printf("\n == Test 3 == \n\n");
+
+	rq_initialize(&shared, 4096);
+
+	pthread_t producers[NUMPRODUCERS];
+	uint32_t  ids[NUMPRODUCERS],
+	          next[NUMPRODUCERS];
+	size_t    received = 0, torn = 0, disorder = 0;
+
+	for (i = 0; i < NUMPRODUCERS; ++i) {
+		ids[i] = i;
+		next[i] = 0;
+		pthread_create(&producers[i], NULL, recordProducer, &ids[i]);
+	}
+
+	while (received < (size_t)NUMPRODUCERS * RECORDS_EACH) {
+		record = rq_peek(shared, &len);
+		if (!record) {
+			sched_yield();
+			continue;
+		}
+
+		const struct Record *r = (const struct Record *)record;
+		uint8_t expect = (uint8_t)(r->producer + r->sequence);
+		size_t k;
+
+		if (len != sizeof(struct Record) || r->producer >= NUMPRODUCERS) {
+			++torn;
+		} else {
+			for (k = 0; k < sizeof(r->fill); ++k)
+				if (r->fill[k] != expect)
+					break;
+			if (k != sizeof(r->fill))
+				++torn;
+			if (r->sequence != next[r->producer])
+				++disorder;
+			next[r->producer] = r->sequence + 1;
+		}
+
+		rq_consume(shared);
+		++received;
+	}
+
+	for (i = 0; i < NUMPRODUCERS; ++i)
+		pthread_join(producers[i], NULL);
+
+	rq_getStats(shared, &stats);
+	printf("%d producers: received %zu records, %zu torn, %zu out of order, "
+			"%zu retries, %zu full\n", NUMPRODUCERS, received, torn, disorder,
+			stats.retries, stats.rejected);
+	check(torn == 0, "every record arrives whole");
+	check(disorder == 0, "each producer's records arrive in order");
+	rq_free(&shared);
+
+	printf("\n%d checks failed\n\n", failures);
+	return failures;
+}
+
+void *recordProducer(void *arg) {
+	struct Record r;
+	uint32_t sequence;
+
+	r.producer = *(uint32_t *)arg;
+	for (sequence = 0; sequence < RECORDS_EACH; ++sequence) {
+		r.sequence = sequence;
+		memset(r.fill, (uint8_t)(r.producer + sequence), sizeof(r.fill));
+
+		while (rq_push(shared, &r, sizeof(r)) == RQ_ERROR_FULL)
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+
+void check(int passed, const char *what) {
+	printf("  %s: %s\n", passed ? "PASS" : "FAIL", what);
+	if (!passed)
+		++failures;
+}
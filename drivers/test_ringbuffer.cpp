@@ -0,0 +1,114 @@
+/**
+	Tests for RingBuffer and AxisRingBuffer
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ringbuffer.h"
+
+struct Sample {
+	int16_t x, y, z;
+};
+
+static int failures = 0;
+
+static void check(int passed, const char *what);
+
+int main(int argc, char **argv) {
+	/*
+		Test 1
+		Fill past capacity; indexed and contiguous access must both give the
+		last N values, oldest first
+	*/
+	printf("\n == Test 1 == \n\n");
+
+	RingBuffer<int, 5> ring;
+	int i, errors = 0;
+
+	printf("Empty: size %zu, capacity %zu\n", ring.size(), ring.capacity());
+
+	for (i = 0; i < 13; ++i) {
+		ring.push(i);
+
+		// Values held are max(0, i - 4) .. i
+		int first = i < 5 ? 0 : i - 4;
+		size_t n;
+		for (n = 0; n < ring.size(); ++n) {
+			if (ring[n] != first + (int)n || ring.data()[n] != first + (int)n)
+				++errors;
+		}
+		if (ring.newest() != i)
+			++errors;
+	}
+
+	printf("After 13 pushes: size %zu, full %d, contents:", ring.size(),
+			ring.full());
+	for (i = 0; i < (int)ring.size(); ++i)
+		printf(" %d", ring[i]);
+	printf("\n%d errors\n", errors);
+	check(errors == 0, "indexed and contiguous access give the last 5");
+	check(ring.size() == 5 && ring.full(), "full at capacity");
+
+	/*
+		Test 2
+		Structs as elements, with newest() counting back
+	*/
+	printf("\n == Test 2 == \n\n");
+
+	RingBuffer<Sample, 4> samples;
+	for (i = 0; i < 6; ++i) {
+		Sample s = { (int16_t)i, (int16_t)(i * 10), (int16_t)(i * 100) };
+		samples.push(s);
+	}
+	printf("newest(0).y = %d, newest(3).z = %d\n",
+			samples.newest(0).y, samples.newest(3).z);
+	check(samples.newest(0).y == 50 && samples.newest(3).z == 200,
+			"newest() counts back from the last push");
+
+	/*
+		Test 3
+		Per-axis storage: a moving average over each axis uses only the
+		contiguous per-axis arrays
+	*/
+	printf("\n == Test 3 == \n\n");
+
+	AxisRingBuffer<int16_t, 8, 3> gyro;
+	errors = 0;
+	for (i = 0; i < 20; ++i) {
+		int16_t sample[3] = { (int16_t)i, (int16_t)-i, (int16_t)(2 * i) };
+		gyro.push(sample);
+	}
+
+	size_t axis, n;
+	for (axis = 0; axis < gyro.axes(); ++axis) {
+		const int16_t *values = gyro.data(axis);
+		int32_t sum = 0;
+		for (n = 0; n < gyro.size(); ++n)
+			sum += values[n];
+		printf("Axis %zu: mean of last %zu = %d\n", axis, gyro.size(),
+				(int)(sum / (int32_t)gyro.size()));
+	}
+
+	for (n = 0; n < gyro.size(); ++n) {
+		if (gyro.at(0, n) != 12 + (int)n || gyro.at(1, n) != -(12 + (int)n))
+			++errors;
+	}
+	if (gyro.newest(2) != 38)
+		++errors;
+
+	printf("%d errors\n", errors);
+	check(errors == 0, "per-axis access gives the last 8 samples");
+	check(alignof(AxisRingBuffer<int16_t, 8, 3>) == RINGBUFFER_ALIGN &&
+			alignof(RingBuffer<Sample, 4>) == RINGBUFFER_ALIGN,
+			"storage aligned to RINGBUFFER_ALIGN");
+
+	printf("\n%d checks failed\n\n", failures);
+	return failures;
+}
+
+void check(int passed, const char *what) {
+	printf("  %s: %s\n", passed ? "PASS" : "FAIL", what);
+	if (!passed)
+		++failures;
+}
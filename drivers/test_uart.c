@@ -1,9 +1,17 @@
 /**
 	Philip Romano
 	Test for UART
+
+	Interactive: type lines to send, and see what comes back.
+
+	Usage: test_uart.x [device [baudrate]]
+	  device defaults to /dev/ttyAMA0, baudrate to 9600. Any serial device
+	  works, including the slave side of a pseudo-terminal (see
+	  test_uartpty.c for a test that needs no one at the other end).
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -12,8 +20,11 @@
 static void ignoreInput();
 
 int main(int argc, char **argv) {
-	if (!uart_init(9600, UART_PARDISABLE)) {
-		fprintf(stderr, "uart_init(): %s\n", uart_getLastError());
+	const char *device = argc > 1 ? argv[1] : "/dev/ttyAMA0";
+	int baudrate = argc > 2 ? atoi(argv[2]) : 9600;
+
+	if (!uart_initWithOptions(device, baudrate, UART_PARDISABLE, NULL)) {
+		fprintf(stderr, "uart_initWithOptions(): %s\n", uart_getLastError());
 		return -1;
 	}
 
@@ -56,18 +67,18 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	printf("Attempting to read a UBE16...\n");
+	printf("Attempting to read a UBE16 (waiting up to 2 seconds)...\n");
 	uint16_t number16;
-	if (uart_readUBE16(&number16))
+	if (uart_waitReadable(2, 2000) > 0 && uart_readUBE16(&number16))
 		printf("  Received: %d\n", number16);
 	else {
 		printf("  Not enough data to read\n");
 		printf("  Size of queue: %d\n", uart_getInputQueueSize());
 	}
 
-	printf("Attempting to read a UBE32...\n");
+	printf("Attempting to read a UBE32 (waiting up to 2 seconds)...\n");
 	uint32_t number32;
-	if (uart_readUBE32(&number32))
+	if (uart_waitReadable(4, 2000) > 0 && uart_readUBE32(&number32))
 		printf("  Received: %d\n", number32);
 	else {
 		printf("  Not enough data to read\n");
@@ -75,13 +86,13 @@ int main(int argc, char **argv) {
 	}
 
 	/*
-	// Read whenever RX FIFO is not empty, until a ` is read
+	// Read whenever data arrives, sleeping in between, until a ` is read
 	done = 0;
 	int bytes;
 
 	printf("Waiting...\n");
 	while (!done) {
-		bytes = uart_read(buffer, 49);
+		bytes = uart_readTimeout(buffer, 49, 1, -1);
 
 		if (bytes > 0) {
 			buffer[bytes] = '\0'; // Terminate string
@@ -95,6 +106,17 @@ int main(int argc, char **argv) {
 	}
 	*/
 
+	// Line errors only show up on a real line
+	struct UARTStats stats;
+	if (uart_getStats(&stats)) {
+		printf("Link over %.1f s: %zu bytes in, %zu out (peaks %zu, %zu)\n",
+				stats.uptime, stats.rxbytes, stats.txbytes, stats.rxpeak,
+				stats.txpeak);
+		printf("  Errors: %zu overrun, %zu buffer overrun, %zu parity, "
+				"%zu framing, %zu break\n", stats.overrun, stats.bufoverrun,
+				stats.parity, stats.framing, stats.breaks);
+	}
+
 	if (!uart_deinit()) {
 		fprintf(stderr, "uart_deinit(): %s\n", uart_getLastError());
 		return -1;
@@ -0,0 +1,601 @@
+/**
+	Philip Romano
+	Test for UART over a pseudo-terminal
+
+	Unlike test_uart.c, this needs no serial port and no one at the other
+	end: a scripted peer on a pseudo-terminal plays the device. Every check
+	prints its result, and the exit status is the number that failed, so
+	"make check" can run it on any Linux machine.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "uart.h"
+#include "ptyharness.h"
+#include "recordqueue.h"
+
+// Bytes looped back at each rate in Test 3
+#define THROUGHPUT_BYTES (32 * 1024)
+
+// Bytes sent ahead of the reader in Test 4: more than the input queue holds
+#define BACKLOG_BYTES (160 * 1024)
+
+// Bytes written to a peer that is not reading in Test 5: more than the
+// pseudo-terminal buffers, less than the output queue holds
+#define STALLED_BYTES (32 * 1024)
+
+// Input queue high watermark in Test 6, and the bytes sent past it
+#define HIGHWATER_BYTES (8 * 1024)
+#define FLOWED_BYTES    (256 * 1024)
+
+// Threads pushing records in Test 7, and the records each pushes
+#define RECORD_PRODUCERS 2
+#define RECORDS_EACH     2000
+
+struct Record {
+	uint32_t producer,
+	         sequence;
+	uint8_t  fill[24]; // Every byte equal to (producer + sequence)
+};
+
+static int failures = 0;
+
+static struct RecordQueue *records;
+
+static int    openUART(int *master, UARTRxMode rxmode, int baudrate,
+		UARTFlowControl flowcontrol, size_t rxhighwater);
+static void   closeUART(int master);
+static void  *recordProducer(void *arg);
+static void   check(int passed, const char *what);
+static double now();
+
+int main(int argc, char **argv) {
+	const char *modenames[] = { "signal", "thread", "uring" };
+	struct PtyPeer peer;
+	char buffer[64];
+	int  master, m, bytes;
+
+	/*
+		Test 1
+		A request-response exchange with the peer, in each receive mode
+	*/
+	printf("\n == Test 1 == \n\n");
+
+	struct PtyStep exchange[] = {
+		{ PTY_EXPECT, "ping\r", 5 },
+		{ PTY_SEND,   "pong\r", 5 }
+	};
+
+	for (m = UART_RXSIGNAL; m <= UART_RXURING; ++m) {
+		if (!openUART(&master, (UARTRxMode)m, 115200, UART_FLOWNONE, 0))
+			return 1;
+		pty_startPeer(&peer, master, exchange, 2);
+
+		uart_write("ping\r", 5);
+		bytes = uart_readTimeout(buffer, 5, 5, 2000);
+		int passed = pty_stopPeer(&peer, 2000);
+
+		// Without io_uring, UART_RXURING runs as UART_RXTHREAD
+		printf("%s (running as %s): sent ping, got %d bytes back\n",
+				modenames[m], modenames[uart_getRxMode()], bytes);
+		check(passed && bytes == 5 && memcmp(buffer, "pong\r", 5) == 0,
+				"request-response exchange");
+		check(uart_readTimeout(buffer, 1, 1, 50) == 0,
+				"nothing more to read");
+		closeUART(master);
+	}
+
+	/*
+		Test 2
+		The big-endian helpers put the expected bytes on the wire, and read
+		the same bytes back as the values they started from
+	*/
+	printf("\n == Test 2 == \n\n");
+
+	uint16_t u16 = 0x1234, a16[2] = { 0x0001, 0xABCD }, r16, ra16[2];
+	uint32_t u32 = 0xDEADBEEF, a32[1] = { 0x01020304 }, r32, ra32[1];
+	float    af[2] = { 1.5f, -2.0f }, raf[2];
+	const uint8_t wire[] = {
+		0x12, 0x34,                                     // UBE16
+		0xDE, 0xAD, 0xBE, 0xEF,                         // UBE32
+		0x00, 0x01, 0xAB, 0xCD,                         // BE16 array
+		0x01, 0x02, 0x03, 0x04,                         // BE32 array
+		0x3F, 0xC0, 0x00, 0x00, 0xC0, 0x00, 0x00, 0x00  // Float array
+	};
+	struct PtyStep endian[] = {
+		{ PTY_EXPECT, wire, sizeof(wire) },
+		{ PTY_SEND,   wire, sizeof(wire) }
+	};
+
+	if (!openUART(&master, UART_RXTHREAD, 115200, UART_FLOWNONE, 0))
+		return 1;
+	pty_startPeer(&peer, master, endian, 2);
+
+	uart_writeUBE16(u16);
+	uart_writeUBE32(u32);
+	uart_writeBE16Array(a16, 2);
+	uart_writeBE32Array(a32, 1);
+	uart_writeBEFloatArray(af, 2);
+
+	int ready = uart_waitReadable(sizeof(wire), 2000);
+	int passed = pty_stopPeer(&peer, 2000);
+	printf("Peer saw %zu bytes written, %zu of them wrong\n", peer.received,
+			peer.mismatched);
+	check(passed, "bytes on the wire are big-endian");
+	check(ready >= (int)sizeof(wire), "all bytes came back");
+
+	check(uart_readUBE16(&r16) && r16 == u16, "uart_readUBE16");
+	check(uart_readUBE32(&r32) && r32 == u32, "uart_readUBE32");
+	check(uart_readBE16Array(ra16, 2) && memcmp(ra16, a16, sizeof(a16)) == 0,
+			"uart_readBE16Array");
+	check(uart_readBE32Array(ra32, 1) && memcmp(ra32, a32, sizeof(a32)) == 0,
+			"uart_readBE32Array");
+	check(uart_readBEFloatArray(raf, 2) && raf[0] == af[0] && raf[1] == af[1],
+			"uart_readBEFloatArray");
+	check(!uart_readUBE16(&r16), "uart_readUBE16 with nothing queued");
+	closeUART(master);
+
+	/*
+		Test 3
+		Loop a counting pattern through an echoing peer at every supported
+		rate. A pseudo-terminal does not pace its output, so this shows
+		whether each rate can be set and carries data intact, and what the
+		driver itself can move; not what the line can.
+	*/
+	printf("\n == Test 3 == \n\n");
+
+	int rates[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200,
+	                230400, 250000, 460800, 500000, 576000, 921600, 1000000,
+	                1152000, 1500000, 2000000, 2500000, 3000000, 3500000,
+	                4000000 };
+	struct PtyStep echo = { PTY_ECHO, NULL, 0 };
+	static uint8_t pattern[THROUGHPUT_BYTES], received[THROUGHPUT_BYTES];
+	size_t r, i;
+
+	for (i = 0; i < THROUGHPUT_BYTES; ++i)
+		pattern[i] = (uint8_t)(i * 7);
+
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); ++r) {
+		if (!openUART(&master, UART_RXTHREAD, rates[r], UART_FLOWNONE, 0))
+			return 1;
+		pty_startPeer(&peer, master, &echo, 1);
+
+		double start = now();
+		size_t sent = 0, got = 0;
+		while (got < THROUGHPUT_BYTES) {
+			if (sent < THROUGHPUT_BYTES)
+				sent += uart_write(pattern + sent, THROUGHPUT_BYTES - sent);
+
+			bytes = uart_readTimeout(received + got, THROUGHPUT_BYTES - got,
+					1, 1000);
+			if (bytes <= 0)
+				break;
+			got += bytes;
+		}
+		double seconds = now() - start;
+		int applied = uart_getBaudRate();
+
+		pty_stopPeer(&peer, 0);
+		closeUART(master);
+
+		printf("%7d baud (applied %7d): %zu of %d bytes, %.2f MB/s\n",
+				rates[r], applied, got, THROUGHPUT_BYTES,
+				got / seconds / 1e6);
+		snprintf(buffer, sizeof(buffer), "%d baud", rates[r]);
+		check(applied == rates[r] && got == THROUGHPUT_BYTES &&
+				memcmp(pattern, received, THROUGHPUT_BYTES) == 0, buffer);
+	}
+
+	/*
+		Test 4
+		The peer sends more than the input queue holds before anything is
+		read. Input stops while the queue is full and resumes as it is read,
+		with nothing lost or reordered, in each mode that reads from a thread.
+		Input io_uring had already read, held until there was room, keeps
+		the time it arrived rather than the time it was queued.
+	*/
+	printf("\n == Test 4 == \n\n");
+
+	static uint8_t backlog[BACKLOG_BYTES], drained[BACKLOG_BYTES];
+	struct PtyStep flood = { PTY_SEND, backlog, BACKLOG_BYTES };
+	struct UARTStats stats;
+
+	for (i = 0; i < BACKLOG_BYTES; ++i)
+		backlog[i] = (uint8_t)(i * 13 + 1);
+
+	for (m = UART_RXTHREAD; m <= UART_RXURING; ++m) {
+		if (!openUART(&master, (UARTRxMode)m, 115200, UART_FLOWNONE, 0))
+			return 1;
+		pty_startPeer(&peer, master, &flood, 1);
+
+		// Let the queue fill and the peer back up behind it
+		struct timespec pause = { 0, 200000000 };
+		nanosleep(&pause, NULL);
+		int queued = uart_getInputQueueSize();
+
+		// Read past what was queued, to the first byte that was held
+		struct timespec arrival;
+		size_t got = uart_readTimeout(drained, queued, queued, 1000);
+		uart_waitReadable(1, 1000);
+		got += uart_readTimestamped(drained + got, 1, &arrival);
+		double age = now() - (arrival.tv_sec + arrival.tv_nsec / 1e9);
+
+		while (got < BACKLOG_BYTES) {
+			bytes = uart_readTimeout(drained + got, BACKLOG_BYTES - got, 1,
+					1000);
+			if (bytes <= 0)
+				break;
+			got += bytes;
+		}
+		int passed = pty_stopPeer(&peer, 2000);
+		uart_getStats(&stats);
+		closeUART(master);
+
+		printf("%s: %d bytes queued before reading, %zu of %d received, "
+				"queue full %zu times, next byte arrived %.0f ms before\n",
+				modenames[m], queued, got, BACKLOG_BYTES, stats.rxfull,
+				age * 1e3);
+		check(passed && got == BACKLOG_BYTES &&
+				memcmp(backlog, drained, BACKLOG_BYTES) == 0,
+				modenames[m]);
+		if (m == UART_RXURING)
+			check(age >= 0.1, "held input stamped when it arrived");
+	}
+
+	/*
+		Test 5
+		The counters follow the traffic. While the peer is not reading,
+		writes come up short and then are refused, and output backs up in
+		the queue; once it reads, everything is counted through.
+	*/
+	printf("\n == Test 5 == \n\n");
+
+	static uint8_t stalled[STALLED_BYTES];
+	struct PtyStep take = { PTY_EXPECT, NULL, STALLED_BYTES },
+	               give = { PTY_SEND, backlog, 1000 };
+
+	if (!openUART(&master, UART_RXTHREAD, 115200, UART_FLOWNONE, 0))
+		return 1;
+
+	int accepted = uart_write(stalled, STALLED_BYTES);
+	uart_flush(0);
+	uart_getStats(&stats);
+	printf("Peer stalled: %d bytes accepted, %zu written, %zu short, "
+			"%zu refused, output peak %zu\n", accepted, stats.txbytes,
+			stats.txshort, stats.txagain, stats.txpeak);
+	check(accepted == STALLED_BYTES && stats.txbytes < STALLED_BYTES &&
+			stats.txshort >= 1 && stats.txagain >= 1,
+			"short and refused writes counted");
+	check(stats.txpeak == STALLED_BYTES, "output peak");
+
+	pty_startPeer(&peer, master, &take, 1);
+	check(uart_flush(2000) == 0 && pty_stopPeer(&peer, 2000),
+			"output drained once the peer reads");
+
+	pty_startPeer(&peer, master, &give, 1);
+	ready = uart_waitReadable(1000, 2000);
+	passed = pty_stopPeer(&peer, 2000);
+	uart_getStats(&stats);
+	uart_readTimeout(drained, 1000, 1000, 0);
+	closeUART(master);
+
+	printf("%zu bytes in, %zu out, %zu reads, input peak %zu, %zu writev() "
+			"calls, %zu system calls in %.3f s\n", stats.rxbytes,
+			stats.txbytes, stats.rxreads, stats.rxpeak, stats.txwrites,
+			stats.syscalls, stats.uptime);
+	check(passed && ready == 1000 && stats.rxbytes == 1000 &&
+			stats.rxreads >= 1, "input counted");
+	check(stats.rxpeak > 0 && stats.rxpeak <= 1000, "input peak");
+	check(stats.txbytes == STALLED_BYTES, "output counted");
+	check(stats.overrun == 0 && stats.bufoverrun == 0 && stats.parity == 0 &&
+			stats.framing == 0 && stats.breaks == 0,
+			"no line errors on a pseudo-terminal");
+	check(stats.uptime > 0.0, "uptime");
+
+	/*
+		Test 6
+		With flow control and a high watermark, a consumer that stops
+		reading holds input at the watermark, and everything sent arrives
+		once it reads again. A pseudo-terminal has no RTS/CTS lines and
+		sends no XOFF of its own, so it is the watermark that holds the
+		sender off here; the flow control shows in the terminal settings.
+		Output stops on XOFF from the peer and resumes on XON.
+	*/
+	printf("\n == Test 6 == \n\n");
+
+	const char *flownames[] = { "none", "RTS/CTS", "XON/XOFF" };
+	static uint8_t flowed[FLOWED_BYTES], flowin[FLOWED_BYTES];
+	struct PtyStep burst = { PTY_SEND, flowed, FLOWED_BYTES };
+	int flow;
+
+	// Printable, so nothing in it reads as XON or XOFF
+	for (i = 0; i < FLOWED_BYTES; ++i)
+		flowed[i] = (uint8_t)(' ' + i * 7 % 95);
+
+	for (flow = UART_FLOWRTSCTS; flow <= UART_FLOWXONXOFF; ++flow) {
+		for (m = UART_RXTHREAD; m <= UART_RXURING; ++m) {
+			if (!openUART(&master, (UARTRxMode)m, 4000000,
+					(UARTFlowControl)flow, HIGHWATER_BYTES))
+				return 1;
+
+			struct termios tprops;
+			tcgetattr(master, &tprops);
+			int applied = flow == UART_FLOWRTSCTS ?
+					(tprops.c_cflag & CRTSCTS) != 0 :
+					(tprops.c_iflag & (IXON | IXOFF)) == (IXON | IXOFF);
+
+			pty_startPeer(&peer, master, &burst, 1);
+
+			// Stall while the peer sends as fast as it can
+			struct timespec pause = { 0, 200000000 };
+			nanosleep(&pause, NULL);
+			int queued = uart_getInputQueueSize();
+
+			size_t got = 0;
+			while (got < FLOWED_BYTES) {
+				bytes = uart_readTimeout(flowin + got, FLOWED_BYTES - got, 1,
+						1000);
+				if (bytes <= 0)
+					break;
+				got += bytes;
+			}
+			int passed = pty_stopPeer(&peer, 2000);
+			uart_getStats(&stats);
+			closeUART(master);
+
+			printf("%s, %s: %d bytes queued while stalled, peak %zu, %zu of "
+					"%d received\n", flownames[flow], modenames[m], queued,
+					stats.rxpeak, got, FLOWED_BYTES);
+			snprintf(buffer, sizeof(buffer), "%s, %s: flow control set",
+					flownames[flow], modenames[m]);
+			check(applied, buffer);
+			snprintf(buffer, sizeof(buffer), "%s, %s: held at the watermark",
+					flownames[flow], modenames[m]);
+			check(queued > 0 && queued <= HIGHWATER_BYTES &&
+					stats.rxpeak <= HIGHWATER_BYTES && stats.rxfull >= 1,
+					buffer);
+			snprintf(buffer, sizeof(buffer), "%s, %s: nothing lost",
+					flownames[flow], modenames[m]);
+			check(passed && got == FLOWED_BYTES &&
+					memcmp(flowed, flowin, FLOWED_BYTES) == 0, buffer);
+		}
+	}
+
+	check(!openUART(&master, UART_RXTHREAD, 115200, UART_FLOWNONE,
+			64 * 1024 + 1), "watermark beyond the queue refused");
+
+	if (!openUART(&master, UART_RXTHREAD, 115200, UART_FLOWXONXOFF, 0))
+		return 1;
+
+	struct pollfd pfd = { master, POLLIN, 0 };
+	char xoff = 0x13, xon = 0x11;
+
+	// The line discipline takes input from the master in its own time
+	struct timespec settle = { 0, 50000000 };
+	check(write(master, &xoff, 1) == 1, "XOFF sent");
+	nanosleep(&settle, NULL);
+	uart_write("abc", 3);
+	nanosleep(&settle, NULL);
+	int held = 1;
+	while (held && poll(&pfd, 1, 0) == 1)
+		held = read(master, buffer, 1) == 1 && (buffer[0] == xon ||
+				buffer[0] == xoff);
+	check(held, "output held by XOFF");
+	check(write(master, &xon, 1) == 1, "XON sent");
+	bytes = 0;
+	while (bytes < 3 && poll(&pfd, 1, 1000) == 1) {
+		if (read(master, buffer + bytes, 1) != 1)
+			break;
+
+		// The driver's side may send XON of its own as its input drains
+		if (buffer[bytes] != xon && buffer[bytes] != xoff)
+			++bytes;
+	}
+	check(bytes == 3 && memcmp(buffer, "abc", 3) == 0,
+			"output resumed by XON");
+	check(uart_readTimeout(buffer, 1, 1, 50) == 0,
+			"XON and XOFF not passed on as input");
+	closeUART(master);
+
+	/*
+		Test 7
+		Several threads push records into a RecordQueue, and one drains them
+		to the UART with rq_drainTo(). An echoing peer sends them back; each
+		must arrive whole, and each producer's in order.
+	*/
+	printf("\n == Test 7 == \n\n");
+
+	static uint8_t echoed[RECORD_PRODUCERS * RECORDS_EACH *
+			sizeof(struct Record)];
+	pthread_t producers[RECORD_PRODUCERS];
+	uint32_t  ids[RECORD_PRODUCERS], next[RECORD_PRODUCERS];
+	size_t    total = sizeof(echoed), got = 0, written = 0, torn = 0,
+	          disorder = 0;
+	int       drainerrors = 0;
+	char      slavepath[64];
+
+	// rq_drainTo() takes a handle rather than the default UART
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.rxmode = UART_RXTHREAD;
+
+	master = pty_open(slavepath, sizeof(slavepath));
+	struct UART *link = master == -1 ? NULL : uart_openWithOptions(slavepath,
+			115200, UART_PARDISABLE, &options);
+	if (!link) {
+		fprintf(stderr, "uart_openWithOptions(): %s\n", uart_getLastError());
+		return 1;
+	}
+	rq_initialize(&records, 4096);
+	pty_startPeer(&peer, master, &echo, 1);
+
+	for (i = 0; i < RECORD_PRODUCERS; ++i) {
+		ids[i] = i;
+		next[i] = 0;
+		pthread_create(&producers[i], NULL, recordProducer, &ids[i]);
+	}
+
+	// Drain and read back in turn, so neither direction backs up for long
+	double start = now();
+	while (got < total && now() - start < 10.0) {
+		int count = rq_drainTo(records, link);
+		if (count < 0)
+			++drainerrors;
+		else
+			written += count;
+
+		bytes = uart_hreadTimeout(link, echoed + got, total - got, 0, 0);
+		if (bytes > 0)
+			got += bytes;
+		else if (count == 0)
+			sched_yield();
+	}
+
+	for (i = 0; i < RECORD_PRODUCERS; ++i)
+		pthread_join(producers[i], NULL);
+	pty_stopPeer(&peer, 0);
+	uart_close(link);
+	close(master);
+	rq_free(&records);
+
+	for (i = 0; i + sizeof(struct Record) <= got; i += sizeof(struct Record)) {
+		struct Record r;
+		size_t k;
+
+		memcpy(&r, echoed + i, sizeof(r));
+		if (r.producer >= RECORD_PRODUCERS) {
+			++torn;
+			continue;
+		}
+		for (k = 0; k < sizeof(r.fill); ++k)
+			if (r.fill[k] != (uint8_t)(r.producer + r.sequence))
+				break;
+		if (k != sizeof(r.fill))
+			++torn;
+		if (r.sequence != next[r.producer])
+			++disorder;
+		next[r.producer] = r.sequence + 1;
+	}
+
+	printf("%zu records drained, %zu of %zu bytes echoed, %zu torn, "
+			"%zu out of order\n", written, got, total, torn, disorder);
+	check(drainerrors == 0 && written == RECORD_PRODUCERS * RECORDS_EACH,
+			"every record drained");
+	check(got == total && torn == 0 && disorder == 0,
+			"records whole and in order on the wire");
+
+	/*
+		Test 8
+		With latency recording on, reading what the peer sent adds samples
+		to the histogram, and its bins account for every one of them
+	*/
+	printf("\n == Test 8 == \n\n");
+
+	struct PtyStep burstlets[] = {
+		{ PTY_SEND, "one", 3 },
+		{ PTY_SEND, "two", 3 },
+		{ PTY_SEND, "six", 3 }
+	};
+	struct UARTLatency latency;
+	size_t binned = 0;
+
+	if (!openUART(&master, UART_RXTHREAD, 115200, UART_FLOWNONE, 0))
+		return 1;
+	check(uart_recordLatency(1), "recording started");
+	pty_startPeer(&peer, master, burstlets, 3);
+
+	got = 0;
+	while (got < 9) {
+		bytes = uart_readTimeout(buffer, 3, 1, 1000);
+		if (bytes <= 0)
+			break;
+		got += bytes;
+	}
+	passed = pty_stopPeer(&peer, 2000);
+	check(uart_getLatency(&latency), "histogram read");
+	closeUART(master);
+
+	for (i = 0; i < UART_LATENCYBINS; ++i)
+		binned += latency.counts[i];
+	printf("%zu bytes read, %zu samples, %zu binned, mean %.1f us, max %.1f "
+			"us\n", got, latency.samples, binned, latency.samples ?
+			latency.totalns / 1e3 / latency.samples : 0.0,
+			latency.maxns / 1e3);
+	check(passed && got == 9 && latency.samples > 0, "samples recorded");
+	check(binned == latency.samples, "bins add up to the samples");
+
+	printf("\n%d checks failed\n\n", failures);
+	return failures;
+}
+
+/**
+	Open a pseudo-terminal and initialize UART on its slave side.
+	Returns 1 on success, 0 on error.
+*/
+int openUART(int *master, UARTRxMode rxmode, int baudrate,
+		UARTFlowControl flowcontrol, size_t rxhighwater) {
+	char slavepath[64];
+
+	*master = pty_open(slavepath, sizeof(slavepath));
+	if (*master == -1) {
+		fprintf(stderr, "Could not open a pseudo-terminal\n");
+		return 0;
+	}
+
+	struct UARTOptions options;
+	uart_defaultOptions(&options);
+	options.rxmode = rxmode;
+	options.flowcontrol = flowcontrol;
+	options.rxhighwater = rxhighwater;
+	if (!uart_initWithOptions(slavepath, baudrate, UART_PARDISABLE,
+			&options)) {
+		fprintf(stderr, "uart_initWithOptions(): %s\n", uart_getLastError());
+		close(*master);
+		return 0;
+	}
+
+	return 1;
+}
+
+void closeUART(int master) {
+	if (!uart_deinit())
+		fprintf(stderr, "uart_deinit(): %s\n", uart_getLastError());
+	close(master);
+}
+
+/**
+	Push RECORDS_EACH numbered records, waiting while the queue is full
+*/
+void *recordProducer(void *arg) {
+	struct Record r;
+
+	r.producer = *(uint32_t *)arg;
+	for (r.sequence = 0; r.sequence < RECORDS_EACH; ++r.sequence) {
+		memset(r.fill, (uint8_t)(r.producer + r.sequence), sizeof(r.fill));
+		while (rq_push(records, &r, sizeof(r)) == RQ_ERROR_FULL)
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+void check(int passed, const char *what) {
+	printf("  %s: %s\n", passed ? "PASS" : "FAIL", what);
+	if (!passed)
+		++failures;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -3,310 +3,2614 @@
 	UART Interface for Raspberry Pi (Broadcom 2835)
 */
 
+#define _GNU_SOURCE // pthread_attr_setaffinity_np
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/serial.h>
+#include <linux/version.h>
+
+// UART_RXURING needs the provided buffer rings of Linux 5.19. With older
+// kernel headers it is left out, and runs as UART_RXTHREAD, as it does
+// when the running kernel lacks io_uring.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define UART_HAVEURING 1
+#include <linux/io_uring.h>
+#else
+#define UART_HAVEURING 0
+#endif
 
 #include "uart.h"
 #include "queuebuffer.h"
 
-// Internal error handling data
 #define UART_ERRSIZE 128
-static int error = 0;
+
+// Size of each UART's input queue
+#define UART_RXBUFSIZE 65536
+
+// Size of each UART's output queue
+#define UART_TXBUFSIZE 65536
+
+// How long uart_close waits for queued output to be written (ms)
+#define UART_CLOSETIMEOUT 1000
+
+// Most UARTs that can be open in UART_RXSIGNAL mode at once
+#define UART_MAXSIGNAL 8
+
+// Receive timestamps kept per UART; a power of two. When they run out,
+// new input shares the timestamp of the input before it.
+#define UART_RXSTAMPS 1024
+
+// Values converted per pass through the stack when writing an array
+#define UART_SWAPCHUNK 256
+
+// Size of the PL011 register block mapped from /dev/mem
+#define UART_PL011BLOCK 4096
+
+// Empty polls of the PL011 receive FIFO before the receive thread naps
+#define UART_POLLSPINS 1000
+
+// UART_RXURING: submission queue entries, and the buffers the kernel reads
+// into and the size of each (both counts powers of two). At most one read,
+// one write and one wakeup poll are outstanding, so the queues never fill.
+#define UART_URINGENTRIES 8
+#define UART_URINGBUFS 16
+#define UART_URINGBUFSIZE 4096
+
+// IORING_OP_READ_MULTISHOT, from Linux 6.7, which older headers lack. The
+// kernel is probed for it; without it each read is queued again by hand.
+#define UART_OPREADMULTISHOT 49
+
+// What each io_uring completion is for (its user_data)
+#define UART_URINGREAD  1
+#define UART_URINGWRITE 2
+#define UART_URINGWAKE  3
+
+// Data on the wire is big-endian; the host's order is known at compile
+// time, so conversion is either nothing or a byte swap instruction
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UART_HOSTBE 1
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define UART_HOSTBE 0
+#else
+#error "Unsupported host byte order"
+#endif
+
+_Static_assert(sizeof(float) == 4, "float must be IEEE 754 single precision");
+
+// The kernel's termios2 (asm/termbits.h), which cannot be included
+// alongside <termios.h>. It carries the baud rate as an integer, used
+// with BOTHER for rates that have no B* constant.
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+#define UART_KERNEL_NCCS 19
+
+struct termios2 {
+	tcflag_t c_iflag,
+	         c_oflag,
+	         c_cflag,
+	         c_lflag;
+	cc_t     c_line;
+	cc_t     c_cc[UART_KERNEL_NCCS];
+	speed_t  c_ispeed,
+	         c_ospeed;
+};
+
+// Rates with a B* constant, set through plain termios
+static const struct {
+	int     rate;
+	speed_t speed;
+} standardrates[] = {
+	{ 1200, B1200 }, { 1800, B1800 }, { 2400, B2400 }, { 4800, B4800 },
+	{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+	{ 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+	{ 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 },
+	{ 921600, B921600 }, { 1000000, B1000000 }, { 1152000, B1152000 },
+	{ 1500000, B1500000 }, { 2000000, B2000000 }, { 2500000, B2500000 },
+	{ 3000000, B3000000 }, { 3500000, B3500000 }, { 4000000, B4000000 }
+};
+
+struct UART {
+	// File descriptor to the terminal interface (-1 for UART_BACKENDPL011)
+	int fd;
+
+	// UART_BACKENDPL011: register access, the /dev/mem mapping behind it
+	// when it is the real UART, and for the polling thread, whether to stop,
+	// whether to poll without napping (low latency) and how long to nap (ns)
+	UARTBackend            backend;
+	struct UARTRegisterOps regops;
+	void                   *regmap;
+	atomic_int             pollstop,
+	                       pollspin;
+	long                   pollnap;
+
+	// QueueBuffer as an intermediate place to store data as it comes in.
+	// Filled from sigHandlerIO() or threadRx() and drained by the
+	// application, so it uses the lock-free ring backend, which never
+	// allocates after initialization.
+	struct QueueBuffer *rxqueue;
+
+	// Only one context may fill rxqueue at a time: normally sigHandlerIO()
+	// or threadRx(), or the application when it resumes input after the
+	// buffer was full. Whoever finds rxbusy already set leaves rxpending for
+	// the owner to see.
+	atomic_flag rxbusy;
+	atomic_int  rxpending;
+
+	// Most bytes rxqueue is filled to (UARTOptions.rxhighwater)
+	size_t rxhighwater;
+
+	// Set when rxqueue filled up and data was left waiting in the kernel.
+	// No SIGIO (or new epoll edge) will arrive for it, so the reader resumes
+	// input itself.
+	atomic_int  rxfull;
+
+	// Signalled whenever data is added to rxqueue (see uart_getEventFd)
+	int rxeventfd;
+
+	// Arrival time of each read() batch, in a ring beside rxqueue with the
+	// same single producer and consumer. Positions count bytes since open:
+	// rxtotal is written by the producer, rxtaken by the application.
+	struct RxStamp {
+		uint64_t start, // Position of the first byte of the batch
+		         ns;    // CLOCK_MONOTONIC when it was read
+	}           rxstamps[UART_RXSTAMPS];
+	atomic_uint rxstamphead,
+	            rxstamptail;
+	uint64_t    rxtotal,
+	            rxtaken;
+
+	// Samples for uart_getLatency, recorded by the application's reads
+	// while recordlatency is set
+	int               recordlatency;
+	struct UARTLatency latency;
+
+	// UART_RXTHREAD: receive thread, the epoll instance it waits in, and an
+	// eventfd used to tell it to exit
+	UARTRxMode rxmode;
+	pthread_t  rxthread;
+	int        epollfd,
+	           stopfd;
+
+	// Bytes accepted by uart_write but not yet taken by the device. txlock
+	// is held around every use of txqueue, since threadRx() also flushes it
+	// when the device becomes writable (txwatch set: EPOLLOUT is being
+	// watched).
+	struct QueueBuffer *txqueue;
+	pthread_mutex_t    txlock;
+	int                txbuffered,
+	                   txwatch;
+
+	// UART_RXURING: the ring that reads and writes go through (see
+	// threadRing())
+	struct URing {
+		int fd;
+
+		// The shared submission and completion rings, and the fields of
+		// each that are used
+		void                *ringmap;
+		size_t              ringsize;
+		struct io_uring_sqe *sqes;
+		size_t              sqesize;
+		unsigned            *sqhead, *sqtail, *sqarray, sqmask, sqentries,
+		                    *cqhead, *cqtail, cqmask;
+		struct io_uring_cqe *cqes;
+
+		// Both the application (writes) and threadRing() fill the
+		// submission queue. lock is held around filling it; unsubmitted
+		// counts entries not yet passed to io_uring_enter().
+		pthread_mutex_t lock;
+		unsigned        unsubmitted;
+
+		// Buffers handed to the kernel for reads, and the ring they are
+		// handed over in. buftail is advanced by whoever holds rxbusy.
+		struct io_uring_buf_ring *bufring;
+		uint8_t                  *bufs;
+		uint16_t                 buftail;
+
+		// Reads that completed but are not yet copied into rxqueue, where
+		// they wait while it is full. tail is advanced by threadRing(), head
+		// by whoever holds rxbusy; a buffer goes back to the kernel once it
+		// is copied. ns is when the read's completion was reaped, which is
+		// the arrival time its bytes are stamped with.
+		struct HeldRead {
+			uint16_t bid;
+			uint32_t offset,
+			         len;
+			uint64_t ns;
+		}           held[UART_URINGBUFS];
+		atomic_uint heldhead,
+		            heldtail;
+
+		// Whether reads stay queued across completions, whether one is
+		// queued now, and whether the device has failed (ended) so no more
+		// should be. stop is set by uart_close() before waking the thread.
+		int        multishot;
+		atomic_int armed,
+		           failed,
+		           stop;
+
+		// The write in flight: its length (the head of txqueue), the
+		// regions it covers, and an error it ended with. All under txlock;
+		// txdone is signalled whenever a write completes.
+		size_t         txinflight;
+		struct iovec   txiov[2];
+		int            txerror;
+		pthread_cond_t txdone;
+	} ring;
+
+	// Rate the kernel actually applied (see uart_getBaudRate)
+	int baudrate;
+
+	// Counters for uart_getStats. The rx counters are only written by
+	// whoever holds rxbusy (or threadRing()), the tx counters under txlock,
+	// so each is bumped with addCount(). syscalls is counted from every
+	// context, with a real atomic add.
+	atomic_size_t rxbytes,
+	              rxreads,
+	              rxfullcount,
+	              rxagain,
+	              rxpeak,
+	              txbytes,
+	              txwrites,
+	              txagain,
+	              txshort,
+	              txpeak,
+	              syscalls;
+
+	// Line errors flagged in the PL011's data register (rx counters)
+	atomic_size_t overrun,
+	              parity,
+	              framing,
+	              breaks;
+
+	// The serial driver's counts when the UART was opened, if it keeps any
+	// (hasicount), and when that was
+	struct serial_icounter_struct icount;
+	int                           hasicount;
+	struct timespec               opened;
+
+	// Error handling data
+	int  error;
+	char error_str[UART_ERRSIZE];
+};
+
+// Errors that have no handle to go with (e.g. uart_open failing)
+static int  error = 0;
 static char error_str[UART_ERRSIZE];
 
-static void generateError(const char *str);
+// UART used by the functions without a handle, opened by uart_init
+static struct UART *defaultuart = NULL;
+
+// UARTs in UART_RXSIGNAL mode, all serviced by sigHandlerIO()
+static struct UART *_Atomic signaluarts[UART_MAXSIGNAL];
+
+// Runs of sigHandlerIO() in progress, on any thread. unregisterSignal()
+// waits for this to reach 0 before the handle can be freed.
+static atomic_int signalactive = 0;
 
-// File descriptor to the UART terminal interface
-static int uartfd = -1;
+static void generateError(struct UART *uart, const char *str);
 
-// QueueBuffer as an intermediate place to store data as it comes in.
-static struct QueueBuffer *queuebuffer = 0;
+// Queue len bytes of output, writing to the device to make room when the
+// queue is full. txlock must be held. Returns the number of bytes queued;
+// *result is set to -1 if writing failed.
+static size_t queueOutput(struct UART *uart, const void *buffer, size_t len,
+		int *result);
 
-// Initialized in uart_init
-//   0  = little endian
-//   1  = big endian
-//   -1 = unsupported
-static int hostendian = 0;
+// Write or read count values of size bytes (2 or 4), converting between
+// host and big-endian order on the way
+static int writeArray(struct UART *uart, const void *values, size_t count,
+		size_t size);
+static int readArray(struct UART *uart, void *values, size_t count,
+		size_t size, const char *shortmsg);
 
-// Reverse the byte order of src, storing into dest
-static void swapEndian(const void *src, void *dest, size_t numbytes);
+// Convert count values of size bytes (2 or 4) between host and big-endian
+// order. src and dest may be the same.
+static void swapArray(const void *src, void *dest, size_t count,
+		size_t size);
 
-// SIgnal handler for SIGIO; called by kernel when IO data becomes
-// available.
+// Signal handler for SIGIO; called by kernel when IO data becomes
+// available on any UART in UART_RXSIGNAL mode.
 static void sigHandlerIO(int signumber);
 
+// Add or remove uart from signaluarts, installing sigHandlerIO() first
+static int  registerSignal(struct UART *uart);
+static void unregisterSignal(struct UART *uart);
+
+// Receive thread for UART_RXTHREAD
+static void *threadRx(void *arg);
+
+// Start threadRx with the affinity and priority in options
+static int startRxThread(struct UART *uart,
+		const struct UARTOptions *options);
+
+// Set up attr with the receive thread affinity and priority in options
+static void initThreadAttr(pthread_attr_t *attr,
+		const struct UARTOptions *options);
+
+// UART_RXURING: set up the ring and start threadRing(). Returns 1 on
+// success, 0 if io_uring is unavailable (so UART_RXTHREAD should be used
+// instead), or -1 on error.
+static int startRing(struct UART *uart, const struct UARTOptions *options);
+
+// Close and unmap the ring, leaving it as if never set up
+static void closeRing(struct URing *ring);
+
+#if UART_HAVEURING
+// UART_RXURING receive thread: submit, wait for completions and act on
+// them in batches until uart_close() wakes it with ring.stop set.
+// Completions are not left for the application to collect in
+// uart_readTimeout(): write completions must be taken for uart_flush()
+// to return, and read buffers handed back, while it is not reading. The
+// application sleeps on rxeventfd (readers) and ring.txdone (uart_flush),
+// and this thread is what signals them. It replaces the epoll thread; it
+// is not one more.
+static void *threadRing(void *arg);
+
+// Fill the next submission queue entry from sqe. ring.lock must not be
+// held. Returns 1 on success, 0 if the queue is full.
+static int queueEntry(struct UART *uart, const struct io_uring_sqe *sqe);
+
+// Pass queued entries to the kernel, waiting for at least one completion
+// if wait is set. Returns the result of io_uring_enter().
+static int enterRing(struct UART *uart, int wait);
+
+// Queue a read of the device into the provided buffers, or a poll of
+// stopfd for uart_close() and drainHeld() to wake threadRing() with
+static void queueRead(struct UART *uart);
+static void queueWake(struct UART *uart);
+
+// Act on a write completion. txlock must be held.
+static void completeWrite(struct UART *uart, int result);
+#endif
+
+// Queue a write of everything in txqueue unless one is in flight already.
+// txlock must be held. Returns 0, or -1 if the last write failed.
+static int queueWrite(struct UART *uart);
+
+// Copy completed reads into rxqueue and return their buffers to the
+// kernel. rxbusy must be held. Returns 1 if anything was added.
+static int drainHeld(struct UART *uart);
+
+// Read from the device into rxqueue until the kernel has nothing more or
+// the queue is full. rxbusy must be held. Returns 1 if anything was added.
+static int readDevice(struct UART *uart);
+
+// Find room in rxqueue for more input, up to the high watermark. If there
+// is none, set rxfull and return 0. rxbusy must be held.
+static int reserveInput(struct UART *uart, void **space, size_t *len);
+
+// UART_BACKENDPL011: map the registers (unless options supplies access to
+// them), configure the PL011 and start the polling thread
+static int openRegisters(struct UART *uart, const char *path, int baudrate,
+		UARTParity parity, const struct UARTOptions *options);
+
+// UART_BACKENDPL011 receive thread: poll the FIFOs until pollstop is set
+static void *threadPoll(void *arg);
+
+// Move bytes from the receive FIFO to buffer, or from iov to the transmit
+// FIFO, until it is empty or full. Return the number of bytes moved.
+static int readRegisters(struct UART *uart, void *buffer, size_t len);
+static int writeRegisters(struct UART *uart, const struct iovec *iov,
+		int count);
+
+// Built-in register access: the /dev/mem mapping
+static uint32_t readMapped(void *context, uint32_t offset);
+static void     writeMapped(void *context, uint32_t offset, uint32_t value);
+
+// Close everything opened for uart and free it
+static void releaseResources(struct UART *uart);
+
+// Move all available data from the device into rxqueue
+static void drainInput(struct UART *uart);
+
+// Get the B* constant for baudrate, or B0 if it has none
+static speed_t standardSpeed(int baudrate);
+
+// Set a rate with no B* constant through termios2 (if custom), and read
+// back the rate the kernel applied into uart->baudrate
+static int applyBaudRate(struct UART *uart, int baudrate, int custom);
+
+// Pop from rxqueue, resuming input if it had been full
+static int popInput(struct UART *uart, void *buffer, size_t len);
+
+// Read more input after the application has made room in a full rxqueue
+static void resumeInput(struct UART *uart);
+
+// Sleep on rxeventfd until more input is queued or deadline (CLOCK_MONOTONIC,
+// NULL for none) passes. Returns 1 if woken by input, 0 on timeout, -1 on
+// error.
+static int waitInput(struct UART *uart, const struct timespec *deadline);
+
+// Set deadline to timeout milliseconds from now; NULL if timeout is -1
+static struct timespec *makeDeadline(struct timespec *deadline, int timeout);
+
+// Record that the next batch of input arrived now, or at ns
+// (CLOCK_MONOTONIC) for input that was held before being queued. Called by
+// the producer before the batch is committed to rxqueue.
+static void stampInput(struct UART *uart);
+static void stampInputAt(struct UART *uart, uint64_t ns);
+
+// CLOCK_MONOTONIC in nanoseconds
+static uint64_t monotonicNs();
+
+// Drop timestamps of input that has already been read
+static void dropStamps(struct UART *uart);
+
+// Input is about to be taken from rxqueue: add a latency sample for it
+static void sampleLatency(struct UART *uart);
+
+// Get the arrival time of the next byte in rxqueue, which must not be empty
+static void arrivalTime(struct UART *uart, struct timespec *arrival);
+
+// Add n to a counter with a single writer at a time, or raise a peak to
+// value. A relaxed load and store, which unlike an atomic add costs no
+// more than a plain increment.
+static void addCount(atomic_size_t *counter, size_t n);
+static void notePeak(atomic_size_t *peak, size_t value);
+
+// Write as much of txqueue as the device will take without blocking.
+// txlock must be held. Returns the number of bytes written, or -1 on error.
+static int flushOutput(struct UART *uart);
+
+// UART_RXTHREAD: have threadRx() wake up when the device is writable
+// while output is left in txqueue. txlock must be held.
+static void watchOutput(struct UART *uart, int watch);
+
+/*
+	Default UART
+*/
+
 int uart_init(int baudrate, UARTParity parity) {
-	// Establish endianness of the running system
-	uint32_t test;
-	char *set = (char *)&test;
-	set[0] = 0x11;
-	set[1] = 0x22;
-	set[2] = 0x33;
-	set[3] = 0x44;
-
-	if (test == 0x11223344)
-		hostendian = 1;  // Big-endian
-	else if (test == 0x44332211)
-		hostendian = 0;  // Little-endian
-	else
-		hostendian = -1; // Unsupported
-
-	// Convert to speed_t / validate provided baudrate
-	speed_t baud;
-	switch (baudrate) {
-		case 1200:
-			baud = B1200;
-			break;
-		case 1800:
-			baud = B1800;
-			break;
-		case 2400:
-			baud = B2400;
-			break;
-		case 4800:
-			baud = B4800;
-			break;
-		case 9600:
-			baud = B9600;
-			break;
-		case 19200:
-			baud = B19200;
-			break;
-		case 38400:
-			baud = B38400;
-			break;
-		case 57600:
-			baud = B57600;
-			break;
-		case 115200:
-			baud = B115200;
-			break;
-		case 230400:
-			baud = B230400;
-			break;
+	return uart_initWithOptions("/dev/ttyAMA0", baudrate, parity, NULL);
+}
+
+int openRegisters(struct UART *uart, const char *path, int baudrate,
+		UARTParity parity, const struct UARTOptions *options) {
+	// Divisor of the reference clock for the 16x sample rate, in 64ths
+	// (IBRD holds the whole part, FBRD the fraction)
+	uint32_t divisor = ((uint64_t)UART_PL011CLOCK * 4 + baudrate / 2) /
+			baudrate;
+	if (divisor < 64 || divisor >= (65536 << 6)) {
+		generateError(uart, "Unsupported baud rate requested");
+		return 0;
+	}
+
+	if (options->regops) {
+		uart->regops = *options->regops;
+	} else {
+		int memfd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+		if (memfd == -1) {
+			generateError(uart, "Couldn't open memory device");
+			return 0;
+		}
 
-		default:
-			generateError("Unsupported baud rate requested");
+		void *map = mmap(NULL, UART_PL011BLOCK, PROT_READ | PROT_WRITE,
+				MAP_SHARED, memfd, UART_PL011BASE);
+		close(memfd);
+		if (map == MAP_FAILED) {
+			generateError(uart, "Couldn't create mapping to UART_PL011BASE");
 			return 0;
+		}
+
+		uart->regmap = map;
+		uart->regops.read = readMapped;
+		uart->regops.write = writeMapped;
+		uart->regops.context = map;
 	}
 
-	uartfd = open("/dev/ttyAMA0", O_RDWR | O_NOCTTY | O_NONBLOCK);
-	if (uartfd == -1) {
-		generateError("Could not open /dev/ttyAMA0");
-		return 0;
+	struct UARTRegisterOps *regs = &uart->regops;
+	int i;
+
+	// Disable the UART before changing settings, letting the character
+	// being sent finish; clearing FEN then empties the FIFOs
+	regs->write(regs->context, UART_REGCR, 0);
+	for (i = 0; i < 100000; ++i)
+		if (!(regs->read(regs->context, UART_REGFR) & UART_FRBUSY))
+			break;
+	regs->write(regs->context, UART_REGLCRH, 0);
+
+	// Polled, so no interrupts
+	regs->write(regs->context, UART_REGIMSC, 0);
+	regs->write(regs->context, UART_REGICR, 0x7FF);
+
+	// The divisors only take effect with the write to LCRH that follows
+	regs->write(regs->context, UART_REGIBRD, divisor >> 6);
+	regs->write(regs->context, UART_REGFBRD, divisor & 0x3F);
+
+	uint32_t lcrh = UART_LCRHFEN | UART_LCRHWL8;
+	if (parity != UART_PARDISABLE) {
+		lcrh |= UART_LCRHPEN;
+		if (parity == UART_PAREVEN)
+			lcrh |= UART_LCRHEPS;
 	}
+	regs->write(regs->context, UART_REGLCRH, lcrh);
 
-	struct sigaction sa;
-	sa.sa_handler = sigHandlerIO;
-	sa.sa_flags = 0;
-	sa.sa_restorer = NULL;
-	sigaction(SIGIO, &sa, NULL);
+	// With RTS/CTS, the UART handshakes by itself: RTS drops as the receive
+	// FIFO fills, which it does once the input queue reaches its watermark
+	uint32_t cr = UART_CRUARTEN | UART_CRTXE | UART_CRRXE;
+	if (options->flowcontrol == UART_FLOWRTSCTS)
+		cr |= UART_CRRTSEN | UART_CRCTSEN;
+	regs->write(regs->context, UART_REGCR, cr);
 
-	fcntl(uartfd, F_SETOWN, getpid());
-	fcntl(uartfd, F_SETFL, O_ASYNC);
+	uart->baudrate = (uint64_t)UART_PL011CLOCK * 4 / divisor;
 
-	// Set terminal properties for /dev/ttyAMA0
-	struct termios tprops;
+	// A quarter of the time the receive FIFO takes to fill, at 10 bits a
+	// byte: long enough to give the CPU back, short enough not to overrun
+	uart->pollnap = UART_PL011FIFO * 10 * 1000000000LL / 4 / uart->baudrate;
 
-	tprops.c_iflag = 0;
-	if (parity != UART_PARDISABLE)
-		tprops.c_iflag = INPCK;
+	pthread_attr_t attr;
+	initThreadAttr(&attr, options);
 
-	tprops.c_oflag = 0;
+	int result = pthread_create(&uart->rxthread, &attr, threadPoll, uart);
+	pthread_attr_destroy(&attr);
 
-	tprops.c_cflag = CS8 | CREAD;
-	if (parity != UART_PARDISABLE) {
-		tprops.c_cflag |= PARENB;
-		if (parity == UART_PARODD)
-			tprops.c_cflag |= PARODD;
+	if (result != 0) {
+		regs->write(regs->context, UART_REGCR, 0);
+		generateError(uart, "Could not start receive thread (check rxcpu and "
+				"rxpriority permissions)");
+		return 0;
 	}
 
-	tprops.c_lflag = 0;
+	return 1;
+}
 
-	// Disable control characters
-	int cc;
-	for (cc = 0; cc < NCCS; ++cc)
-		tprops.c_cc[cc] = _POSIX_VDISABLE;
+void *threadPoll(void *arg) {
+	struct UART *uart = (struct UART *)arg;
+	size_t before;
+	int    empty = 0;
 
-	tprops.c_cc[VMIN] = 0;  // No minimum number of characters for reads
-	tprops.c_cc[VTIME] = 0; // No timeout (0 deciseconds)
+	while (!atomic_load_explicit(&uart->pollstop, memory_order_relaxed)) {
+		before = atomic_load_explicit(&uart->rxbytes, memory_order_relaxed);
+		drainInput(uart);
 
-	// Baud rate
-	cfsetospeed(&tprops, baud);
-	cfsetispeed(&tprops, baud);
+		// The application may be flushing already; it will finish the job
+		if (pthread_mutex_trylock(&uart->txlock) == 0) {
+			if (qb_getSize(uart->txqueue) > 0)
+				flushOutput(uart);
+			pthread_mutex_unlock(&uart->txlock);
+		}
 
-	// Set the attributes
-	tcsetattr(uartfd, TCSAFLUSH, &tprops);
+		// Once the FIFO has stayed empty a while, nap; or when spinning,
+		// at least let anything else waiting for this CPU have it
+		if (atomic_load_explicit(&uart->rxbytes, memory_order_relaxed) !=
+				before) {
+			empty = 0;
+		} else if (++empty >= UART_POLLSPINS) {
+			if (atomic_load_explicit(&uart->pollspin, memory_order_relaxed)) {
+				sched_yield();
+			} else {
+				struct timespec nap = { 0, uart->pollnap };
+				nanosleep(&nap, NULL);
+			}
+		}
+	}
 
-	tcflow(uartfd, TCOON | TCION); // Restart input and output
-	tcflush(uartfd, TCIOFLUSH);    // Flush buffer for clean start
+	return NULL;
+}
 
-	qb_initialize(&queuebuffer);
+int readRegisters(struct UART *uart, void *buffer, size_t len) {
+	struct UARTRegisterOps *regs = &uart->regops;
+	uint8_t *bytes = (uint8_t *)buffer;
+	size_t  count = 0;
 
-	return 1;
+	// Bits 8-11 of DR flag a framing, parity, break or overrun error on
+	// that byte; they are counted, and the byte is passed on regardless
+	while (count < len &&
+			!(regs->read(regs->context, UART_REGFR) & UART_FRRXFE)) {
+		uint32_t data = regs->read(regs->context, UART_REGDR);
+		if (data & (UART_DRFE | UART_DRPE | UART_DRBE | UART_DROE)) {
+			if (data & UART_DROE)
+				addCount(&uart->overrun, 1);
+			if (data & UART_DRPE)
+				addCount(&uart->parity, 1);
+			if (data & UART_DRFE)
+				addCount(&uart->framing, 1);
+			if (data & UART_DRBE)
+				addCount(&uart->breaks, 1);
+		}
+		bytes[count++] = data & 0xFF;
+	}
+
+	return count;
 }
 
-int uart_deinit() {
-	if (close(uartfd) != 0) {
-		generateError("Could not close /dev/ttyAMA0");
-		return 0;
+int writeRegisters(struct UART *uart, const struct iovec *iov, int count) {
+	struct UARTRegisterOps *regs = &uart->regops;
+	int    written = 0, i;
+	size_t k;
+
+	for (i = 0; i < count; ++i) {
+		const uint8_t *bytes = (const uint8_t *)iov[i].iov_base;
+		for (k = 0; k < iov[i].iov_len; ++k) {
+			if (regs->read(regs->context, UART_REGFR) & UART_FRTXFF)
+				return written;
+			regs->write(regs->context, UART_REGDR, bytes[k]);
+			++written;
+		}
 	}
 
-	qb_free(&queuebuffer);
+	return written;
+}
 
-	return 1;
+uint32_t readMapped(void *context, uint32_t offset) {
+	return *(volatile uint32_t *)((uint8_t *)context + offset);
 }
 
-int uart_write(const void *buffer, size_t len) {
-	if (uartfd == -1) {
-		generateError("UART has not been initialized");
+void writeMapped(void *context, uint32_t offset, uint32_t value) {
+	*(volatile uint32_t *)((uint8_t *)context + offset) = value;
+}
+
+void uart_defaultOptions(struct UARTOptions *options) {
+	memset(options, 0, sizeof(struct UARTOptions));
+	options->backend = UART_BACKENDTTY;
+	options->regops = NULL;
+	options->rxmode = UART_RXSIGNAL;
+	options->rxcpu = -1;
+	options->flowcontrol = UART_FLOWNONE;
+}
+
+int uart_initWithOptions(const char *device, int baudrate, UARTParity parity,
+		const struct UARTOptions *options) {
+	if (defaultuart) {
+		generateError(NULL, "UART is already initialized");
 		return 0;
 	}
 
-	write(uartfd, buffer, len);
-	return 1;
+	defaultuart = uart_openWithOptions(device, baudrate, parity, options);
+	return defaultuart != NULL;
+}
+
+int uart_deinit() {
+	if (!defaultuart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	int result = uart_close(defaultuart);
+	defaultuart = NULL;
+	return result;
+}
+
+int uart_write(const void *buffer, size_t len) {
+	return uart_hwrite(defaultuart, buffer, len);
 }
 
 int uart_writeChar(char c) {
-	return uart_write(&c, 1);
+	return uart_hwriteChar(defaultuart, c);
 }
 
 int uart_writeUBE16(uint16_t i) {
-	if (hostendian == 1)
-		return uart_write(&i, 2);
-	else if (hostendian == 0) {
-		uint16_t swapped;
-		swapEndian(&i, &swapped, 2);
-		return uart_write(&swapped, 2);
-	} else {
-		generateError("System endianness is not supported. Use uart_write()");
-		return 0;
-	}
+	return uart_hwriteUBE16(defaultuart, i);
 }
 
 int uart_writeUBE32(uint32_t i) {
-	if (hostendian == 1)
-		return uart_write(&i, 4);
-	else if (hostendian == 0) {
-		uint16_t swapped;
-		swapEndian(&i, &swapped, 4);
-		return uart_write(&swapped, 4);
-	} else {
-		generateError("System endianness is not supported. Use uart_write()");
-		return 0;
-	}
+	return uart_hwriteUBE32(defaultuart, i);
 }
 
 int uart_read(void *buffer, size_t len) {
-	if (uartfd == -1) {
-		generateError("UART has not been initialized");
-		return 0;
-	}
+	return uart_hread(defaultuart, buffer, len);
+}
+
+int uart_readTimestamped(void *buffer, size_t len, struct timespec *arrival) {
+	return uart_hreadTimestamped(defaultuart, buffer, len, arrival);
+}
+
+int uart_readTimeout(void *buffer, size_t len, size_t minbytes, int timeout) {
+	return uart_hreadTimeout(defaultuart, buffer, len, minbytes, timeout);
+}
 
-	return qb_pop(queuebuffer, buffer, len);
+int uart_waitReadable(size_t minbytes, int timeout) {
+	return uart_hwaitReadable(defaultuart, minbytes, timeout);
 }
 
 int uart_readChar(char *c) {
-	// qb_pop() will return 1 if there is a byte, or 0 if there are no bytes
-	return uart_read(c, 1);
+	return uart_hreadChar(defaultuart, c);
 }
 
 int uart_readUBE16(uint16_t *i) {
-	if (uartfd == -1) {
-		generateError("UART has not been initialized");
-		return 0;
-	}
-
-	if (qb_getSize(queuebuffer) >= 2) {
-		if (hostendian == 1) {
-			qb_pop(queuebuffer, i, 2);
-			return 1;
-		}
-		else if (hostendian == 0) {
-			uint16_t be;
-			qb_pop(queuebuffer, &be, 2);
-			swapEndian(&be, i, 2);
-			return 1;
-		} else {
-			generateError("System endianness is not supported. Use uart_write()");
-			return 0;
-		}
-	} else {
-		generateError("Not enough data in queue to read 16-bit integer");
-		return 0;
-	}
+	return uart_hreadUBE16(defaultuart, i);
 }
 
 int uart_readUBE32(uint32_t *i) {
-	if (uartfd == -1) {
-		generateError("UART has not been initialized");
-		return 0;
-	}
+	return uart_hreadUBE32(defaultuart, i);
+}
 
-	if (qb_getSize(queuebuffer) >= 4) {
-		if (hostendian == 1) {
-			qb_pop(queuebuffer, i, 4);
-			return 1;
-		}
-		else if (hostendian == 0) {
-			uint32_t be;
-			qb_pop(queuebuffer, &be, 4);
-			swapEndian(&be, i, 4);
-			return 1;
-		} else {
-			generateError("System endianness is not supported. Use uart_write()");
-			return 0;
-		}
-	} else {
-		generateError("Not enough data in queue to read 32-bit integer");
-		return 0;
-	}
+int uart_writeBE16Array(const uint16_t *values, size_t count) {
+	return uart_hwriteBE16Array(defaultuart, values, count);
+}
+
+int uart_writeBE32Array(const uint32_t *values, size_t count) {
+	return uart_hwriteBE32Array(defaultuart, values, count);
+}
+
+int uart_writeBEFloatArray(const float *values, size_t count) {
+	return uart_hwriteBEFloatArray(defaultuart, values, count);
+}
+
+int uart_readBE16Array(uint16_t *values, size_t count) {
+	return uart_hreadBE16Array(defaultuart, values, count);
+}
+
+int uart_readBE32Array(uint32_t *values, size_t count) {
+	return uart_hreadBE32Array(defaultuart, values, count);
+}
+
+int uart_readBEFloatArray(float *values, size_t count) {
+	return uart_hreadBEFloatArray(defaultuart, values, count);
+}
+
+int uart_peek(struct iovec *iov, int iovcnt) {
+	return uart_hpeek(defaultuart, iov, iovcnt);
+}
+
+size_t uart_consume(size_t len) {
+	return uart_hconsume(defaultuart, len);
+}
+
+int uart_flush(int timeout) {
+	return uart_hflush(defaultuart, timeout);
 }
 
 int uart_getInputQueueSize() {
-	if (!queuebuffer) {
-		generateError("UART has not been initialized");
-		return -1;
-	}
+	return uart_hgetInputQueueSize(defaultuart);
+}
 
-	return qb_getSize(queuebuffer);
+int uart_getOutputQueueSize() {
+	return uart_hgetOutputQueueSize(defaultuart);
 }
 
-char *uart_getLastError() {
-	if (error) {
-		error = 0;
-		return error_str;
-	} else
-		return "No error";
+int uart_getBaudRate() {
+	return uart_hgetBaudRate(defaultuart);
 }
 
-void sigHandlerIO(int signumber) {
-	if (queuebuffer) {
-		char buffer[64];
-		int bytes;
-		while ((bytes = read(uartfd, buffer, 64)) > 0)
-			qb_push(queuebuffer, buffer, bytes);
-	}
+int uart_getEventFd() {
+	return uart_hgetEventFd(defaultuart);
 }
 
-void generateError(const char *str) {
-	error = 1;
-	strncpy(error_str, str, UART_ERRSIZE);
+int uart_getStats(struct UARTStats *stats) {
+	return uart_hgetStats(defaultuart, stats);
 }
 
-void swapEndian(const void *src, void *dest, size_t numbytes) {
-	char   *swapped = (char *)dest,
-	       *srcbyte = (char *)src;
-	size_t i;
+int uart_getRxMode() {
+	return uart_hgetRxMode(defaultuart);
+}
+
+int uart_setLowLatency(int enable) {
+	return uart_hsetLowLatency(defaultuart, enable);
+}
 
-	for (i = 0; i < numbytes; ++i)
-		swapped[i] = srcbyte[numbytes - i - 1];
+int uart_getLowLatency() {
+	return uart_hgetLowLatency(defaultuart);
 }
 
+int uart_recordLatency(int enable) {
+	return uart_hrecordLatency(defaultuart, enable);
+}
+
+int uart_getLatency(struct UARTLatency *latency) {
+	return uart_hgetLatency(defaultuart, latency);
+}
+
+char *uart_getLastError() {
+	if (defaultuart && defaultuart->error)
+		return uart_hgetLastError(defaultuart);
+
+	return uart_hgetLastError(NULL);
+}
+
+/*
+	Handle API
+*/
+
+struct UART *uart_open(const char *path, int baudrate, UARTParity parity) {
+	return uart_openWithOptions(path, baudrate, parity, NULL);
+}
+
+struct UART *uart_openWithOptions(const char *path, int baudrate,
+		UARTParity parity, const struct UARTOptions *options) {
+	// Convert to speed_t / validate provided baudrate. Rates without a B*
+	// constant are set afterwards through termios2.
+	if (baudrate <= 0) {
+		generateError(NULL, "Unsupported baud rate requested");
+		return NULL;
+	}
+	speed_t baud = standardSpeed(baudrate);
+
+	UARTRxMode rxmode = options ? options->rxmode : UART_RXSIGNAL;
+	if (rxmode != UART_RXSIGNAL && rxmode != UART_RXTHREAD &&
+			rxmode != UART_RXURING) {
+		generateError(NULL, "Unsupported receive mode requested");
+		return NULL;
+	}
+
+	UARTBackend backend = options ? options->backend : UART_BACKENDTTY;
+	if (backend != UART_BACKENDTTY && backend != UART_BACKENDPL011) {
+		generateError(NULL, "Unsupported backend requested");
+		return NULL;
+	}
+	if (backend == UART_BACKENDPL011)
+		rxmode = UART_RXTHREAD;
+
+	UARTFlowControl flowcontrol = options ? options->flowcontrol :
+			UART_FLOWNONE;
+	if (flowcontrol != UART_FLOWNONE && flowcontrol != UART_FLOWRTSCTS &&
+			(flowcontrol != UART_FLOWXONXOFF || backend == UART_BACKENDPL011)) {
+		generateError(NULL, "Unsupported flow control requested");
+		return NULL;
+	}
+
+	size_t rxhighwater = options ? options->rxhighwater : 0;
+	if (rxhighwater > UART_RXBUFSIZE) {
+		generateError(NULL, "High watermark is beyond the input queue");
+		return NULL;
+	}
+
+	struct UART *uart = malloc(sizeof(struct UART));
+	if (!uart) {
+		generateError(NULL, "Could not allocate UART");
+		return NULL;
+	}
+	memset(uart, 0, sizeof(struct UART));
+	atomic_flag_clear(&uart->rxbusy);
+	pthread_mutex_init(&uart->txlock, NULL);
+	pthread_mutex_init(&uart->ring.lock, NULL);
+	uart->fd = uart->rxeventfd = uart->epollfd = uart->stopfd = -1;
+	uart->ring.fd = -1;
+
+	// Timed waits for ring writes measure against the same clock as
+	// makeDeadline()
+	pthread_condattr_t condattr;
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&uart->ring.txdone, &condattr);
+	pthread_condattr_destroy(&condattr);
+	uart->rxmode = rxmode;
+	uart->backend = backend;
+	uart->txbuffered = options ? options->txbuffered : 0;
+	uart->rxhighwater = rxhighwater > 0 ? rxhighwater : UART_RXBUFSIZE;
+	clock_gettime(CLOCK_MONOTONIC, &uart->opened);
+
+	// The queue must exist before SIGIO can be delivered
+	struct QueueBufferConfig qbconfig;
+	qbconfig.backend = QB_BACKEND_RING;
+	qbconfig.capacity = UART_RXBUFSIZE;
+	qbconfig.overflow = QB_OVERFLOW_DROP_NEWEST;
+	qbconfig.reserve = 0;
+	if (!qb_initializeWithConfig(&uart->rxqueue, &qbconfig)) {
+		releaseResources(uart);
+		generateError(NULL, "Could not allocate receive buffer");
+		return NULL;
+	}
+
+	qbconfig.capacity = UART_TXBUFSIZE;
+	if (!qb_initializeWithConfig(&uart->txqueue, &qbconfig)) {
+		releaseResources(uart);
+		generateError(NULL, "Could not allocate transmit buffer");
+		return NULL;
+	}
+
+	uart->rxeventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (uart->rxeventfd == -1) {
+		releaseResources(uart);
+		generateError(NULL, "Could not create receive event descriptor");
+		return NULL;
+	}
+
+	if (backend == UART_BACKENDPL011) {
+		if (!openRegisters(uart, path, baudrate, parity, options)) {
+			generateError(NULL, uart->error_str);
+			releaseResources(uart);
+			return NULL;
+		}
+		return uart;
+	}
+
+	uart->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (uart->fd == -1) {
+		releaseResources(uart);
+		generateError(NULL, "Could not open serial device");
+		return NULL;
+	}
+
+	// Set terminal properties for the device
+	struct termios tprops;
+
+	tprops.c_iflag = 0;
+	if (parity != UART_PARDISABLE)
+		tprops.c_iflag = INPCK;
+	if (flowcontrol == UART_FLOWXONXOFF)
+		tprops.c_iflag |= IXON | IXOFF;
+
+	tprops.c_oflag = 0;
+
+	tprops.c_cflag = CS8 | CREAD;
+	if (flowcontrol == UART_FLOWRTSCTS)
+		tprops.c_cflag |= CRTSCTS;
+	if (parity != UART_PARDISABLE) {
+		tprops.c_cflag |= PARENB;
+		if (parity == UART_PARODD)
+			tprops.c_cflag |= PARODD;
+	}
+
+	tprops.c_lflag = 0;
+
+	// Disable control characters
+	int cc;
+	for (cc = 0; cc < NCCS; ++cc)
+		tprops.c_cc[cc] = _POSIX_VDISABLE;
+
+	tprops.c_cc[VMIN] = 0;  // No minimum number of characters for reads
+	tprops.c_cc[VTIME] = 0; // No timeout (0 deciseconds)
+
+	if (flowcontrol == UART_FLOWXONXOFF) {
+		tprops.c_cc[VSTART] = 0x11;
+		tprops.c_cc[VSTOP] = 0x13;
+	}
+
+	// Baud rate (any B* value will do as a placeholder for a custom rate)
+	cfsetospeed(&tprops, baud != B0 ? baud : B38400);
+	cfsetispeed(&tprops, baud != B0 ? baud : B38400);
+
+	// Set the attributes
+	tcsetattr(uart->fd, TCSAFLUSH, &tprops);
+
+	if (!applyBaudRate(uart, baudrate, baud == B0)) {
+		generateError(NULL, uart->error_str);
+		releaseResources(uart);
+		return NULL;
+	}
+
+	tcflow(uart->fd, TCOON | TCION); // Restart input and output
+	tcflush(uart->fd, TCIOFLUSH);    // Flush buffer for clean start
+
+	// The driver's error counts run from boot; uart_getStats() reports
+	// them from here
+	uart->hasicount = ioctl(uart->fd, TIOCGICOUNT, &uart->icount) == 0;
+
+	// Start receiving only once the terminal is set up. Without io_uring,
+	// the epoll thread does the same job.
+	int started;
+	if (rxmode == UART_RXURING) {
+		started = startRing(uart, options);
+		if (started == 0) {
+			closeRing(&uart->ring);
+			uart->rxmode = UART_RXTHREAD;
+			started = startRxThread(uart, options);
+		}
+		started = started == 1;
+	} else if (rxmode == UART_RXTHREAD) {
+		started = startRxThread(uart, options);
+	} else {
+		started = registerSignal(uart);
+	}
+	if (!started) {
+		// Keep the reason, which is stored on the handle about to be freed
+		generateError(NULL, uart->error_str);
+		releaseResources(uart);
+		return NULL;
+	}
+
+	return uart;
+}
+
+int uart_close(struct UART *uart) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	// Give queued output a chance to go out; whatever is left is lost
+	int flushed = uart_hflush(uart, UART_CLOSETIMEOUT) == 0;
+
+	int closed = 1;
+	if (uart->backend == UART_BACKENDPL011) {
+		atomic_store(&uart->pollstop, 1);
+		pthread_join(uart->rxthread, NULL);
+		uart->regops.write(uart->regops.context, UART_REGCR, 0);
+	} else {
+		if (uart->rxmode != UART_RXSIGNAL) {
+			uint64_t one = 1;
+			atomic_store(&uart->ring.stop, 1);
+			write(uart->stopfd, &one, sizeof(one));
+			pthread_join(uart->rxthread, NULL);
+		} else {
+			unregisterSignal(uart);
+		}
+
+		closed = close(uart->fd) == 0;
+		uart->fd = -1;
+	}
+	releaseResources(uart);
+
+	if (!closed) {
+		generateError(NULL, "Could not close serial device");
+		return 0;
+	}
+	if (!flushed) {
+		generateError(NULL, "Output still queued was discarded");
+		return 0;
+	}
+
+	return 1;
+}
+
+int uart_hwrite(struct UART *uart, const void *buffer, size_t len) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	int result = 0;
+
+	pthread_mutex_lock(&uart->txlock);
+	size_t accepted = queueOutput(uart, buffer, len, &result);
+	if (!uart->txbuffered && result != -1)
+		result = flushOutput(uart);
+	pthread_mutex_unlock(&uart->txlock);
+
+	if (accepted < len && result != -1)
+		generateError(uart, "Output queue is full");
+
+	return accepted;
+}
+
+int uart_hwriteChar(struct UART *uart, char c) {
+	return uart_hwrite(uart, &c, 1);
+}
+
+int uart_hwriteUBE16(struct UART *uart, uint16_t i) {
+	return writeArray(uart, &i, 1, 2);
+}
+
+int uart_hwriteUBE32(struct UART *uart, uint32_t i) {
+	return writeArray(uart, &i, 1, 4);
+}
+
+int uart_hwriteBE16Array(struct UART *uart, const uint16_t *values,
+		size_t count) {
+	return writeArray(uart, values, count, 2);
+}
+
+int uart_hwriteBE32Array(struct UART *uart, const uint32_t *values,
+		size_t count) {
+	return writeArray(uart, values, count, 4);
+}
+
+int uart_hwriteBEFloatArray(struct UART *uart, const float *values,
+		size_t count) {
+	return writeArray(uart, values, count, 4);
+}
+
+int uart_hread(struct UART *uart, void *buffer, size_t len) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	return popInput(uart, buffer, len);
+}
+
+int uart_hreadTimestamped(struct UART *uart, void *buffer, size_t len,
+		struct timespec *arrival) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+	if (!arrival) {
+		generateError(uart, "No timespec given for the arrival time");
+		return 0;
+	}
+
+	// Once the first byte is queued, its timestamp is too
+	if (len == 0 || qb_getSize(uart->rxqueue) == 0) {
+		arrival->tv_sec = arrival->tv_nsec = 0;
+		return 0;
+	}
+
+	arrivalTime(uart, arrival);
+	return popInput(uart, buffer, len);
+}
+
+int uart_hreadTimeout(struct UART *uart, void *buffer, size_t len,
+		size_t minbytes, int timeout) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	struct timespec deadlinebuf,
+	                *deadline = makeDeadline(&deadlinebuf, timeout);
+	char   *bytes = (char *)buffer;
+	size_t got = 0;
+	int    woken;
+
+	if (minbytes > len)
+		minbytes = len;
+
+	// Take what is there as it comes, so a request larger than the queue
+	// can still complete
+	for (;;) {
+		got += popInput(uart, bytes + got, len - got);
+		if (got >= minbytes)
+			return got;
+
+		woken = timeout == 0 ? 0 : waitInput(uart, deadline);
+		if (woken == -1)
+			return -1;
+		if (woken == 0) {
+			// One last look: input may have come in with the deadline
+			got += popInput(uart, bytes + got, len - got);
+			return got;
+		}
+	}
+}
+
+int uart_hwaitReadable(struct UART *uart, size_t minbytes, int timeout) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+	if (minbytes > uart->rxhighwater) {
+		generateError(uart, "Waiting for more than the input queue can hold");
+		return -1;
+	}
+
+	struct timespec deadlinebuf,
+	                *deadline = makeDeadline(&deadlinebuf, timeout);
+	int size, woken;
+
+	if (minbytes == 0)
+		minbytes = 1;
+
+	for (;;) {
+		size = qb_getSize(uart->rxqueue);
+		if ((size_t)size >= minbytes)
+			return size;
+		if (timeout == 0)
+			return 0;
+
+		woken = waitInput(uart, deadline);
+		if (woken != 1)
+			return woken;
+	}
+}
+
+int uart_hreadChar(struct UART *uart, char *c) {
+	// qb_pop() will return 1 if there is a byte, or 0 if there are no bytes
+	return uart_hread(uart, c, 1);
+}
+
+int uart_hreadUBE16(struct UART *uart, uint16_t *i) {
+	return readArray(uart, i, 1, 2,
+			"Not enough data in queue to read 16-bit integer");
+}
+
+int uart_hreadUBE32(struct UART *uart, uint32_t *i) {
+	return readArray(uart, i, 1, 4,
+			"Not enough data in queue to read 32-bit integer");
+}
+
+int uart_hreadBE16Array(struct UART *uart, uint16_t *values, size_t count) {
+	return readArray(uart, values, count, 2,
+			"Not enough data in queue to read 16-bit array");
+}
+
+int uart_hreadBE32Array(struct UART *uart, uint32_t *values, size_t count) {
+	return readArray(uart, values, count, 4,
+			"Not enough data in queue to read 32-bit array");
+}
+
+int uart_hreadBEFloatArray(struct UART *uart, float *values, size_t count) {
+	return readArray(uart, values, count, 4,
+			"Not enough data in queue to read float array");
+}
+
+int uart_hpeek(struct UART *uart, struct iovec *iov, int iovcnt) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	return qb_peek(uart->rxqueue, iov, iovcnt);
+}
+
+size_t uart_hconsume(struct UART *uart, size_t len) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	if (uart->recordlatency && len > 0 && qb_getSize(uart->rxqueue) > 0)
+		sampleLatency(uart);
+
+	size_t bytes = qb_consume(uart->rxqueue, len);
+	if (bytes > 0) {
+		uart->rxtaken += bytes;
+		dropStamps(uart);
+		resumeInput(uart);
+	}
+
+	return bytes;
+}
+
+int uart_hflush(struct UART *uart, int timeout) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	struct timespec start, current;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int remaining, result, wait = timeout;
+	for (;;) {
+		pthread_mutex_lock(&uart->txlock);
+		result = flushOutput(uart);
+		remaining = qb_getSize(uart->txqueue);
+		pthread_mutex_unlock(&uart->txlock);
+
+		if (result == -1)
+			return -1;
+		if (remaining == 0 || timeout == 0)
+			return remaining;
+
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &current);
+			wait = timeout - (int)((current.tv_sec - start.tv_sec) * 1000 +
+					(current.tv_nsec - start.tv_nsec) / 1000000);
+			if (wait <= 0)
+				return remaining;
+		}
+
+		// A ring write completes on threadRing(), which signals txdone. With
+		// none in flight, the ring had no free entry for one; threadRing()
+		// frees entries as it submits, so wait a moment and try again.
+		if (uart->rxmode == UART_RXURING) {
+			struct timespec deadline;
+			pthread_mutex_lock(&uart->txlock);
+			if (uart->ring.txinflight > 0 && timeout < 0) {
+				pthread_cond_wait(&uart->ring.txdone, &uart->txlock);
+			} else {
+				int ms = wait;
+				if (uart->ring.txinflight == 0 && (timeout < 0 || ms > 1))
+					ms = 1;
+				makeDeadline(&deadline, ms);
+				pthread_cond_timedwait(&uart->ring.txdone, &uart->txlock,
+						&deadline);
+			}
+			pthread_mutex_unlock(&uart->txlock);
+			continue;
+		}
+
+		// The transmit FIFO has no descriptor to wait on; give it a moment
+		if (uart->backend == UART_BACKENDPL011) {
+			struct timespec nap = { 0, uart->pollnap };
+			nanosleep(&nap, NULL);
+			continue;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = uart->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, wait) == -1 && errno != EINTR) {
+			generateError(uart, "Could not wait for serial device");
+			return -1;
+		}
+	}
+}
+
+int uart_hgetInputQueueSize(struct UART *uart) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	return qb_getSize(uart->rxqueue);
+}
+
+int uart_hgetOutputQueueSize(struct UART *uart) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	pthread_mutex_lock(&uart->txlock);
+	int size = qb_getSize(uart->txqueue);
+	pthread_mutex_unlock(&uart->txlock);
+	return size;
+}
+
+int uart_hgetBaudRate(struct UART *uart) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	return uart->baudrate;
+}
+
+int uart_hgetEventFd(struct UART *uart) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	return uart->rxeventfd;
+}
+
+int uart_hgetStats(struct UART *uart, struct UARTStats *stats) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+	if (!stats) {
+		generateError(uart, "No stats structure given");
+		return 0;
+	}
+
+	stats->rxbytes = atomic_load_explicit(&uart->rxbytes, memory_order_relaxed);
+	stats->rxreads = atomic_load_explicit(&uart->rxreads, memory_order_relaxed);
+	stats->rxfull =
+			atomic_load_explicit(&uart->rxfullcount, memory_order_relaxed);
+	stats->txbytes = atomic_load_explicit(&uart->txbytes, memory_order_relaxed);
+	stats->txwrites =
+			atomic_load_explicit(&uart->txwrites, memory_order_relaxed);
+	stats->syscalls =
+			atomic_load_explicit(&uart->syscalls, memory_order_relaxed);
+	stats->rxagain = atomic_load_explicit(&uart->rxagain, memory_order_relaxed);
+	stats->txagain = atomic_load_explicit(&uart->txagain, memory_order_relaxed);
+	stats->txshort = atomic_load_explicit(&uart->txshort, memory_order_relaxed);
+	stats->rxpeak = atomic_load_explicit(&uart->rxpeak, memory_order_relaxed);
+	stats->txpeak = atomic_load_explicit(&uart->txpeak, memory_order_relaxed);
+
+	struct serial_icounter_struct icount;
+	if (uart->hasicount && ioctl(uart->fd, TIOCGICOUNT, &icount) == 0) {
+		stats->overrun = icount.overrun - uart->icount.overrun;
+		stats->bufoverrun = icount.buf_overrun - uart->icount.buf_overrun;
+		stats->parity = icount.parity - uart->icount.parity;
+		stats->framing = icount.frame - uart->icount.frame;
+		stats->breaks = icount.brk - uart->icount.brk;
+	} else {
+		stats->overrun =
+				atomic_load_explicit(&uart->overrun, memory_order_relaxed);
+		stats->bufoverrun = 0;
+		stats->parity =
+				atomic_load_explicit(&uart->parity, memory_order_relaxed);
+		stats->framing =
+				atomic_load_explicit(&uart->framing, memory_order_relaxed);
+		stats->breaks =
+				atomic_load_explicit(&uart->breaks, memory_order_relaxed);
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->uptime = (now.tv_sec - uart->opened.tv_sec) +
+			(now.tv_nsec - uart->opened.tv_nsec) / 1e9;
+	return 1;
+}
+
+int uart_hgetRxMode(struct UART *uart) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	return uart->rxmode;
+}
+
+int uart_hsetLowLatency(struct UART *uart, int enable) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	if (uart->backend == UART_BACKENDPL011) {
+		atomic_store(&uart->pollspin, enable != 0);
+		return 1;
+	}
+
+	// Not every driver has serial_struct; those that do not have nothing to
+	// batch, or no way to stop it
+	struct serial_struct serial;
+	if (ioctl(uart->fd, TIOCGSERIAL, &serial) == 0) {
+		if (enable)
+			serial.flags |= ASYNC_LOW_LATENCY;
+		else
+			serial.flags &= ~ASYNC_LOW_LATENCY;
+
+		if (ioctl(uart->fd, TIOCSSERIAL, &serial) == -1) {
+			generateError(uart, "Could not set low-latency mode");
+			return 0;
+		}
+	}
+
+	// VMIN is left alone. Reads never block (O_NONBLOCK), and n_tty reports
+	// the device readable, and raises SIGIO, on the first byte whether VMIN
+	// is 0 or 1, so it would change nothing here. Only the blocking reads of
+	// UART_RXURING depend on it, and startRing() has set it for them.
+
+	return 1;
+}
+
+int uart_hgetLowLatency(struct UART *uart) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return -1;
+	}
+
+	if (uart->backend == UART_BACKENDPL011)
+		return atomic_load(&uart->pollspin);
+
+	struct serial_struct serial;
+	if (ioctl(uart->fd, TIOCGSERIAL, &serial) == -1)
+		return 0;
+
+	return (serial.flags & ASYNC_LOW_LATENCY) != 0;
+}
+
+int uart_hrecordLatency(struct UART *uart, int enable) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	if (enable)
+		memset(&uart->latency, 0, sizeof(uart->latency));
+	uart->recordlatency = enable;
+	return 1;
+}
+
+int uart_hgetLatency(struct UART *uart, struct UARTLatency *latency) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+	if (!latency) {
+		generateError(uart, "No latency structure given");
+		return 0;
+	}
+
+	*latency = uart->latency;
+	return 1;
+}
+
+char *uart_hgetLastError(struct UART *uart) {
+	int  *errorflag = uart ? &uart->error : &error;
+	char *errorstr = uart ? uart->error_str : error_str;
+
+	if (*errorflag) {
+		*errorflag = 0;
+		return errorstr;
+	} else
+		return "No error";
+}
+
+/*
+	Baud rate
+*/
+
+speed_t standardSpeed(int baudrate) {
+	size_t i;
+
+	for (i = 0; i < sizeof(standardrates) / sizeof(standardrates[0]); ++i)
+		if (standardrates[i].rate == baudrate)
+			return standardrates[i].speed;
+
+	return B0;
+}
+
+int applyBaudRate(struct UART *uart, int baudrate, int custom) {
+	struct termios2 tprops;
+
+	if (ioctl(uart->fd, TCGETS2, &tprops) == -1) {
+		// No termios2: standard rates were still set by tcsetattr()
+		if (custom) {
+			generateError(uart, "Baud rate needs termios2 support");
+			return 0;
+		}
+		uart->baudrate = baudrate;
+		return 1;
+	}
+
+	if (custom) {
+		// Input speed bits left at 0 follow the output speed
+		tprops.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+		tprops.c_cflag |= BOTHER;
+		tprops.c_ispeed = tprops.c_ospeed = baudrate;
+
+		if (ioctl(uart->fd, TCSETS2, &tprops) == -1 ||
+				ioctl(uart->fd, TCGETS2, &tprops) == -1) {
+			generateError(uart, "Unsupported baud rate requested");
+			return 0;
+		}
+	}
+
+	// Drivers report the rate their clock divisor really gives, which may
+	// differ from the one requested
+	uart->baudrate = tprops.c_ospeed;
+	return 1;
+}
+
+/*
+	Receive path
+*/
+
+void sigHandlerIO(int signumber) {
+	int saved = errno, i;
+	(void)signumber;
+
+	// Counted before any slot is read, so a UART taken out of signaluarts
+	// is either never seen here or waited for by unregisterSignal()
+	atomic_fetch_add(&signalactive, 1);
+
+	// Non-realtime signals are merged, so one SIGIO may stand for data on
+	// several devices: service every registered UART
+	for (i = 0; i < UART_MAXSIGNAL; ++i) {
+		struct UART *uart = atomic_load(&signaluarts[i]);
+		if (uart)
+			drainInput(uart);
+	}
+
+	atomic_fetch_sub(&signalactive, 1);
+	errno = saved;
+}
+
+int registerSignal(struct UART *uart) {
+	static atomic_flag installed = ATOMIC_FLAG_INIT;
+	int i;
+
+	if (!atomic_flag_test_and_set(&installed)) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = sigHandlerIO;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGIO, &sa, NULL);
+	}
+
+	for (i = 0; i < UART_MAXSIGNAL; ++i) {
+		struct UART *expected = NULL;
+		if (atomic_compare_exchange_strong(&signaluarts[i], &expected, uart))
+			break;
+	}
+	if (i == UART_MAXSIGNAL) {
+		generateError(uart, "Too many UARTs in signal receive mode");
+		return 0;
+	}
+
+	// O_NONBLOCK is kept, so a read never stalls the signal handler
+	fcntl(uart->fd, F_SETOWN, getpid());
+	fcntl(uart->fd, F_SETFL, O_ASYNC | O_NONBLOCK);
+
+	// Data may have arrived before SIGIO was enabled
+	drainInput(uart);
+	return 1;
+}
+
+void unregisterSignal(struct UART *uart) {
+	int i;
+
+	fcntl(uart->fd, F_SETFL, O_NONBLOCK);
+	for (i = 0; i < UART_MAXSIGNAL; ++i) {
+		struct UART *expected = uart;
+		atomic_compare_exchange_strong(&signaluarts[i], &expected, NULL);
+	}
+
+	// A handler running on another thread may have read the slot before it
+	// was cleared, and not yet reached drainInput(); wait until every such
+	// run has finished. Runs that start now cannot find this UART.
+	while (atomic_load(&signalactive) > 0)
+		sched_yield();
+}
+
+void *threadRx(void *arg) {
+	struct UART *uart = (struct UART *)arg;
+	struct epoll_event events[2];
+	int count, i;
+
+	for (;;) {
+		count = epoll_wait(uart->epollfd, events, 2, -1);
+		atomic_fetch_add_explicit(&uart->syscalls, 1, memory_order_relaxed);
+		for (i = 0; i < count; ++i) {
+			if (events[i].data.fd == uart->stopfd)
+				return NULL;
+
+			if (events[i].events & EPOLLOUT) {
+				pthread_mutex_lock(&uart->txlock);
+				flushOutput(uart);
+				pthread_mutex_unlock(&uart->txlock);
+			}
+			if (events[i].events & ~EPOLLOUT)
+				drainInput(uart);
+		}
+	}
+}
+
+int startRxThread(struct UART *uart, const struct UARTOptions *options) {
+	struct epoll_event event;
+
+	uart->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	uart->stopfd = eventfd(0, EFD_CLOEXEC);
+	if (uart->epollfd == -1 || uart->stopfd == -1) {
+		generateError(uart, "Could not create receive thread descriptors");
+		return 0;
+	}
+
+	// Edge-triggered: drainInput() reads until the kernel is empty, or
+	// leaves rxfull set for popInput() to resume later
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.fd = uart->fd;
+	if (epoll_ctl(uart->epollfd, EPOLL_CTL_ADD, uart->fd, &event) == -1) {
+		generateError(uart, "Could not watch serial device");
+		return 0;
+	}
+	event.events = EPOLLIN;
+	event.data.fd = uart->stopfd;
+	epoll_ctl(uart->epollfd, EPOLL_CTL_ADD, uart->stopfd, &event);
+
+	pthread_attr_t attr;
+	initThreadAttr(&attr, options);
+
+	int result = pthread_create(&uart->rxthread, &attr, threadRx, uart);
+	pthread_attr_destroy(&attr);
+
+	if (result != 0) {
+		generateError(uart, "Could not start receive thread (check rxcpu and "
+				"rxpriority permissions)");
+		return 0;
+	}
+
+	// Data may have arrived before the thread was watching
+	drainInput(uart);
+	return 1;
+}
+
+void initThreadAttr(pthread_attr_t *attr, const struct UARTOptions *options) {
+	pthread_attr_init(attr);
+	if (!options)
+		return;
+
+	if (options->rxcpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(options->rxcpu, &cpus);
+		pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+	}
+
+	if (options->rxpriority > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = options->rxpriority;
+		pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+		pthread_attr_setschedparam(attr, &param);
+	}
+}
+
+#if UART_HAVEURING
+int startRing(struct UART *uart, const struct UARTOptions *options) {
+	struct URing *ring = &uart->ring;
+	struct io_uring_params params;
+	int i;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, UART_URINGENTRIES, &params);
+	if (ring->fd == -1)
+		return 0;
+
+	// Both rings in one mapping (5.4), and no completions dropped (5.5)
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(params.features & IORING_FEAT_NODROP))
+		return 0;
+
+	size_t sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned),
+	       cqsize = params.cq_off.cqes +
+	                params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ringsize = sqsize > cqsize ? sqsize : cqsize;
+	ring->ringmap = mmap(NULL, ring->ringsize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ringmap == MAP_FAILED) {
+		ring->ringmap = NULL;
+		return 0;
+	}
+
+	ring->sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return 0;
+	}
+
+	uint8_t *map = (uint8_t *)ring->ringmap;
+	ring->sqhead = (unsigned *)(map + params.sq_off.head);
+	ring->sqtail = (unsigned *)(map + params.sq_off.tail);
+	ring->sqarray = (unsigned *)(map + params.sq_off.array);
+	ring->sqmask = *(unsigned *)(map + params.sq_off.ring_mask);
+	ring->sqentries = params.sq_entries;
+	ring->cqhead = (unsigned *)(map + params.cq_off.head);
+	ring->cqtail = (unsigned *)(map + params.cq_off.tail);
+	ring->cqmask = *(unsigned *)(map + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+	// Entries are used in order, so each slot of the array names its own
+	for (i = 0; i < (int)params.sq_entries; ++i)
+		ring->sqarray[i] = i;
+
+	// Multishot reads are new enough to need asking for
+	struct {
+		struct io_uring_probe   probe;
+		struct io_uring_probe_op ops[256];
+	} probe;
+	memset(&probe, 0, sizeof(probe));
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+			&probe, 256) == 0 &&
+			probe.probe.ops_len > UART_OPREADMULTISHOT)
+		ring->multishot = (probe.ops[UART_OPREADMULTISHOT].flags &
+				IO_URING_OP_SUPPORTED) != 0;
+
+	// Buffers for the kernel to read into, handed over through a ring of
+	// their own (5.19). It must be page-aligned.
+	if (posix_memalign((void **)&ring->bufring, sysconf(_SC_PAGESIZE),
+			UART_URINGBUFS * sizeof(struct io_uring_buf)) != 0) {
+		ring->bufring = NULL;
+		return 0;
+	}
+	memset(ring->bufring, 0, UART_URINGBUFS * sizeof(struct io_uring_buf));
+	ring->bufs = malloc(UART_URINGBUFS * UART_URINGBUFSIZE);
+	if (!ring->bufs)
+		return 0;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring->bufring;
+	reg.ring_entries = UART_URINGBUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+			&reg, 1) != 0)
+		return 0;
+
+	for (i = 0; i < UART_URINGBUFS; ++i) {
+		ring->bufring->bufs[i].addr =
+				(uintptr_t)(ring->bufs + (size_t)i * UART_URINGBUFSIZE);
+		ring->bufring->bufs[i].len = UART_URINGBUFSIZE;
+		ring->bufring->bufs[i].bid = i;
+	}
+	ring->buftail = UART_URINGBUFS;
+	__atomic_store_n(&ring->bufring->tail, ring->buftail, __ATOMIC_RELEASE);
+
+	uart->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (uart->stopfd == -1) {
+		generateError(uart, "Could not create receive thread descriptors");
+		return -1;
+	}
+
+	// Ring reads wait in the kernel for data rather than returning EAGAIN,
+	// which io_uring passes straight back for O_NONBLOCK descriptors. With
+	// VMIN 0 they would return 0 at once instead, which ends them.
+	struct termios tprops;
+	fcntl(uart->fd, F_SETFL, 0);
+	if (tcgetattr(uart->fd, &tprops) == 0) {
+		tprops.c_cc[VMIN] = 1;
+		tcsetattr(uart->fd, TCSANOW, &tprops);
+	}
+
+	pthread_attr_t attr;
+	initThreadAttr(&attr, options);
+
+	int result = pthread_create(&uart->rxthread, &attr, threadRing, uart);
+	pthread_attr_destroy(&attr);
+
+	if (result != 0) {
+		generateError(uart, "Could not start receive thread (check rxcpu and "
+				"rxpriority permissions)");
+		return -1;
+	}
+
+	return 1;
+}
+
+void *threadRing(void *arg) {
+	struct UART  *uart = (struct UART *)arg;
+	struct URing *ring = &uart->ring;
+	unsigned head, tail, held;
+	int      result, wrote, woken, gotinput;
+	uint64_t events;
+
+	// Queued from here, so the kernel runs the reads on this thread's
+	// behalf rather than the application's
+	queueWake(uart);
+
+	for (;;) {
+		held = atomic_load(&ring->heldtail) - atomic_load(&ring->heldhead);
+		if (!atomic_load(&ring->armed) && !atomic_load(&ring->failed) &&
+				held < UART_URINGBUFS)
+			queueRead(uart);
+
+		// Whatever was queued goes in with the wait: one system call
+		result = enterRing(uart, 1);
+		if (result == -1 && errno != EINTR && errno != EAGAIN &&
+				errno != EBUSY)
+			return NULL;
+
+		// Take every completion there is before acting on any. Reads are
+		// stamped as they are reaped, since they may be held a while before
+		// there is room to queue them.
+		wrote = woken = gotinput = 0;
+		head = *ring->cqhead;
+		tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+		uint64_t reaped = head != tail ? monotonicNs() : 0;
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqmask];
+
+			if (cqe->user_data == UART_URINGREAD) {
+				if (cqe->res > 0) {
+					held = atomic_load_explicit(&ring->heldtail,
+							memory_order_relaxed);
+					ring->held[held & (UART_URINGBUFS - 1)] =
+							(struct HeldRead){
+								cqe->flags >> IORING_CQE_BUFFER_SHIFT, 0,
+								cqe->res, reaped };
+					atomic_store_explicit(&ring->heldtail, held + 1,
+							memory_order_release);
+					addCount(&uart->rxreads, 1);
+					gotinput = 1;
+				} else if (cqe->res != -ENOBUFS && cqe->res != -EAGAIN &&
+						cqe->res != -EINTR && cqe->res != -ECANCELED) {
+					// End of file or hangup: there will be nothing more
+					atomic_store(&ring->failed, 1);
+				}
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					atomic_store(&ring->armed, 0);
+			} else if (cqe->user_data == UART_URINGWRITE) {
+				pthread_mutex_lock(&uart->txlock);
+				completeWrite(uart, cqe->res);
+				pthread_mutex_unlock(&uart->txlock);
+				wrote = 1;
+			} else if (cqe->user_data == UART_URINGWAKE) {
+				woken = 1;
+			}
+		}
+		__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+
+		if (gotinput)
+			drainInput(uart);
+
+		// Whatever was queued while the last write was in flight goes out
+		// as one
+		if (wrote) {
+			pthread_mutex_lock(&uart->txlock);
+			queueWrite(uart);
+			pthread_cond_broadcast(&ring->txdone);
+			pthread_mutex_unlock(&uart->txlock);
+		}
+
+		if (woken) {
+			if (atomic_load(&ring->stop))
+				return NULL;
+			read(uart->stopfd, &events, sizeof(events));
+			atomic_fetch_add_explicit(&uart->syscalls, 1,
+					memory_order_relaxed);
+			queueWake(uart);
+		}
+	}
+}
+
+int queueEntry(struct UART *uart, const struct io_uring_sqe *sqe) {
+	struct URing *ring = &uart->ring;
+
+	pthread_mutex_lock(&ring->lock);
+	unsigned tail = *ring->sqtail;
+	if (tail - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >=
+			ring->sqentries) {
+		pthread_mutex_unlock(&ring->lock);
+		return 0;
+	}
+
+	ring->sqes[tail & ring->sqmask] = *sqe;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+	++ring->unsubmitted;
+	pthread_mutex_unlock(&ring->lock);
+	return 1;
+}
+
+int enterRing(struct UART *uart, int wait) {
+	struct URing *ring = &uart->ring;
+
+	pthread_mutex_lock(&ring->lock);
+	unsigned count = ring->unsubmitted;
+	ring->unsubmitted = 0;
+	pthread_mutex_unlock(&ring->lock);
+
+	if (count == 0 && !wait)
+		return 0;
+
+	// If another thread's call submits these entries first, this one
+	// submits fewer; either way none is left behind
+	atomic_fetch_add_explicit(&uart->syscalls, 1, memory_order_relaxed);
+	return syscall(__NR_io_uring_enter, ring->fd, count, wait ? 1 : 0,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+void queueRead(struct UART *uart) {
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.fd = uart->fd;
+	sqe.off = (uint64_t)-1;
+	sqe.flags = IOSQE_BUFFER_SELECT;
+	sqe.buf_group = 0;
+	sqe.user_data = UART_URINGREAD;
+	if (uart->ring.multishot) {
+		// Stays queued, taking a new buffer for each completion
+		sqe.opcode = UART_OPREADMULTISHOT;
+	} else {
+		sqe.opcode = IORING_OP_READ;
+		sqe.len = UART_URINGBUFSIZE;
+	}
+
+	if (queueEntry(uart, &sqe))
+		atomic_store(&uart->ring.armed, 1);
+}
+
+void queueWake(struct UART *uart) {
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_POLL_ADD;
+	sqe.fd = uart->stopfd;
+	sqe.poll32_events = POLLIN;
+	sqe.user_data = UART_URINGWAKE;
+	queueEntry(uart, &sqe);
+}
+
+int queueWrite(struct UART *uart) {
+	struct URing *ring = &uart->ring;
+
+	if (ring->txerror) {
+		ring->txerror = 0;
+		generateError(uart, "Could not write to serial device");
+		return -1;
+	}
+	if (ring->txinflight > 0)
+		return 0;
+
+	// The regions stay queued, and the iovecs in place, until the write
+	// completes; uart_write() only adds behind them meanwhile
+	int count = qb_peek(uart->txqueue, ring->txiov, 2);
+	if (count == 0)
+		return 0;
+
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_WRITEV;
+	sqe.fd = uart->fd;
+	sqe.off = (uint64_t)-1;
+	sqe.addr = (uintptr_t)ring->txiov;
+	sqe.len = count;
+	sqe.user_data = UART_URINGWRITE;
+	if (!queueEntry(uart, &sqe))
+		return 0;
+
+	ring->txinflight = ring->txiov[0].iov_len +
+			(count > 1 ? ring->txiov[1].iov_len : 0);
+	addCount(&uart->txwrites, 1);
+
+	// threadRing() submits its own entries with its next wait
+	if (!pthread_equal(pthread_self(), uart->rxthread))
+		enterRing(uart, 0);
+	return 0;
+}
+
+void completeWrite(struct UART *uart, int result) {
+	struct URing *ring = &uart->ring;
+	size_t inflight = ring->txinflight;
+
+	ring->txinflight = 0;
+	if (result > 0) {
+		qb_consume(uart->txqueue, result);
+		addCount(&uart->txbytes, result);
+		if ((size_t)result < inflight)
+			addCount(&uart->txshort, 1);
+	} else if (result == -EAGAIN) {
+		addCount(&uart->txagain, 1);
+	} else if (result < 0 && result != -EINTR &&
+			result != -ECANCELED) {
+		// Reported by the next uart_write() or uart_flush(); the data stays
+		// queued
+		ring->txerror = 1;
+	}
+}
+#else
+int startRing(struct UART *uart, const struct UARTOptions *options) {
+	return 0;
+}
+
+int queueWrite(struct UART *uart) {
+	return -1;
+}
+#endif
+
+void closeRing(struct URing *ring) {
+	// Closing the ring cancels whatever it still had queued
+	if (ring->fd != -1)
+		close(ring->fd);
+	if (ring->ringmap)
+		munmap(ring->ringmap, ring->ringsize);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqesize);
+	free(ring->bufring);
+	free(ring->bufs);
+
+	ring->fd = -1;
+	ring->ringmap = ring->sqes = NULL;
+	ring->bufring = NULL;
+	ring->bufs = NULL;
+}
+
+void releaseResources(struct UART *uart) {
+	closeRing(&uart->ring);
+	pthread_mutex_destroy(&uart->ring.lock);
+	pthread_cond_destroy(&uart->ring.txdone);
+
+	if (uart->epollfd != -1)
+		close(uart->epollfd);
+	if (uart->stopfd != -1)
+		close(uart->stopfd);
+	if (uart->rxeventfd != -1)
+		close(uart->rxeventfd);
+	if (uart->fd != -1)
+		close(uart->fd);
+	if (uart->regmap)
+		munmap(uart->regmap, UART_PL011BLOCK);
+
+	qb_free(&uart->rxqueue);
+	qb_free(&uart->txqueue);
+	pthread_mutex_destroy(&uart->txlock);
+	free(uart);
+}
+
+void drainInput(struct UART *uart) {
+	int added = 0;
+
+	do {
+		if (atomic_flag_test_and_set_explicit(&uart->rxbusy,
+				memory_order_acquire)) {
+			atomic_store(&uart->rxpending, 1);
+			return;
+		}
+		atomic_store(&uart->rxpending, 0);
+
+		if (uart->rxmode == UART_RXURING)
+			added |= drainHeld(uart);
+		else
+			added |= readDevice(uart);
+
+		atomic_flag_clear_explicit(&uart->rxbusy, memory_order_release);
+	} while (atomic_load(&uart->rxpending));
+
+	// write() is async-signal-safe, so this is fine from sigHandlerIO()
+	if (added) {
+		uint64_t one = 1;
+		write(uart->rxeventfd, &one, sizeof(one));
+		atomic_fetch_add_explicit(&uart->syscalls, 1, memory_order_relaxed);
+	}
+}
+
+int readDevice(struct UART *uart) {
+	void   *space;
+	size_t len;
+	int    bytes, added = 0;
+
+	// read() straight into the free space of the queue. A short read means
+	// the kernel has nothing more for now.
+	for (;;) {
+		if (!reserveInput(uart, &space, &len))
+			break;
+
+		if (uart->backend == UART_BACKENDPL011) {
+			bytes = readRegisters(uart, space, len);
+		} else {
+			bytes = read(uart->fd, space, len);
+			atomic_fetch_add_explicit(&uart->syscalls, 1,
+					memory_order_relaxed);
+		}
+		if (bytes <= 0) {
+			// An empty FIFO is every other poll, not worth counting
+			if (uart->backend == UART_BACKENDTTY &&
+					(bytes == 0 || errno == EAGAIN))
+				addCount(&uart->rxagain, 1);
+			break;
+		}
+
+		stampInput(uart);
+		uart->rxtotal += bytes;
+		qb_commit(uart->rxqueue, bytes);
+		addCount(&uart->rxreads, 1);
+		addCount(&uart->rxbytes, bytes);
+		notePeak(&uart->rxpeak, qb_getSize(uart->rxqueue));
+		added = 1;
+		if ((size_t)bytes < len)
+			break;
+	}
+
+	return added;
+}
+
+int reserveInput(struct UART *uart, void **space, size_t *len) {
+	int attempt;
+
+	// Input left in the kernel past the watermark is what lets its flow
+	// control hold off the sender
+	for (attempt = 0; attempt < 2; ++attempt) {
+		size_t size = qb_getSize(uart->rxqueue);
+		if (size < uart->rxhighwater && qb_reserve(uart->rxqueue, space, len)) {
+			if (*len > uart->rxhighwater - size)
+				*len = uart->rxhighwater - size;
+			if (attempt > 0)
+				atomic_store(&uart->rxfull, 0);
+			return 1;
+		}
+
+		// The reader may have made room just before seeing rxfull
+		atomic_store(&uart->rxfull, 1);
+	}
+
+	addCount(&uart->rxfullcount, 1);
+	return 0;
+}
+
+#if UART_HAVEURING
+int drainHeld(struct UART *uart) {
+	struct URing *ring = &uart->ring;
+	unsigned head = atomic_load_explicit(&ring->heldhead, memory_order_relaxed),
+	         tail = atomic_load_explicit(&ring->heldtail, memory_order_acquire);
+	void     *space;
+	size_t   len;
+	int      added = 0, returned = 0;
+
+	while (head != tail) {
+		struct HeldRead *held = &ring->held[head & (UART_URINGBUFS - 1)];
+
+		if (!reserveInput(uart, &space, &len))
+			break;
+
+		if (len > held->len)
+			len = held->len;
+		memcpy(space, ring->bufs + (size_t)held->bid * UART_URINGBUFSIZE +
+				held->offset, len);
+
+		stampInputAt(uart, held->ns);
+		uart->rxtotal += len;
+		qb_commit(uart->rxqueue, len);
+		addCount(&uart->rxbytes, len);
+		notePeak(&uart->rxpeak, qb_getSize(uart->rxqueue));
+		added = 1;
+
+		held->offset += len;
+		held->len -= len;
+		if (held->len > 0)
+			continue;
+
+		// Copied out: the buffer can take another read
+		struct io_uring_buf *buf =
+				&ring->bufring->bufs[ring->buftail & (UART_URINGBUFS - 1)];
+		buf->addr = (uintptr_t)(ring->bufs +
+				(size_t)held->bid * UART_URINGBUFSIZE);
+		buf->len = UART_URINGBUFSIZE;
+		buf->bid = held->bid;
+		__atomic_store_n(&ring->bufring->tail, ++ring->buftail,
+				__ATOMIC_RELEASE);
+		atomic_store_explicit(&ring->heldhead, ++head, memory_order_release);
+		returned = 1;
+	}
+
+	// Reads stop once every buffer is held. Now that one is back, have
+	// threadRing() queue another (it does so itself after each batch).
+	if (returned && !atomic_load(&ring->armed) &&
+			!pthread_equal(pthread_self(), uart->rxthread)) {
+		uint64_t one = 1;
+		write(uart->stopfd, &one, sizeof(one));
+		atomic_fetch_add_explicit(&uart->syscalls, 1, memory_order_relaxed);
+	}
+
+	return added;
+}
+#else
+int drainHeld(struct UART *uart) {
+	return 0;
+}
+#endif
+
+int popInput(struct UART *uart, void *buffer, size_t len) {
+	if (uart->recordlatency && len > 0 && qb_getSize(uart->rxqueue) > 0)
+		sampleLatency(uart);
+
+	int bytes = qb_pop(uart->rxqueue, buffer, len);
+
+	if (bytes > 0) {
+		uart->rxtaken += bytes;
+		dropStamps(uart);
+		resumeInput(uart);
+	}
+
+	return bytes;
+}
+
+int waitInput(struct UART *uart, const struct timespec *deadline) {
+	struct timespec now;
+	struct pollfd   pfd;
+	uint64_t        events;
+	int             wait = -1, size, ready;
+
+	// Reset the eventfd before looking at the queue: input committed after
+	// the look signals it again, so poll() cannot sleep through it
+	read(uart->rxeventfd, &events, sizeof(events));
+	size = qb_getSize(uart->rxqueue);
+
+	pfd.fd = uart->rxeventfd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (qb_getSize(uart->rxqueue) != size)
+			return 1;
+
+		if (deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > deadline->tv_sec ||
+					(now.tv_sec == deadline->tv_sec &&
+					now.tv_nsec >= deadline->tv_nsec))
+				return 0;
+
+			// Round up, so the deadline has passed when poll() returns
+			wait = (deadline->tv_sec - now.tv_sec) * 1000 +
+					(deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+		}
+
+		// SIGIO interrupts poll() in UART_RXSIGNAL mode; the eventfd is
+		// signalled by then if it brought input
+		ready = poll(&pfd, 1, wait);
+		if (ready == -1 && errno != EINTR) {
+			generateError(uart, "Could not wait for input");
+			return -1;
+		}
+		if (ready > 0)
+			return 1;
+	}
+}
+
+struct timespec *makeDeadline(struct timespec *deadline, int timeout) {
+	if (timeout < 0)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		++deadline->tv_sec;
+		deadline->tv_nsec -= 1000000000L;
+	}
+
+	return deadline;
+}
+
+void resumeInput(struct UART *uart) {
+	if (atomic_load(&uart->rxfull)) {
+		atomic_store(&uart->rxfull, 0);
+		drainInput(uart);
+	}
+}
+
+void stampInput(struct UART *uart) {
+	// clock_gettime() is async-signal-safe, so this is fine from
+	// sigHandlerIO(). One call per read() batch, not per byte.
+	stampInputAt(uart, monotonicNs());
+}
+
+void stampInputAt(struct UART *uart, uint64_t ns) {
+	unsigned tail = atomic_load_explicit(&uart->rxstamptail,
+			memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&uart->rxstamphead,
+			memory_order_acquire);
+
+	// Out of room: this batch is covered by the timestamp before it, which
+	// is only a little early
+	if (tail - head == UART_RXSTAMPS)
+		return;
+
+	struct RxStamp *stamp = &uart->rxstamps[tail & (UART_RXSTAMPS - 1)];
+	stamp->start = uart->rxtotal;
+	stamp->ns = ns;
+
+	// Published before the bytes are committed, so whoever sees the bytes
+	// also sees their timestamp
+	atomic_store_explicit(&uart->rxstamptail, tail + 1, memory_order_release);
+}
+
+uint64_t monotonicNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void dropStamps(struct UART *uart) {
+	unsigned head = atomic_load_explicit(&uart->rxstamphead,
+			memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&uart->rxstamptail,
+			memory_order_acquire);
+
+	// The timestamp for the next byte is the last one starting at or before
+	// it; any before that are for input already read
+	while (tail - head > 1 &&
+			uart->rxstamps[(head + 1) & (UART_RXSTAMPS - 1)].start <=
+			uart->rxtaken)
+		++head;
+
+	atomic_store_explicit(&uart->rxstamphead, head, memory_order_release);
+}
+
+void arrivalTime(struct UART *uart, struct timespec *arrival) {
+	// Input may have arrived since the last read
+	dropStamps(uart);
+
+	unsigned head = atomic_load_explicit(&uart->rxstamphead,
+			memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&uart->rxstamptail,
+			memory_order_acquire);
+
+	if (tail == head) {
+		arrival->tv_sec = arrival->tv_nsec = 0;
+		return;
+	}
+
+	uint64_t ns = uart->rxstamps[head & (UART_RXSTAMPS - 1)].ns;
+	arrival->tv_sec = ns / 1000000000;
+	arrival->tv_nsec = ns % 1000000000;
+}
+
+void sampleLatency(struct UART *uart) {
+	struct timespec arrival, now;
+	arrivalTime(uart, &arrival);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int64_t ns = (int64_t)(now.tv_sec - arrival.tv_sec) * 1000000000 +
+			(now.tv_nsec - arrival.tv_nsec);
+	if (ns < 0)
+		ns = 0;
+
+	// Bin by the number of bits in the latency in microseconds
+	uint64_t us = ns / 1000;
+	int bin = 0;
+	while (us > 0 && bin < UART_LATENCYBINS - 1) {
+		us >>= 1;
+		++bin;
+	}
+
+	struct UARTLatency *latency = &uart->latency;
+	++latency->counts[bin];
+	++latency->samples;
+	latency->totalns += ns;
+	if ((uint64_t)ns > latency->maxns)
+		latency->maxns = ns;
+}
+
+/*
+	Transmit path
+*/
+
+size_t queueOutput(struct UART *uart, const void *buffer, size_t len,
+		int *result) {
+	const char *bytes = (const char *)buffer;
+	size_t accepted = 0;
+
+	// Queue what fits; if that is not everything, make room by writing to
+	// the device and try again, until it stops taking data
+	for (;;) {
+		accepted += qb_push(uart->txqueue, bytes + accepted, len - accepted);
+		notePeak(&uart->txpeak, qb_getSize(uart->txqueue));
+		if (accepted == len)
+			break;
+
+		*result = flushOutput(uart);
+		if (*result <= 0)
+			break;
+	}
+
+	return accepted;
+}
+
+int flushOutput(struct UART *uart) {
+	struct iovec iov[2];
+	size_t  queued;
+	ssize_t bytes;
+	int     count, written = 0;
+
+	if (uart->rxmode == UART_RXURING)
+		return queueWrite(uart);
+
+	// The ring holds at most two regions, so one writev() takes everything
+	// queued. A short write means the kernel buffer is full for now.
+	while ((count = qb_peek(uart->txqueue, iov, 2)) > 0) {
+		queued = iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0);
+
+		if (uart->backend == UART_BACKENDPL011) {
+			bytes = writeRegisters(uart, iov, count);
+		} else {
+			bytes = writev(uart->fd, iov, count);
+			atomic_fetch_add_explicit(&uart->syscalls, 1,
+					memory_order_relaxed);
+		}
+		addCount(&uart->txwrites, 1);
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				addCount(&uart->txagain, 1);
+				break;
+			}
+
+			generateError(uart, "Could not write to serial device");
+			return -1;
+		}
+
+		qb_consume(uart->txqueue, bytes);
+		addCount(&uart->txbytes, bytes);
+		written += bytes;
+		if ((size_t)bytes < queued) {
+			// The transmit FIFO takes nothing at all when full
+			addCount(bytes == 0 ? &uart->txagain : &uart->txshort, 1);
+			break;
+		}
+	}
+
+	watchOutput(uart, qb_getSize(uart->txqueue) > 0);
+	return written;
+}
+
+void watchOutput(struct UART *uart, int watch) {
+	// The PL011 polling thread flushes output on every pass anyway
+	if (uart->rxmode != UART_RXTHREAD || uart->backend != UART_BACKENDTTY ||
+			uart->txwatch == watch)
+		return;
+
+	// Modifying the registration re-checks readiness, so an EPOLLOUT edge
+	// cannot be missed between the last writev() and this call
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET | (watch ? EPOLLOUT : 0);
+	event.data.fd = uart->fd;
+	if (epoll_ctl(uart->epollfd, EPOLL_CTL_MOD, uart->fd, &event) == 0)
+		uart->txwatch = watch;
+	atomic_fetch_add_explicit(&uart->syscalls, 1, memory_order_relaxed);
+}
+
+void addCount(atomic_size_t *counter, size_t n) {
+	atomic_store_explicit(counter,
+			atomic_load_explicit(counter, memory_order_relaxed) + n,
+			memory_order_relaxed);
+}
+
+void notePeak(atomic_size_t *peak, size_t value) {
+	if (value > atomic_load_explicit(peak, memory_order_relaxed))
+		atomic_store_explicit(peak, value, memory_order_relaxed);
+}
+
+void generateError(struct UART *uart, const char *str) {
+	int  *errorflag = uart ? &uart->error : &error;
+	char *errorstr = uart ? uart->error_str : error_str;
+
+	*errorflag = 1;
+	if (errorstr != str)
+		strncpy(errorstr, str, UART_ERRSIZE);
+}
+
+/*
+	Byte order
+*/
+
+int writeArray(struct UART *uart, const void *values, size_t count,
+		size_t size) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	const uint8_t *src = (const uint8_t *)values;
+	uint8_t chunk[UART_SWAPCHUNK * 4];
+	size_t  accepted = 0, done = 0, n, queued;
+	int     result = 0;
+
+	// Everything goes into the output queue before any of it is written,
+	// so a whole array costs one writev()
+	pthread_mutex_lock(&uart->txlock);
+	while (done < count) {
+		n = count - done;
+		if (n > UART_SWAPCHUNK)
+			n = UART_SWAPCHUNK;
+
+		swapArray(src + done * size, chunk, n, size);
+		queued = queueOutput(uart, chunk, n * size, &result);
+		accepted += queued;
+		if (queued < n * size)
+			break;
+		done += n;
+	}
+	if (!uart->txbuffered && result != -1)
+		result = flushOutput(uart);
+	pthread_mutex_unlock(&uart->txlock);
+
+	if (accepted < count * size && result != -1)
+		generateError(uart, "Output queue is full");
+
+	return accepted;
+}
+
+int readArray(struct UART *uart, void *values, size_t count, size_t size,
+		const char *shortmsg) {
+	if (!uart) {
+		generateError(NULL, "UART has not been initialized");
+		return 0;
+	}
+
+	if ((size_t)qb_getSize(uart->rxqueue) < count * size) {
+		generateError(uart, shortmsg);
+		return 0;
+	}
+
+	popInput(uart, values, count * size);
+	swapArray(values, values, count, size);
+	return 1;
+}
+
+void swapArray(const void *src, void *dest, size_t count, size_t size) {
+	const uint8_t *in = (const uint8_t *)src;
+	uint8_t       *out = (uint8_t *)dest;
+
+#if UART_HOSTBE
+	if (in != out)
+		memmove(out, in, count * size);
+#else
+	size_t i;
+
+	// memcpy keeps unaligned and float data well-defined; the compiler
+	// turns each into a plain load or store around the swap
+	if (size == 2) {
+		for (i = 0; i < count; ++i) {
+			uint16_t v;
+			memcpy(&v, in + i * 2, 2);
+			v = __builtin_bswap16(v);
+			memcpy(out + i * 2, &v, 2);
+		}
+	} else {
+		for (i = 0; i < count; ++i) {
+			uint32_t v;
+			memcpy(&v, in + i * 4, 4);
+			v = __builtin_bswap32(v);
+			memcpy(out + i * 4, &v, 4);
+		}
+	}
+#endif
+}
@@ -1,12 +1,24 @@
 /**
 	Philip Romano
 	UART Interface for Raspberry Pi (Broadcom 2835)
+
+	Each serial device is driven through a struct UART handle from
+	uart_open(), so several devices (e.g. the onboard UART and a USB XBee)
+	can be used at once, each from its own thread. Calls on one handle must
+	not be made from more than one thread at a time, except that the
+	receive path (signal handler or receive thread) runs alongside them.
+
+	The uart_* functions without a handle work on a single default UART
+	opened by uart_init(), as they always have.
 */
 
 #ifndef UART_H
 #define UART_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 
 typedef enum _UARTParity {
 	UART_PARDISABLE = 0,
@@ -14,6 +26,181 @@ typedef enum _UARTParity {
 	UART_PAREVEN = 2
 } UARTParity;
 
+typedef enum _UARTFlowControl {
+	UART_FLOWNONE = 0,
+
+	// RTS/CTS handshaking: output pauses while the far end deasserts CTS,
+	// and RTS is deasserted when no more input can be taken (CRTSCTS, or
+	// the PL011's own automatic RTS and CTS)
+	UART_FLOWRTSCTS = 1,
+
+	// XON/XOFF: the kernel sends XOFF (0x13) when no more input can be
+	// taken and XON (0x11) once it can, and pauses output between an XOFF
+	// and an XON received. Those two bytes can then no longer be data. Not
+	// available with UART_BACKENDPL011.
+	UART_FLOWXONXOFF = 2
+} UARTFlowControl;
+
+typedef enum _UARTRxMode {
+	// Received data is read by a SIGIO handler, which interrupts whichever
+	// thread is running. Up to 8 UARTs per process (UART_MAXSIGNAL in
+	// uart.c) can use this mode; they share the one handler.
+	UART_RXSIGNAL = 0,
+
+	// Received data is read by a dedicated thread blocked in epoll_wait().
+	// No signals are used.
+	UART_RXTHREAD = 1,
+
+	// Received data is read through io_uring: a read stays queued in the
+	// kernel, which fills buffers handed to it in advance, and a dedicated
+	// thread collects the completions in batches. Output is queued on the
+	// same ring, so uart_write() never makes the write() itself. Needs Linux
+	// 5.19, both to build against and to run on; where io_uring is missing
+	// or disabled, UART_RXTHREAD is used instead (see uart_getRxMode()).
+	UART_RXURING = 2
+} UARTRxMode;
+
+typedef enum _UARTBackend {
+	// The kernel's serial driver, through the tty device at the given path
+	UART_BACKENDTTY = 0,
+
+	// The PL011 registers directly (see below), polled by a receive thread
+	// that moves bytes between the FIFOs and the queues. Bypasses the tty
+	// layer; the kernel's own driver must not be using the UART.
+	UART_BACKENDPL011 = 1
+} UARTBackend;
+
+/*
+	PL011 registers, as byte offsets into the register block, and the bits
+	of them that UART_BACKENDPL011 uses
+*/
+#define UART_PL011BASE  0x20201000 // Physical address on the BCM2835
+#define UART_PL011CLOCK 7372800    // Reference clock (init_uart_clock)
+#define UART_PL011FIFO  16         // Depth of each FIFO
+
+#define UART_REGDR   0x00 // Data: bits 0-7 data, 8-11 FE, PE, BE, OE
+#define UART_REGFR   0x18 // Flags
+#define UART_REGIBRD 0x24 // Integer baud rate divisor
+#define UART_REGFBRD 0x28 // Fractional baud rate divisor (64ths)
+#define UART_REGLCRH 0x2C // Line control
+#define UART_REGCR   0x30 // Control
+#define UART_REGIMSC 0x38 // Interrupt mask
+#define UART_REGICR  0x44 // Interrupt clear
+
+#define UART_FRBUSY 0x08  // Transmitting
+#define UART_FRRXFE 0x10  // Receive FIFO empty
+#define UART_FRTXFF 0x20  // Transmit FIFO full
+#define UART_FRRXFF 0x40  // Receive FIFO full
+#define UART_FRTXFE 0x80  // Transmit FIFO empty
+
+#define UART_DRFE 0x100   // Framing error (no valid stop bit)
+#define UART_DRPE 0x200   // Parity error
+#define UART_DRBE 0x400   // Break (input held low for a whole character)
+#define UART_DROE 0x800   // Overrun: the FIFO was full, a byte was lost
+
+#define UART_LCRHPEN 0x02 // Parity enable
+#define UART_LCRHEPS 0x04 // Even parity
+#define UART_LCRHFEN 0x10 // FIFOs enable
+#define UART_LCRHWL8 0x60 // 8-bit words
+
+#define UART_CRUARTEN 0x001
+#define UART_CRTXE    0x100
+#define UART_CRRXE    0x200
+#define UART_CRRTSEN  0x4000 // RTS follows the receive FIFO
+#define UART_CRCTSEN  0x8000 // Transmit only while CTS is asserted
+
+/*
+	How UART_BACKENDPL011 reaches the registers. Given in UARTOptions to
+	drive something other than the real UART, such as a fake register block
+	for testing (see pl011fake.h); NULL maps the real one from /dev/mem.
+	Both functions are called from the receive thread and, for output, from
+	whichever thread holds the handle's output lock.
+*/
+struct UARTRegisterOps {
+	uint32_t (*read)(void *context, uint32_t offset);
+	void     (*write)(void *context, uint32_t offset, uint32_t value);
+	void     *context;
+};
+
+struct UARTOptions {
+	UARTBackend backend;
+
+	// UART_BACKENDPL011 only: register access, or NULL for the real
+	// registers, mapped from the memory device given as the path (normally
+	// "/dev/mem")
+	const struct UARTRegisterOps *regops;
+
+	// Ignored by UART_BACKENDPL011, which always polls from a thread (the
+	// rxcpu and rxpriority below still apply to it)
+	UARTRxMode rxmode;
+
+	// UART_RXTHREAD and UART_RXURING only: CPU to pin the receive thread
+	// to, or -1 to let it run on any CPU
+	int rxcpu;
+
+	// UART_RXTHREAD and UART_RXURING only: SCHED_FIFO priority (1 to 99)
+	// for the receive thread, or 0 to leave it on the default scheduling
+	// policy. Real-time priorities need root or CAP_SYS_NICE.
+	int rxpriority;
+
+	// 0 to write output to the device as soon as uart_write() queues it; 1
+	// to hold it in the output queue until uart_flush() (or until the queue
+	// fills), so a message made of many small fields costs one system call.
+	int txbuffered;
+
+	// How the far end is told to pause when input backs up
+	UARTFlowControl flowcontrol;
+
+	// Bytes the input queue may hold before the driver stops taking input
+	// from the device, or 0 for all of it (64 KiB). Beyond that, input
+	// backs up in the kernel (or the PL011's FIFO), where flow control
+	// holds off the sender instead of the data overrunning. UART_RXURING
+	// also holds up to 64 KiB already read in its buffers.
+	size_t rxhighwater;
+};
+
+struct UARTStats {
+	size_t rxbytes;  // Bytes read from the device into the input queue
+	size_t txbytes;  // Bytes written to the device
+	size_t rxreads;  // read() calls (or ring reads) that returned data
+	size_t txwrites; // writev() calls, including ones that wrote nothing
+	size_t rxfull;   // Times input stopped at the input queue's high watermark
+	size_t syscalls; // System calls made to move data: reads, writes, waits,
+	                 // io_uring submissions and wakeups of the application
+	size_t rxagain;  // Reads that found nothing waiting
+	size_t txagain;  // Writes the device refused outright (EAGAIN: full)
+	size_t txshort;  // Writes that took only part of what was queued
+	size_t rxpeak;   // Most bytes the input queue has held at once
+	size_t txpeak;   // Most bytes the output queue has held at once
+
+	// Line errors, from the serial driver (TIOCGICOUNT) or the PL011's
+	// data register. Devices that keep no count (pseudo-terminals, most
+	// USB adapters) report 0.
+	size_t overrun;    // Bytes lost because the UART's FIFO was full
+	size_t bufoverrun; // Bytes lost because the kernel's buffer was full
+	size_t parity;     // Bytes received with a parity error
+	size_t framing;    // Bytes received without a valid stop bit
+	size_t breaks;     // Breaks received
+
+	// Seconds since the UART was opened; with the counts above, the
+	// average rates. All counts start from zero at open.
+	double uptime;
+};
+
+// Bins of struct UARTLatency: bin 0 counts latencies under 1 us, bin i
+// those from 2^(i-1) up to 2^i us, and the last bin everything longer
+#define UART_LATENCYBINS 24
+
+struct UARTLatency {
+	size_t   counts[UART_LATENCYBINS];
+	size_t   samples;
+	uint64_t totalns, // Sum of all samples, for the mean
+	         maxns;
+};
+
+// Contents are private to uart.c
+struct UART;
+
 /**
 	Initialize UART functionality.
 	This must be called before calling any other functions in this header!
@@ -24,11 +211,39 @@ typedef enum _UARTParity {
 
 	init_uart_clock=7372800
 
+	baudrate may be any rate the device supports (see uart_getBaudRate()).
+
 	Returns 1 on success, 0 on error.
 	Use uart_getLastError() to get a description of the error.
 */
 int uart_init(int baudrate, UARTParity parity);
 
+/**
+	Fill options with the behaviour of uart_init(): the tty backend,
+	UART_RXSIGNAL, no receive thread affinity or priority, output written
+	at once, no flow control and the whole input queue. Start from this and
+	change only the fields that matter, so fields added later keep their
+	defaults.
+*/
+void uart_defaultOptions(struct UARTOptions *options);
+
+/**
+	Initialize UART functionality on the given serial device (e.g.
+	"/dev/ttyAMA0", "/dev/ttyUSB0"), choosing how received data is
+	collected and when output is written. options is best filled by
+	uart_defaultOptions() first; NULL gives the same behaviour as
+	uart_init().
+
+	Any number of UARTs can use UART_RXTHREAD or UART_RXURING. Those using
+	UART_RXSIGNAL share the process-wide SIGIO handler, which services all
+	of them.
+
+	Returns 1 on success, 0 on error.
+	Use uart_getLastError() to get a description of the error.
+*/
+int uart_initWithOptions(const char *device, int baudrate, UARTParity parity,
+		const struct UARTOptions *options);
+
 /**
 	Properly close UART functionality.
 	This should be called when UART is no longer needed (i.e. the end of
@@ -40,17 +255,26 @@ int uart_init(int baudrate, UARTParity parity);
 int uart_deinit();
 
 /**
-	Write the contents of buffer to UART transmit line, byte-per-byte.
+	Write the contents of buffer to UART transmit line.
 	The size of buffer is assumed to be len bytes.
 
-	Returns 1 on success, 0 on error.
+	The data is copied into an output queue and written to the device
+	without blocking. Anything the device cannot take yet stays queued, and
+	goes out on the next uart_write() or uart_flush(); in UART_RXTHREAD mode
+	the receive thread also writes it as soon as the device has room. In
+	UART_RXURING mode the write is queued on the ring and completes on the
+	receive thread, which starts the next one with whatever has been queued
+	meanwhile.
+
+	Returns the number of bytes accepted, which is less than len only if
+	the output queue is full (or 0 on error).
 */
 int uart_write(const void *buffer, size_t len);
 
 /**
 	Write a single character to UART Tx.
 
-	Returns 1 on success, 0 on error.
+	Returns the number of bytes accepted (1 on success, 0 on error).
 */
 int uart_writeChar(char c);
 
@@ -58,7 +282,7 @@ int uart_writeChar(char c);
   Write the given integer to UART Tx as a 16-bit big-endian integer.
   This function converts from host to BE.
 
-  Returns 1 on success, 0 on error.
+  Returns the number of bytes accepted (2 on success).
 */
 int uart_writeUBE16(uint16_t i);
 
@@ -66,10 +290,47 @@ int uart_writeUBE16(uint16_t i);
   Write the given integer to UART Tx as a 32-bit big-endian integer.
   This function converts from host to BE.
 
-  Returns 1 on success, 0 on error.
+  Returns the number of bytes accepted (4 on success).
 */
 int uart_writeUBE32(uint32_t i);
 
+/**
+	Write count values to UART Tx as 16-bit big-endian integers, converting
+	the whole array from host order in one pass and writing it with a
+	single system call (e.g. a block of 3-axis samples).
+
+	Returns the number of bytes accepted (count * 2 on success).
+*/
+int uart_writeBE16Array(const uint16_t *values, size_t count);
+
+/**
+	Same as uart_writeBE16Array() with 32-bit integers.
+
+	Returns the number of bytes accepted (count * 4 on success).
+*/
+int uart_writeBE32Array(const uint32_t *values, size_t count);
+
+/**
+	Same as uart_writeBE32Array() with IEEE 754 single-precision floats.
+
+	Returns the number of bytes accepted (count * 4 on success).
+*/
+int uart_writeBEFloatArray(const float *values, size_t count);
+
+/**
+	Write queued output to the device.
+
+	timeout is how long to wait for the device to take all of it, in
+	milliseconds: 0 to only write what it takes right away, or -1 to wait
+	until the queue is empty. An empty queue means every byte has been
+	handed to the kernel; use tcdrain() on the device to wait until it has
+	been transmitted.
+
+	Returns the number of bytes still queued (0 once everything has been
+	written), or -1 on error.
+*/
+int uart_flush(int timeout);
+
 /**
 	Read the next len bytes from UART Rx into buffer, byte-per-byte.
 
@@ -79,6 +340,44 @@ int uart_writeUBE32(uint32_t i);
 */
 int uart_read(void *buffer, size_t len);
 
+/**
+	Same as uart_read(), also storing in arrival the CLOCK_MONOTONIC time at
+	which the first byte read was received from the device: when the
+	receive path read() it, not when the application got to it.
+
+	The time is taken once per read() of the device, so bytes that came in
+	together share it. If nothing was read, arrival is set to zero.
+
+	Returns the actual number of bytes read.
+*/
+int uart_readTimestamped(void *buffer, size_t len, struct timespec *arrival);
+
+/**
+	Read up to len bytes into buffer like uart_read(), first sleeping until
+	at least minbytes of them have arrived or timeout milliseconds have
+	passed (-1 to wait as long as it takes, 0 not to wait). The caller is
+	woken as soon as the receive path queues new input; nothing is polled.
+	With minbytes 0, this never waits.
+
+	Bytes are taken as they arrive, so len may be larger than the input
+	queue.
+
+	Returns the number of bytes read, which is less than minbytes only if
+	the timeout passed, or -1 on error.
+*/
+int uart_readTimeout(void *buffer, size_t len, size_t minbytes, int timeout);
+
+/**
+	Sleep until at least minbytes (1 if 0) are in the input queue, or
+	timeout milliseconds have passed (-1 to wait as long as it takes).
+	Nothing is read. minbytes cannot be more than the input queue holds
+	(64 KiB, or its high watermark; see UARTOptions.rxhighwater).
+
+	Returns the number of bytes in the queue, 0 if the timeout passed
+	first, or -1 on error.
+*/
+int uart_waitReadable(size_t minbytes, int timeout);
+
 /**
 	Read the next character from the queue buffer into c.
 
@@ -102,6 +401,44 @@ int uart_readUBE16(uint16_t *i);
 */
 int uart_readUBE32(uint32_t *i);
 
+/**
+	Read the next count 16-bit big-endian integers from the queue buffer
+	into values, converting them to host order.
+
+	Returns 1 on success, 0 on error. Nothing is read unless all count
+	values are available.
+*/
+int uart_readBE16Array(uint16_t *values, size_t count);
+
+/**
+	Same as uart_readBE16Array() with 32-bit integers.
+*/
+int uart_readBE32Array(uint32_t *values, size_t count);
+
+/**
+	Same as uart_readBE32Array() with IEEE 754 single-precision floats.
+*/
+int uart_readBEFloatArray(float *values, size_t count);
+
+/**
+	Describe the bytes at the front of the input queue without removing
+	them, so they can be parsed in place (see qb_peek()). Fills up to
+	iovcnt entries of iov; two are enough for everything queued.
+
+	Returns the number of entries filled; 0 if the queue is empty or UART
+	has not been initialized. The regions stay valid until the next
+	uart_consume() or uart_read().
+*/
+int uart_peek(struct iovec *iov, int iovcnt);
+
+/**
+	Remove the next len bytes from the input queue, typically after
+	parsing them with uart_peek().
+
+	Returns the number of bytes actually removed.
+*/
+size_t uart_consume(size_t len);
+
 /**
 	Get the size of the input queue buffer.
 
@@ -111,6 +448,80 @@ int uart_readUBE32(uint32_t *i);
 */
 int uart_getInputQueueSize();
 
+/**
+	Get the number of bytes accepted by uart_write() that have not been
+	written to the device yet, or -1 if UART has not been initialized.
+*/
+int uart_getOutputQueueSize();
+
+/**
+	Get the baud rate in use, as applied by the kernel. Any rate can be
+	requested: those with a standard B* constant are set through termios,
+	others through termios2 (BOTHER), and the device may round a rate to
+	the nearest its clock can produce.
+
+	Returns the rate, or -1 if UART has not been initialized.
+*/
+int uart_getBaudRate();
+
+/**
+	Get a file descriptor that becomes readable (with poll(), select() or
+	epoll) whenever new data has been added to the input queue buffer, so a
+	consumer can sleep until there is something to read.
+
+	The descriptor is an eventfd: read 8 bytes from it to reset it before
+	reading the queue. It must not be closed by the caller.
+
+	Returns the descriptor, or -1 if UART has not been initialized.
+*/
+int uart_getEventFd();
+
+/**
+	Switch the device to low-latency receive, or back (enable 0).
+
+	On serial drivers that support TIOCSSERIAL this sets ASYNC_LOW_LATENCY,
+	which makes the driver hand over received data immediately instead of
+	batching it (ftdi_sio, for instance, drops its latency timer from 16 ms
+	to 1 ms). The terminal settings are left alone: the device is already
+	reported readable as soon as a byte arrives. Devices without
+	TIOCSSERIAL, such as pseudo-terminals, are left unchanged; that is not
+	an error.
+
+	With UART_BACKENDPL011 the receive thread normally naps between polls
+	once the receive FIFO has stayed empty for a while, for a quarter of the
+	time the FIFO takes to fill. Low latency keeps it polling, only yielding
+	to other threads that want the CPU, so it takes a whole CPU otherwise
+	idle.
+
+	Returns 1 on success, 0 on error.
+*/
+int uart_setLowLatency(int enable);
+
+/**
+	Returns 1 if the serial driver has ASYNC_LOW_LATENCY set, 0 if not or
+	if it does not support TIOCGSERIAL, or -1 if UART has not been
+	initialized.
+*/
+int uart_getLowLatency();
+
+/**
+	Start (enable 1) or stop recording how long received data waits in the
+	input queue: from when the receive path read it from the device (see
+	uart_readTimestamped()) until a read or uart_consume() takes it. Each
+	such call adds one sample, for its first byte, at the cost of one clock
+	read. Starting clears any earlier samples.
+
+	Returns 1 on success, 0 on error.
+*/
+int uart_recordLatency(int enable);
+
+/**
+	Fill latency with the samples recorded since uart_recordLatency(1).
+
+	Returns 1 on success, 0 on error.
+*/
+int uart_getLatency(struct UARTLatency *latency);
+
 /**
 	Returns a string containing a descripiton of the last error. If no error
 	has occurred since the last call to this function, then the string
@@ -118,5 +529,97 @@ int uart_getInputQueueSize();
 */
 char *uart_getLastError();
 
+/**
+	Fill stats with counters for the default UART.
+
+	The counters are kept as data moves, at the cost of a plain increment
+	each; reading them costs at most one ioctl() (for the line errors).
+
+	Returns 1 on success, 0 on error.
+*/
+int uart_getStats(struct UARTStats *stats);
+
+/**
+	Returns the receive mode in use, which is UART_RXTHREAD where
+	UART_RXURING was asked for but io_uring is unavailable (or -1 on error).
+*/
+int uart_getRxMode();
+
+/*
+	Handle API
+
+	Each function below does the same as the uart_* function of the same
+	name without the h, but on the given UART.
+*/
+
+/**
+	Open and configure the serial device at path (e.g. "/dev/ttyAMA0",
+	"/dev/ttyUSB0"), receiving in UART_RXSIGNAL mode.
+
+	Returns a new handle, or NULL on error. Use uart_getLastError() to get a
+	description of the error.
+*/
+struct UART *uart_open(const char *path, int baudrate, UARTParity parity);
+
+/**
+	Same as uart_open(), choosing how received data is collected (see
+	uart_initWithOptions()).
+*/
+struct UART *uart_openWithOptions(const char *path, int baudrate,
+		UARTParity parity, const struct UARTOptions *options);
+
+/**
+	Close a handle from uart_open() and free everything it uses. Queued
+	output is given up to a second to be written first.
+
+	Returns 1 on success, 0 on error (including output being discarded).
+	The handle is freed either way.
+*/
+int uart_close(struct UART *uart);
+
+int uart_hwrite(struct UART *uart, const void *buffer, size_t len);
+int uart_hwriteChar(struct UART *uart, char c);
+int uart_hwriteUBE16(struct UART *uart, uint16_t i);
+int uart_hwriteUBE32(struct UART *uart, uint32_t i);
+int uart_hwriteBE16Array(struct UART *uart, const uint16_t *values,
+		size_t count);
+int uart_hwriteBE32Array(struct UART *uart, const uint32_t *values,
+		size_t count);
+int uart_hwriteBEFloatArray(struct UART *uart, const float *values,
+		size_t count);
+int uart_hflush(struct UART *uart, int timeout);
+
+int uart_hread(struct UART *uart, void *buffer, size_t len);
+int uart_hreadTimestamped(struct UART *uart, void *buffer, size_t len,
+		struct timespec *arrival);
+int uart_hreadTimeout(struct UART *uart, void *buffer, size_t len,
+		size_t minbytes, int timeout);
+int uart_hwaitReadable(struct UART *uart, size_t minbytes, int timeout);
+int uart_hreadChar(struct UART *uart, char *c);
+int uart_hreadUBE16(struct UART *uart, uint16_t *i);
+int uart_hreadUBE32(struct UART *uart, uint32_t *i);
+int uart_hreadBE16Array(struct UART *uart, uint16_t *values, size_t count);
+int uart_hreadBE32Array(struct UART *uart, uint32_t *values, size_t count);
+int uart_hreadBEFloatArray(struct UART *uart, float *values, size_t count);
+int uart_hpeek(struct UART *uart, struct iovec *iov, int iovcnt);
+size_t uart_hconsume(struct UART *uart, size_t len);
+
+int uart_hgetInputQueueSize(struct UART *uart);
+int uart_hgetOutputQueueSize(struct UART *uart);
+int uart_hgetBaudRate(struct UART *uart);
+int uart_hgetEventFd(struct UART *uart);
+int uart_hgetStats(struct UART *uart, struct UARTStats *stats);
+int uart_hgetRxMode(struct UART *uart);
+int uart_hsetLowLatency(struct UART *uart, int enable);
+int uart_hgetLowLatency(struct UART *uart);
+int uart_hrecordLatency(struct UART *uart, int enable);
+int uart_hgetLatency(struct UART *uart, struct UARTLatency *latency);
+
+/**
+	Returns a description of the last error on the given UART, like
+	uart_getLastError().
+*/
+char *uart_hgetLastError(struct UART *uart);
+
 #endif
 
@@ -10,15 +10,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <fcntl.h>
-#include <termios.h>
-#include <unistd.h>
+#include "uart.h"
 
 int main(int argc, char **argv) {
 	int     usbdev = 0,
 	        baudarg = 9600,
 	        parity = 0;
-	speed_t baudrate = B9600;
 	char    devname[64];
 
 	// For the purposes of this program:
@@ -26,54 +23,14 @@ int main(int argc, char **argv) {
 
 	if (argc >= 2)
 		usbdev = atoi(argv[1]);
-	if (argc >= 3) {
+	if (argc >= 3)
 		baudarg = atoi(argv[2]);
-		switch (baudarg) {
-			case 1200:
-				baudrate = B1200;
-				break;
-			case 1800:
-				baudrate = B1800;
-				break;
-			case 2400:
-				baudrate = B2400;
-				break;
-			case 4800:
-				baudrate = B4800;
-				break;
-			case 9600:
-				baudrate = B9600;
-				break;
-			case 19200:
-				baudrate = B19200;
-				break;
-			case 38400:
-				baudrate = B38400;
-				break;
-			case 57600:
-				baudrate = B57600;
-				break;
-			case 115200:
-				baudrate = B115200;
-				break;
-			case 230400:
-				baudrate = B230400;
-				break;
-
-			default:
-				printf("WARNING: unsupported baudrate, using 9600\n");
-				baudarg = 9600;
-				baudrate = B9600;
-				break;
-		}
-	}
 	if (argc >= 4)
 		parity = atoi(argv[3]);
 
 	snprintf(devname, 64, "/dev/ttyUSB%d", usbdev);
 
 	printf("Using %s\n", devname);
-	printf("Using baud rate %d\n", baudarg);
 	if (parity == 0)
 		printf("No parity\n");
 	else if (parity == 1)
@@ -81,49 +38,21 @@ int main(int argc, char **argv) {
 	else
 		printf("Even parity\n");
 
-	// Open USB interface
-	int fd = open(devname, O_RDWR | O_ASYNC);
-	if (fd == -1) {
-		fprintf(stderr, "Could not open %s\n", devname);
+	// Open USB interface. Any baud rate the adapter supports can be used.
+	UARTParity uparity = UART_PAREVEN;
+	if (parity == 0)
+		uparity = UART_PARDISABLE;
+	else if (parity == 1)
+		uparity = UART_PARODD;
+
+	struct UART *uart = uart_open(devname, baudarg, uparity);
+	if (!uart) {
+		fprintf(stderr, "Could not open %s: %s\n", devname,
+				uart_getLastError());
 		return 1;
 	}
 	printf("Opened %s\n", devname);
-
-	// Set terminal properties for /dev/ttyUSBx
-	struct termios tprops;
-	tcgetattr(fd, &tprops);
-
-	tprops.c_iflag = 0;
-	if (parity)
-		tprops.c_iflag |= INPCK;
-
-	tprops.c_oflag = 0;
-
-	tprops.c_cflag = CS8 | CREAD;
-	if (parity) {
-		tprops.c_cflag |= PARENB;
-		if (parity == 1)
-			tprops.c_cflag |= PARODD;
-	}
-
-	tprops.c_lflag = 0;
-
-	// Disable control characaters
-	int cc;
-	for (cc = 0; cc < NCCS; ++cc)
-		tprops.c_cc[cc] = _POSIX_VDISABLE;
-
-	tprops.c_cc[VMIN]  = 0; // No minimum number of characters for reads
-	tprops.c_cc[VTIME] = 0; // No timeout (0 deciseconds)
-
-	// Baud rate
-	cfsetospeed(&tprops, baudrate);
-	cfsetispeed(&tprops, baudrate);
-
-	tcsetattr(fd, TCSAFLUSH, &tprops);
-
-	tcflow(fd, TCOON | TCION);
-	tcflush(fd, TCIOFLUSH);
+	printf("Using baud rate %d\n", uart_hgetBaudRate(uart));
 
 	char inbuffer[50],
 	     outbuffer[50];
@@ -132,7 +61,7 @@ int main(int argc, char **argv) {
 	while (!done) {
 		// Receive
 		printf("Checking for received input\n");
-		while ((bytes = read(fd, inbuffer, 50)) > 0 && !done) {
+		while ((bytes = uart_hread(uart, inbuffer, 50)) > 0 && !done) {
 			char *c;
 			while ((c = memchr(inbuffer, '\r', bytes)) != NULL)
 				*c = '\n';
@@ -152,14 +81,14 @@ int main(int argc, char **argv) {
 			if (outbuffer[strlen(outbuffer) - 1] == '\n')
 				outbuffer[strlen(outbuffer) - 1] = '\r';
 			if (strlen(outbuffer) > 0 && strcmp(outbuffer, "\r") != 0) {
-				write(fd, outbuffer, strlen(outbuffer));
+				uart_hwrite(uart, outbuffer, strlen(outbuffer));
 				printf("Wrote data\n");
 			}
 		}
 	}
 	printf("\n");
 
-	close(fd);
+	uart_close(uart);
 	printf("Closed %s\n", devname);
 
 	return 0;